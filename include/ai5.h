@@ -94,6 +94,17 @@ struct config {
 	bool texthook_stdout;
 	bool no_warp_mouse;
 	bool map_no_wallslide;
+	size_t glyph_cache_size;
+	size_t cg_cache_size;
+	size_t sound_cache_size;
+	unsigned sound_cache_length;
+	unsigned frame_rate;
+	bool vsync;
+	bool frame_stats;
+	bool profile;
+	bool bench;
+	unsigned long bench_statements;
+	unsigned bench_seconds;
 };
 
 extern struct config config;
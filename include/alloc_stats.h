@@ -0,0 +1,52 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef AI5_ALLOC_STATS_H
+#define AI5_ALLOC_STATS_H
+
+/*
+ * Heap allocation counting, enabled with the alloc_stats build option.
+ * alloc_stats.c replaces the C library's allocation functions, so that
+ * allocations made by SDL and FFmpeg are counted too.
+ *
+ * Code which must not allocate (such as the audio callback) is bracketed
+ * with ALLOC_STATS_ENTER_REALTIME/ALLOC_STATS_LEAVE_REALTIME, and
+ * allocations made on that thread in between are counted separately.
+ */
+
+#ifdef ALLOC_STATS
+
+struct alloc_stats {
+	unsigned long allocs;
+	// allocations made in realtime sections
+	unsigned long realtime_allocs;
+};
+
+void alloc_stats(struct alloc_stats *stats);
+void alloc_stats_enter_realtime(void);
+void alloc_stats_leave_realtime(void);
+
+#define ALLOC_STATS_ENTER_REALTIME() alloc_stats_enter_realtime()
+#define ALLOC_STATS_LEAVE_REALTIME() alloc_stats_leave_realtime()
+
+#else
+
+#define ALLOC_STATS_ENTER_REALTIME()
+#define ALLOC_STATS_LEAVE_REALTIME()
+
+#endif // ALLOC_STATS
+
+#endif // AI5_ALLOC_STATS_H
@@ -18,6 +18,8 @@
 #define AI5_ASSET_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 struct archive_data;
 
@@ -37,9 +39,47 @@ void asset_fini(void);
 bool asset_set_voice_archive(const char *name);
 
 struct archive_data *asset_mes_load(const char *name);
+void asset_mes_set_name(const char *name);
 struct archive_data *_asset_cg_load(const char *name);
 struct cg *asset_cg_decode(struct archive_data *file);
 struct cg *asset_cg_load(const char *name);
+void asset_cg_prefetch(const char *name);
+void asset_cg_prefetch_scan(const uint8_t *code, size_t size);
+
+/*
+ * Get the actual path of a file, matching each path component
+ * case-insensitively. Returns NULL if the file doesn't exist.
+ */
+char *asset_path_icase(const char *path);
+// call after creating, renaming or deleting a file
+void asset_path_invalidate(const char *path);
+
+struct asset_path_stats {
+	unsigned long lookups;
+	// lookups of files that don't exist
+	unsigned long misses;
+	// directories listed (including re-listing after changes)
+	unsigned long dir_scans;
+};
+void asset_path_stats(struct asset_path_stats *stats);
+
+struct asset_cg_stats {
+	// found in the CG cache
+	unsigned long hits;
+	// decoded ahead of time by the prefetch thread
+	unsigned long prefetch_hits;
+	// waited for the prefetch thread to finish decoding
+	unsigned long waits;
+	// decoded synchronously
+	unsigned long misses;
+	double wait_ms;
+	double miss_ms;
+	// CG cache state
+	unsigned long evictions;
+	unsigned entries;
+	size_t bytes;
+};
+void asset_cg_stats(struct asset_cg_stats *stats);
 struct archive_data *asset_bgm_load(const char *name);
 struct archive_data *asset_effect_load(const char *name);
 struct archive_data *asset_voice_load(const char *name);
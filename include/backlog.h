@@ -27,5 +27,6 @@ uint32_t backlog_get_pointer(unsigned no);
 bool backlog_has_voice(unsigned no);
 void backlog_set_has_voice(void);
 void backlog_push_byte(uint8_t b);
+void backlog_push_bytes(const uint8_t *b, unsigned n);
 
 #endif // AI5_BACKLOG_H
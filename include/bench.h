@@ -0,0 +1,32 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef AI5_BENCH_H
+#define AI5_BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum input_event_type;
+
+void bench_init(void);
+uint32_t bench_get_ticks(void);
+uint64_t bench_time_us(void);
+void bench_delay(int ms);
+bool bench_input_down(enum input_event_type type);
+void bench_statement(void);
+
+#endif // AI5_BENCH_H
@@ -32,6 +32,21 @@ void gfx_screen_dirty(void);
 void gfx_whole_surface_dirty(unsigned surface);
 bool gfx_is_dirty(unsigned surface);
 void gfx_clean(unsigned surface);
+
+struct gfx_update_stats {
+	unsigned long frames;
+	uint64_t pixels_uploaded;
+	// pixels uploaded for the most recent frame
+	unsigned frame_pixels_uploaded;
+	unsigned frame_rects_uploaded;
+	// time spent converting the screen to the texture format, writing it
+	// to the texture, and presenting
+	uint64_t convert_us;
+	uint64_t upload_us;
+	uint64_t present_us;
+};
+void gfx_update_stats(struct gfx_update_stats *stats);
+void gfx_flush(void);
 void gfx_overlay_enable(void);
 void gfx_overlay_disable(void);
 unsigned gfx_current_surface(void);
@@ -110,8 +125,22 @@ void gfx_text_set_weight(int weight);
 void gfx_text_fill(int x, int y, int w, int h, unsigned i);
 void gfx_text_swap_colors(int x, int y, int w, int h, unsigned i);
 unsigned gfx_text_draw_glyph(int x, int y, unsigned i, uint32_t ch);
+void gfx_text_begin_run(unsigned i);
+void gfx_text_end_run(void);
 unsigned gfx_text_size_char(uint32_t ch);
 
+struct gfx_text_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned glyphs;
+	size_t bytes;
+	// blits into the destination surface, and gfx_dirty calls
+	unsigned long blits;
+	unsigned long dirty_calls;
+};
+void gfx_text_cache_stats(struct gfx_text_cache_stats *stats);
+
 // default: false
 extern bool text_antialias;
 
@@ -0,0 +1,33 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+
+#ifndef AI5_GFX_BLEND_H
+#define AI5_GFX_BLEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// number of bytes in the repeating color pattern for gfx_blend_fill_row
+// (16 RGB24 pixels)
+#define GFX_BLEND_FILL_PATTERN 48
+
+void gfx_blend_row(uint8_t *dst, const uint8_t *bg, const uint8_t *fg, const uint16_t *w,
+		size_t n);
+void gfx_blend_fill_row(uint8_t *p, const uint16_t fg_w[GFX_BLEND_FILL_PATTERN],
+		uint16_t bg_w, size_t n);
+
+#endif // AI5_GFX_BLEND_H
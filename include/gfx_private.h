@@ -20,6 +20,7 @@
 #include <SDL.h>
 
 #include "gfx.h"
+#include "gfx_blend.h"
 
 #define SDL_CALL(f, ...) if (f(__VA_ARGS__) < 0) { ERROR(#f ": %s", SDL_GetError()); }
 #define SDL_CTOR(f, dst, ...) if (!(dst = f(__VA_ARGS__))) { ERROR(#f ": %s", SDL_GetError()); }
@@ -36,13 +37,21 @@
 #define GFX_DIRECT_BPP 24
 #define GFX_DIRECT_FORMAT SDL_PIXELFORMAT_RGB24
 
+// maximum number of damaged rectangles tracked per surface; above this the
+// whole surface is considered damaged
+#define GFX_MAX_DAMAGED 8
+
 struct gfx_surface {
 	SDL_Surface *s;
 	SDL_Rect src;   // source rectangle for BlitScaled
 	SDL_Rect dst;   // destination rectangle for BlitScaled
 	bool scaled;    // if true, `src` and `rect` differ
 	bool dirty;
-	SDL_Rect damaged;
+	// list of disjoint damaged rectangles
+	unsigned nr_damaged;
+	SDL_Rect damaged[GFX_MAX_DAMAGED];
+	// incremented whenever the surface is dirtied
+	uint32_t generation;
 };
 
 struct gfx {
@@ -61,6 +70,8 @@ struct gfx {
 	SDL_Surface *scaled_display;
 	SDL_Surface *overlay;
 	SDL_Texture *texture;
+	// the final frame of the last fade out, until something else is shown
+	SDL_Texture *fade_mask;
 	SDL_Color palette[256];
 	struct {
 		uint32_t bg;
@@ -74,6 +85,7 @@ struct gfx {
 extern struct gfx gfx;
 
 SDL_Surface *gfx_get_surface(unsigned i);
+uint32_t gfx_surface_generation(unsigned surface);
 SDL_Surface *gfx_get_overlay(void);
 void gfx_update_palette(int n);
 bool gfx_fill_clip(SDL_Surface *s, SDL_Rect *r);
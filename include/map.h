@@ -52,6 +52,24 @@ enum map_diagonal {
 	MAP_DOWN_RIGHT = 7,
 };
 
+struct map_draw_stats {
+	unsigned long frames;
+	unsigned long full_redraws;
+	unsigned long scrolls;
+	uint64_t tiles_blitted;
+	uint64_t bytes_dirtied;
+	// tiles blitted/bytes dirtied by the last frame
+	unsigned frame_tiles_blitted;
+	unsigned frame_bytes_dirtied;
+};
+
+struct map_path_stats {
+	unsigned long searches;
+	unsigned long failures;
+	uint64_t nodes_expanded;
+	uint64_t time_us;
+};
+
 void map_load_bitmap(const char *name, unsigned col, unsigned row, unsigned which);
 void map_load_palette(const char *name, unsigned which);
 void map_load_tilemap(void);
@@ -72,5 +90,7 @@ void map_stop_pathing(void);
 void map_get_pathing(void);
 void map_set_location_mode(enum map_location_mode mode);
 void map_get_location(void);
+void map_draw_stats(struct map_draw_stats *stats);
+void map_path_stats(struct map_path_stats *stats);
 
 #endif // AI5_SDL2_MAP_H
@@ -18,6 +18,8 @@
 #define AI5_MIXER_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 enum mix_channel {
 	MIXER_MUSIC = 0,
@@ -42,6 +44,39 @@ int mixer_set_mute(int n, int mute);
 struct archive_data;
 struct mixer_stream;
 
+struct mixer_stream_stats {
+	// number of times the audio callback ran out of decoded audio
+	unsigned long underruns;
+	uint64_t frames_decoded;
+	// frames decoded on the main thread when starting or seeking streams
+	uint64_t frames_primed;
+	// number of open streams
+	unsigned streams;
+	// capacity of each stream's decode-ahead buffer, in frames
+	unsigned ring_frames;
+	// lowest fill level seen by the audio callback, in frames
+	unsigned min_fill;
+	// current lowest fill level among playing streams, in frames
+	unsigned fill;
+};
+
+void mixer_stream_stats(struct mixer_stream_stats *stats);
+
+struct mixer_sound_cache_stats {
+	unsigned long hits;
+	// sounds decoded into the cache
+	unsigned long misses;
+	unsigned long evictions;
+	// time spent decoding sounds into the cache
+	double decode_ms;
+	// decode time saved by cache hits
+	double saved_ms;
+	unsigned entries;
+	size_t bytes;
+};
+
+void mixer_sound_cache_stats(struct mixer_sound_cache_stats *stats);
+
 struct mixer_stream *mixer_stream_open(struct archive_data *dfile, enum mix_channel mixer);
 void mixer_stream_close(struct mixer_stream *ch);
 int mixer_stream_play(struct mixer_stream *ch);
@@ -67,6 +102,11 @@ int mixer_stream_reverse_LR(struct mixer_stream *ch);
 int mixer_stream_get_volume(struct mixer_stream *ch);
 int mixer_stream_get_time_length(struct mixer_stream *ch);
 
+// audio_mix.c
+void mixer_accumulate(float *acc, const float *src, float gain, size_t n);
+void mixer_gain_clamp(float *dst, const float *src, float gain, size_t n);
+void mixer_swap_stereo(float *buf, size_t frames);
+
 struct sts_mixer_stream_t;
 int mixer_sts_stream_play(struct sts_mixer_stream_t* stream, int volume);
 bool mixer_sts_stream_set_volume(int voice, int volume);
@@ -22,6 +22,27 @@
 struct movie_context;
 struct archive_data;
 
+struct movie_stats {
+	unsigned long frames_displayed;
+	// frames skipped because a newer frame was already due
+	unsigned long frames_dropped;
+	// frames displayed more than a frame period after their timestamp
+	unsigned long frames_late;
+	// number of times the audio callback ran out of decoded audio
+	unsigned long audio_underruns;
+	// queue depths summed over displayed frames
+	unsigned long video_frames_queued;
+	unsigned long video_packets_queued;
+	unsigned long audio_packets_queued;
+	// time spent converting frames to RGBA (sws path only)
+	unsigned long frames_converted;
+	uint64_t convert_us;
+	// time spent uploading displayed frames to the texture
+	uint64_t upload_us;
+};
+
+void movie_stats(struct movie_stats *stats);
+
 struct movie_context *movie_load(const char *movie_path, const char *audio_path, int w, int h);
 struct movie_context *movie_load_arc(struct archive_data *movie, struct archive_data *audio, int w, int h);
 void movie_free(struct movie_context *mc);
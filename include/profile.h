@@ -0,0 +1,59 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef AI5_PROFILE_H
+#define AI5_PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum profile_category {
+	PROFILE_STMT,
+	PROFILE_EXPR,
+	PROFILE_SYS,
+	PROFILE_UTIL,
+	PROFILE_NR_CATEGORIES
+};
+
+// pseudo statement opcode for text (TXT/STR without an opcode)
+#define PROFILE_STMT_TEXT 256
+
+extern bool vm_profile_enabled;
+
+void profile_init(void);
+void profile_enable(bool enable);
+void profile_reset(void);
+void profile_print(void);
+uint64_t profile_start(void);
+void profile_end(enum profile_category cat, unsigned no, uint64_t start);
+void profile_set_mes(const char *name);
+
+/*
+ * Call `call`, recording its call count and (inclusive) wall time when the
+ * profiler is enabled. When disabled this costs a single branch.
+ */
+#define PROFILE_CALL(cat, no, call) \
+	do { \
+		if (unlikely(vm_profile_enabled)) { \
+			uint64_t _profile_t = profile_start(); \
+			call; \
+			profile_end(cat, no, _profile_t); \
+		} else { \
+			call; \
+		} \
+	} while (0)
+
+#endif // AI5_PROFILE_H
@@ -29,6 +29,45 @@ void savedata_read(const char *save_name, uint8_t *buf, uint32_t off, size_t siz
  */
 void savedata_write(const char *save_name, const uint8_t *buf, uint32_t off, size_t size);
 
+/*
+ * Queue modified save files to be written back to disk. This happens
+ * automatically shortly after a change (see savedata_update) and at exit,
+ * where the queue is also drained.
+ */
+void savedata_sync(void);
+
+/*
+ * Write modified save files back to disk if they have been modified for long
+ * enough. Called periodically from the VM.
+ */
+void savedata_update(void);
+
+#define SAVEDATA_QUEUE_BUCKETS 6
+#define SAVEDATA_LATENCY_BUCKETS 12
+
+struct savedata_stats {
+	// savedata_read/savedata_write calls
+	unsigned long operations;
+	// save files read from disk
+	unsigned long loads;
+	// save files written back to disk
+	unsigned long flushes;
+	// failed attempts to write a save file (the file is retried later)
+	unsigned long write_failures;
+	// file system calls (lookups, opens, reads, writes, syncs, renames)
+	unsigned long io_calls;
+	// writes dropped because a newer image of the same file was queued
+	unsigned long coalesced;
+	// Histograms; bucket i counts values below 2^i, and the last bucket
+	// counts everything else. Queue depth is the number of writes already
+	// queued when a write is queued; latency is the time in ms from
+	// queueing a write to finishing it.
+	unsigned long queue_depth[SAVEDATA_QUEUE_BUCKETS];
+	unsigned long write_latency[SAVEDATA_LATENCY_BUCKETS];
+};
+
+void savedata_stats(struct savedata_stats *stats);
+
 void savedata_resume_load(const char *save_name);
 void savedata_resume_save(const char *save_name);
 void savedata_load(const char *save_name);
@@ -159,6 +159,8 @@ void sts_mixer_mix_audio(sts_mixer_t* mixer, void* output, unsigned int samples)
 ////
 #ifdef STS_MIXER_IMPLEMENTATION
 
+#include <string.h>
+
 enum {
   STS_MIXER_VOICE_STOPPED,
   STS_MIXER_VOICE_PLAYING,
@@ -307,6 +309,101 @@ void sts_mixer_stop_stream(sts_mixer_t* mixer, sts_mixer_stream_t* stream) {
 }
 
 
+// ai5-sdl2 change: float output is mixed a voice at a time, a block at a time. Each
+// voice is accumulated into the block in the same order as the per-sample loop below,
+// so the result is identical; but runs of stream data at the mixer's frequency can be
+// mixed with faster kernels. To use them, define STS_MIXER_ACCUMULATE and
+// STS_MIXER_GAIN_CLAMP (with the signatures of the scalar kernels below) before
+// including the implementation.
+#define STS_MIXER_BLOCK 1024
+
+// acc[i] += clamp(src[i] * gain)
+static inline void sts_mixer__accumulate(float* acc, const float* src, float gain, size_t n) {
+  size_t i;
+  for (i = 0; i < n; ++i) acc[i] += sts_mixer__clamp_sample(src[i] * gain);
+}
+
+// dst[i] = clamp(src[i] * gain)
+static inline void sts_mixer__gain_clamp(float* dst, const float* src, float gain, size_t n) {
+  size_t i;
+  for (i = 0; i < n; ++i) dst[i] = sts_mixer__clamp_sample(src[i] * gain);
+}
+
+#ifndef STS_MIXER_ACCUMULATE
+#define STS_MIXER_ACCUMULATE sts_mixer__accumulate
+#endif
+#ifndef STS_MIXER_GAIN_CLAMP
+#define STS_MIXER_GAIN_CLAMP sts_mixer__gain_clamp
+#endif
+
+static void sts_mixer__mix_voice_float(sts_mixer_t* mixer, int i, float* acc, unsigned int samples, float advance) {
+  sts_mixer_voice_t*  voice = &mixer->voices[i];
+  unsigned int        j = 0, position, n;
+  float               sample, step;
+
+  if (voice->state == STS_MIXER_VOICE_PLAYING) {
+    for (; j < samples; ++j) {
+      position = (int)voice->position;
+      if (position >= voice->sample->length) {
+        sts_mixer__reset_voice(mixer, i);
+        return;
+      }
+      sample = sts_mixer__clamp_sample(sts_mixer__get_sample(voice->sample, position) * voice->gain);
+      acc[j*2] += sts_mixer__clamp_sample(sample * (0.5f - voice->pan));
+      acc[j*2+1] += sts_mixer__clamp_sample(sample * (0.5f + voice->pan));
+      voice->position += (float)voice->sample->frequency * advance * voice->pitch;
+    }
+  } else if (voice->state == STS_MIXER_VOICE_STREAMING) {
+    step = (float)voice->stream->sample.frequency * advance;
+    while (j < samples) {
+      position = ((int)voice->position) * 2;
+      if (position >= voice->stream->sample.length) {
+        // buffer empty...refill
+        int status = voice->stream->callback(&voice->stream->sample, voice->stream->userdata);
+        voice->position = 0.0f;
+        position = 0;
+        if (status == STS_STREAM_COMPLETE) {
+          sts_mixer_stop_voice(mixer, i);
+          return;
+        }
+      }
+      n = (voice->stream->sample.length - position) / 2;
+      if (step == 1.0f && n > 0 && voice->stream->sample.audio_format == STS_MIXER_SAMPLE_FORMAT_FLOAT) {
+        // the position advances by exactly one frame per sample: mix the whole run
+        if (n > samples - j) n = samples - j;
+        STS_MIXER_ACCUMULATE(acc + j*2, (float*)voice->stream->sample.data + position, voice->gain, n * 2);
+        voice->position += (float)n;
+        j += n;
+      } else {
+        acc[j*2] += sts_mixer__clamp_sample(sts_mixer__get_sample(&voice->stream->sample, position) * voice->gain);
+        acc[j*2+1] += sts_mixer__clamp_sample(sts_mixer__get_sample(&voice->stream->sample, position + 1) * voice->gain);
+        voice->position += step;
+        ++j;
+      }
+    }
+  }
+}
+
+
+static void sts_mixer__mix_audio_float(sts_mixer_t* mixer, float* output, unsigned int samples) {
+  float               acc[STS_MIXER_BLOCK * 2];
+  float               advance = 1.0f / (float)mixer->frequency;
+  unsigned int        n;
+  int                 i;
+
+  while (samples > 0) {
+    n = samples < STS_MIXER_BLOCK ? samples : STS_MIXER_BLOCK;
+    memset(acc, 0, n * 2 * sizeof(float));
+    for (i = 0; i < STS_MIXER_VOICES; ++i) {
+      sts_mixer__mix_voice_float(mixer, i, acc, n, advance);
+    }
+    STS_MIXER_GAIN_CLAMP(output, acc, mixer->gain, n * 2);
+    output += n * 2;
+    samples -= n;
+  }
+}
+
+
 void sts_mixer_mix_audio(sts_mixer_t* mixer, void* output, unsigned int samples) {
   sts_mixer_voice_t*  voice;
   unsigned int        i, position;
@@ -316,6 +413,11 @@ void sts_mixer_mix_audio(sts_mixer_t* mixer, void* output, unsigned int samples)
   int*                out_32 = (int*)output;
   float*              out_float = (float*)output;
 
+  if (mixer->audio_format == STS_MIXER_SAMPLE_FORMAT_FLOAT) {
+    sts_mixer__mix_audio_float(mixer, out_float, samples);
+    return;
+  }
+
   // mix all voices
   advance = 1.0f / (float)mixer->frequency;
   for (; samples > 0; --samples) {
@@ -55,6 +55,21 @@ struct vm {
 };
 extern struct vm vm;
 
+struct vm_stats {
+	unsigned long statements;
+	// MES files loaded from the archive/filesystem
+	unsigned long mes_loads;
+	// MES files loaded from the MES cache
+	unsigned long mes_cache_hits;
+	// cache hits where the file was still intact in memory
+	unsigned long mes_copies_skipped;
+	// text bytes read, and performance counter ticks spent reading them,
+	// indexed by whether the bytes were copied to the backlog (bench only)
+	unsigned long long text_bytes[2];
+	uint64_t text_ticks[2];
+};
+extern struct vm_stats vm_stats;
+
 _Noreturn void _vm_error(const char *file, const char *func, int line, const char *fmt, ...);
 #define VM_ERROR(fmt, ...) _vm_error(__FILE__, __func__, __LINE__, fmt "\n", ##__VA_ARGS__)
 
@@ -63,6 +78,7 @@ void vm_exec(void);
 void vm_peek(void);
 void vm_load_file(struct archive_data *file, uint32_t offset);
 void vm_load_mes(char *name);
+void vm_cg_lookahead(void);
 void vm_call_procedure(unsigned no);
 
 // generic stack operations
@@ -0,0 +1,108 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Counting wrappers for the allocation functions. Definitions in the
+ * executable take precedence over the C library's for every library loaded
+ * by the program, so this also counts allocations made by SDL and FFmpeg
+ * (av_malloc uses posix_memalign). The wrappers call glibc's internal
+ * entry points, so this is only supported with glibc.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "alloc_stats.h"
+
+#ifndef __GLIBC__
+#error "alloc_stats requires glibc"
+#endif
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+static atomic_ulong allocs;
+static atomic_ulong realtime_allocs;
+static _Thread_local unsigned realtime_depth;
+
+static void count_alloc(void)
+{
+	atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+	if (realtime_depth)
+		atomic_fetch_add_explicit(&realtime_allocs, 1, memory_order_relaxed);
+}
+
+void *malloc(size_t size)
+{
+	count_alloc();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	count_alloc();
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (size)
+		count_alloc();
+	return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	count_alloc();
+	return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	count_alloc();
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+	if (!alignment || (alignment & (alignment - 1)) || alignment % sizeof(void*))
+		return EINVAL;
+	count_alloc();
+	void *p = __libc_memalign(alignment, size);
+	if (!p)
+		return ENOMEM;
+	*ptr = p;
+	return 0;
+}
+
+void alloc_stats(struct alloc_stats *stats)
+{
+	stats->allocs = atomic_load(&allocs);
+	stats->realtime_allocs = atomic_load(&realtime_allocs);
+}
+
+void alloc_stats_enter_realtime(void)
+{
+	realtime_depth++;
+}
+
+void alloc_stats_leave_realtime(void)
+{
+	realtime_depth--;
+}
@@ -14,9 +14,18 @@
  * along with this program; if not, see <http://gnu.org/licenses/>.
  */
 
+#include <ctype.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+#include <SDL.h>
+
 #include "nulib.h"
 #include "nulib/file.h"
 #include "nulib/queue.h"
+#include "nulib/vector.h"
 #include "ai5/arc.h"
 #include "ai5/cg.h"
 
@@ -46,10 +55,252 @@ char *asset_data_name = NULL;
 bool asset_effect_is_bgm = true;
 
 static void cg_cache_init(void);
+static void cg_prefetch_init(void);
+
+// FNV-1a hash of the case-folded string
+static uint32_t name_hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+	for (; *s; s++) {
+		h = (h ^ (uint8_t)tolower((uint8_t)*s)) * 16777619u;
+	}
+	return h;
+}
+
+static uint32_t name_hash_n(const char *s, size_t n)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < n; i++) {
+		h = (h ^ (uint8_t)tolower((uint8_t)s[i])) * 16777619u;
+	}
+	return h;
+}
+
+/*
+ * Case-insensitive path lookup. Each directory is listed once, and its entries
+ * are kept in an open addressing hash table keyed on the case-folded name. A
+ * directory is listed again when a lookup misses and the directory may have
+ * changed since it was listed: its modification time differs, it was modified
+ * in the same second that it was listed, or it was invalidated after a write.
+ *
+ * On Windows the file system is case-insensitive already, so lookups go
+ * straight to path_get_icase.
+ */
+struct dir_entry {
+	uint32_t hash;
+	char *name;
+};
+
+struct dir_index {
+	// resolved path of the directory ("" for the working directory)
+	char *path;
+	struct dir_entry *table;
+	unsigned table_bits;
+	unsigned nr_entries;
+	time_t mtime;
+	time_t listed;
+	bool stale;
+};
+
+#define DIR_INDEX_MIN_BITS 5
+
+static vector_t(struct dir_index*) dir_indices = vector_initializer;
+static struct asset_path_stats path_stats = {0};
+
+void asset_path_stats(struct asset_path_stats *stats)
+{
+	*stats = path_stats;
+}
+
+#ifndef _WIN32
+static void dir_index_clear(struct dir_index *dir)
+{
+	if (!dir->table)
+		return;
+	for (unsigned i = 0; i < (1u << dir->table_bits); i++) {
+		free(dir->table[i].name);
+	}
+	free(dir->table);
+	dir->table = NULL;
+	dir->nr_entries = 0;
+}
+
+static void dir_index_insert(struct dir_index *dir, char *name)
+{
+	// keep the load factor below 1/2
+	if ((dir->nr_entries + 1) * 2 > (1u << dir->table_bits)) {
+		struct dir_entry *old = dir->table;
+		unsigned old_size = 1u << dir->table_bits;
+		dir->table_bits++;
+		dir->table = xcalloc(1u << dir->table_bits, sizeof(struct dir_entry));
+		dir->nr_entries = 0;
+		for (unsigned i = 0; i < old_size; i++) {
+			if (old[i].name)
+				dir_index_insert(dir, old[i].name);
+		}
+		free(old);
+	}
+
+	const unsigned mask = (1u << dir->table_bits) - 1;
+	uint32_t hash = name_hash(name);
+	unsigned i = hash & mask;
+	while (dir->table[i].name)
+		i = (i + 1) & mask;
+	dir->table[i] = (struct dir_entry) { hash, name };
+	dir->nr_entries++;
+}
+
+static bool dir_index_list(struct dir_index *dir)
+{
+	const char *path = dir->path[0] ? dir->path : ".";
+	path_stats.dir_scans++;
+
+	struct stat st;
+	DIR *d;
+	if (stat(path, &st) || !(d = opendir(path)))
+		return false;
+
+	dir_index_clear(dir);
+	dir->table_bits = DIR_INDEX_MIN_BITS;
+	dir->table = xcalloc(1u << dir->table_bits, sizeof(struct dir_entry));
+	struct dirent *e;
+	while ((e = readdir(d))) {
+		if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+			continue;
+		dir_index_insert(dir, xstrdup(e->d_name));
+	}
+	closedir(d);
+
+	dir->mtime = st.st_mtime;
+	dir->listed = time(NULL);
+	dir->stale = false;
+	return true;
+}
+
+static bool dir_index_may_have_changed(struct dir_index *dir)
+{
+	if (dir->stale || dir->listed <= dir->mtime)
+		return true;
+	struct stat st;
+	if (stat(dir->path[0] ? dir->path : ".", &st))
+		return true;
+	return st.st_mtime != dir->mtime;
+}
+
+// returns the actual name of the entry matching `name` (of length `len`)
+static const char *dir_index_find(struct dir_index *dir, const char *name, size_t len)
+{
+	if (!dir->table)
+		return NULL;
+	const unsigned mask = (1u << dir->table_bits) - 1;
+	uint32_t hash = name_hash_n(name, len);
+	const char *found = NULL;
+	for (unsigned i = hash & mask; dir->table[i].name; i = (i + 1) & mask) {
+		struct dir_entry *e = &dir->table[i];
+		if (e->hash != hash || strlen(e->name) != len || strncasecmp(e->name, name, len))
+			continue;
+		// prefer an exact match if several entries differ only in case
+		if (!strncmp(e->name, name, len))
+			return e->name;
+		if (!found)
+			found = e->name;
+	}
+	return found;
+}
+
+static struct dir_index *dir_index_get(const char *path)
+{
+	struct dir_index *dir;
+	vector_foreach(dir, dir_indices) {
+		if (!strcmp(dir->path, path))
+			return dir;
+	}
+	dir = xcalloc(1, sizeof(struct dir_index));
+	dir->path = xstrdup(path);
+	vector_push(struct dir_index*, dir_indices, dir);
+	if (!dir_index_list(dir))
+		dir->stale = true;
+	return dir;
+}
+
+void asset_path_invalidate(const char *path)
+{
+	// invalidate the directory containing `path`
+	const char *sep = strrchr(path, '/');
+	size_t len = sep ? sep - path : 0;
+	char *dir_path = xmalloc(len + 1);
+	memcpy(dir_path, path, len);
+	dir_path[len] = '\0';
+	struct dir_index *dir;
+	vector_foreach(dir, dir_indices) {
+		if (!strcasecmp(dir->path, dir_path))
+			dir->stale = true;
+	}
+	free(dir_path);
+}
+
+char *asset_path_icase(const char *path)
+{
+	path_stats.lookups++;
+
+	// resolve the path one component at a time
+	size_t path_len = strlen(path);
+	char *resolved = xmalloc(path_len + 1);
+	size_t n = 0;
+	const char *p = path;
+	if (*p == '/') {
+		resolved[n++] = '/';
+		while (*p == '/')
+			p++;
+	}
+	resolved[n] = '\0';
+
+	while (*p) {
+		const char *end = p;
+		while (*end && *end != '/')
+			end++;
+		size_t len = end - p;
+		const char *name;
+		if ((len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.')) {
+			name = p;
+		} else {
+			struct dir_index *dir = dir_index_get(resolved);
+			if (!(name = dir_index_find(dir, p, len))) {
+				if (!dir_index_may_have_changed(dir) || !dir_index_list(dir)
+						|| !(name = dir_index_find(dir, p, len))) {
+					path_stats.misses++;
+					free(resolved);
+					return NULL;
+				}
+			}
+		}
+		if (n && resolved[n-1] != '/')
+			resolved[n++] = '/';
+		memcpy(resolved + n, name, len);
+		n += len;
+		resolved[n] = '\0';
+
+		p = end;
+		while (*p == '/')
+			p++;
+	}
+	return resolved;
+}
+#else
+void asset_path_invalidate(const char *path)
+{
+}
+
+char *asset_path_icase(const char *path)
+{
+	path_stats.lookups++;
+	return path_get_icase(path);
+}
+#endif
 
 static struct archive *open_arc(const char *name, unsigned flags)
 {
-	char *path = path_get_icase(name);
+	char *path = asset_path_icase(name);
 	if (!path)
 		return NULL;
 	struct archive *arc = archive_open(path, flags);
@@ -83,10 +334,33 @@ void asset_init(void)
 	ARC_OPEN(priv,     typ_flags,  WARNING);
 #undef ARC_OPEN
 	cg_cache_init();
+	cg_prefetch_init();
 }
 
+/*
+ * Voice archives switched to by the game. These stay open until exit, so an
+ * archive pointer always identifies the same archive (the sound cache relies
+ * on this), and switching back doesn't re-read the archive index.
+ */
+struct voice_archive {
+	char *name;
+	struct archive *ar;
+};
+static vector_t(struct voice_archive) voice_archives = vector_initializer;
+
 void asset_fini(void)
 {
+	// arc.voice is one of these, if the game switched voice archives
+	struct voice_archive *v;
+	vector_foreach_p(v, voice_archives) {
+		archive_close(v->ar);
+		free(v->name);
+	}
+	if (vector_length(voice_archives) > 0)
+		arc.voice = NULL;
+	vector_destroy(voice_archives);
+	vector_init(voice_archives);
+
 #define ARC_CLOSE(t) if (arc.t) { archive_close(arc.t); arc.t = NULL; }
 	ARC_CLOSE(bg);
 	ARC_CLOSE(mes);
@@ -104,11 +378,25 @@ bool asset_set_voice_archive(const char *name)
 	if (config.file.voice.arc && !strcasecmp(config.file.voice.name, name))
 		return true;
 
-	struct archive *ar = open_arc(name, 0);
-	if (!ar)
-		return false;
-	if (arc.voice)
-		archive_close(arc.voice);
+	if (arc.voice && vector_length(voice_archives) == 0) {
+		struct voice_archive cur = { xstrdup(config.file.voice.name), arc.voice };
+		vector_push(struct voice_archive, voice_archives, cur);
+	}
+
+	struct archive *ar = NULL;
+	struct voice_archive *v;
+	vector_foreach_p(v, voice_archives) {
+		if (!strcasecmp(v->name, name)) {
+			ar = v->ar;
+			break;
+		}
+	}
+	if (!ar) {
+		if (!(ar = open_arc(name, 0)))
+			return false;
+		struct voice_archive new = { xstrdup(name), ar };
+		vector_push(struct voice_archive, voice_archives, new);
+	}
 	arc.voice = ar;
 	config.file.voice.arc = true;
 	string_free(config.file.voice.name);
@@ -116,6 +404,61 @@ bool asset_set_voice_archive(const char *name)
 	return true;
 }
 
+/*
+ * Paths of files loaded from the file system. The path is used as the name of
+ * the file's archive_data, so it must live for the rest of the program. Each
+ * path is stored once.
+ */
+static struct {
+	char **table;
+	unsigned table_bits;
+	unsigned nr_entries;
+} fs_names = {0};
+
+#define FS_NAMES_MIN_BITS 6
+
+static void fs_names_insert(char *path)
+{
+	unsigned mask = (1u << fs_names.table_bits) - 1;
+	unsigned i = name_hash(path) & mask;
+	while (fs_names.table[i])
+		i = (i + 1) & mask;
+	fs_names.table[i] = path;
+}
+
+// takes ownership of `path`
+static char *fs_name_intern(char *path)
+{
+	if (!fs_names.table) {
+		fs_names.table_bits = FS_NAMES_MIN_BITS;
+		fs_names.table = xcalloc(1u << fs_names.table_bits, sizeof(char*));
+	}
+
+	unsigned mask = (1u << fs_names.table_bits) - 1;
+	for (unsigned i = name_hash(path) & mask; fs_names.table[i]; i = (i + 1) & mask) {
+		if (!strcmp(fs_names.table[i], path)) {
+			free(path);
+			return fs_names.table[i];
+		}
+	}
+
+	// grow at 50% load
+	if ((fs_names.nr_entries + 1) * 2 > (1u << fs_names.table_bits)) {
+		char **old = fs_names.table;
+		unsigned old_size = 1u << fs_names.table_bits;
+		fs_names.table_bits++;
+		fs_names.table = xcalloc(1u << fs_names.table_bits, sizeof(char*));
+		for (unsigned i = 0; i < old_size; i++) {
+			if (old[i])
+				fs_names_insert(old[i]);
+		}
+		free(old);
+	}
+	fs_names_insert(path);
+	fs_names.nr_entries++;
+	return path;
+}
+
 struct archive_data *asset_fs_load(const char *_name)
 {
 	// convert to *nix path
@@ -126,14 +469,14 @@ struct archive_data *asset_fs_load(const char *_name)
 	}
 
 	// get case-insensitive path
-	char *path = path_get_icase(name);
+	char *path = asset_path_icase(name);
 	// XXX: hack for YU-NO Eng TL: load .ogg file if .wav not found
 	if (!path && !strcasecmp(file_extension(name), "wav")) {
 		char *ext = (char*)file_extension(name);
 		ext[0] = 'o';
 		ext[1] = 'g';
 		ext[2] = 'g';
-		path = path_get_icase(name);
+		path = asset_path_icase(name);
 	}
 	free(name);
 	if (!path)
@@ -142,14 +485,15 @@ struct archive_data *asset_fs_load(const char *_name)
 	// read data
 	size_t size;
 	uint8_t *data = file_read(path, &size);
-	free(path);
-	if (!data)
+	if (!data) {
+		free(path);
 		return NULL;
+	}
 
 	// create fake archive_data
 	struct archive_data *file = xcalloc(1, sizeof(struct archive_data));
 	file->size = size;
-	file->name = "<none>";
+	file->name = fs_name_intern(path);
 	file->data = data;
 	file->ref = 1;
 	file->allocated = true;
@@ -163,30 +507,46 @@ struct archive_data *asset_mes_load(const char *name)
 	struct archive_data *file = archive_get(arc.mes, name);
 	if (!file)
 		return NULL;
+	asset_mes_set_name(name);
+	return file;
+}
+
+void asset_mes_set_name(const char *name)
+{
 	free(asset_mes_name);
 	asset_mes_name = xstrdup(name);
-	return file;
 }
 
+/*
+ * CG cache. Entries are indexed by an open addressing hash table keyed on the
+ * case-folded file name, and kept in an LRU list. The cache is bounded by the
+ * (approximate) number of bytes used by the decoded CGs.
+ */
 struct cached_cg {
 	TAILQ_ENTRY(cached_cg) entry;
-	unsigned key;
-	const char *name;
+	uint32_t hash;
+	char *name;
 	struct cg *cg;
+	size_t size;
 };
 
-#define CG_CACHE_SIZE 16
-static struct cached_cg cg_cache_entry[CG_CACHE_SIZE] = {0};
-static TAILQ_HEAD(cg_cache_head, cached_cg) cg_cache;
-static TAILQ_HEAD(cg_freelist_head, cached_cg) cg_free_list;
+#define CG_CACHE_MIN_BITS 6
+
+static struct {
+	struct cached_cg **table;
+	unsigned table_bits;
+	unsigned nr_entries;
+	size_t bytes;
+	TAILQ_HEAD(cg_cache_head, cached_cg) lru;
+} cg_cache = {0};
+
+static struct asset_cg_stats cg_stats = {0};
 
 static void cg_cache_init(void)
 {
-	TAILQ_INIT(&cg_cache);
-	TAILQ_INIT(&cg_free_list);
-	for (int i = 0; i < CG_CACHE_SIZE; i++) {
-		TAILQ_INSERT_TAIL(&cg_free_list, &cg_cache_entry[i], entry);
-	}
+	TAILQ_INIT(&cg_cache.lru);
+	cg_cache.table_bits = CG_CACHE_MIN_BITS;
+	cg_cache.table = xcalloc(1u << cg_cache.table_bits, sizeof(struct cached_cg*));
 }
 
 struct archive_data *_asset_cg_load(const char *name)
@@ -201,63 +561,397 @@ struct archive_data *_asset_cg_load(const char *name)
 	return file;
 }
 
-static uint64_t cg_name_hash(const char *s)
+static size_t cg_size(struct cg *cg)
 {
-	uint16_t h = (uint64_t)*s;
-	if (h) for (++s ; *s; ++s) h = (h << 5) - h + (khint_t)*s;
-	return h;
+	size_t size = sizeof(struct cg) + (cg->palette ? 256 * 4 : 0);
+	return size + cg->metrics.w * cg->metrics.h * (cg->metrics.bpp <= 8 ? 1 : 4);
 }
 
-static struct cg *cg_cache_get(const char *name, uint64_t key)
+static unsigned cg_cache_slot(uint32_t hash)
 {
-	for (int i = 0; i < CG_CACHE_SIZE; i++) {
-		if (!cg_cache_entry[i].name)
-			continue;
-		if (cg_cache_entry[i].key == key && !strcasecmp(cg_cache_entry[i].name, name)) {
-			// move to front of cache
-			TAILQ_REMOVE(&cg_cache, &cg_cache_entry[i], entry);
-			TAILQ_INSERT_HEAD(&cg_cache, &cg_cache_entry[i], entry);
-			return cg_cache_entry[i].cg;
+	return hash & ((1u << cg_cache.table_bits) - 1);
+}
+
+// returns the table index of the entry for `name`, or -1 if not present
+static int cg_cache_find(const char *name, uint32_t hash)
+{
+	const unsigned mask = (1u << cg_cache.table_bits) - 1;
+	for (unsigned i = cg_cache_slot(hash); cg_cache.table[i]; i = (i + 1) & mask) {
+		struct cached_cg *e = cg_cache.table[i];
+		if (e->hash == hash && !strcasecmp(e->name, name))
+			return i;
+	}
+	return -1;
+}
+
+static void cg_cache_table_insert(struct cached_cg *e)
+{
+	const unsigned mask = (1u << cg_cache.table_bits) - 1;
+	unsigned i = cg_cache_slot(e->hash);
+	while (cg_cache.table[i])
+		i = (i + 1) & mask;
+	cg_cache.table[i] = e;
+}
+
+// remove the entry at index `i`, shifting back any entries which follow it
+// in the same probe sequence
+static void cg_cache_table_remove(unsigned i)
+{
+	const unsigned mask = (1u << cg_cache.table_bits) - 1;
+	cg_cache.table[i] = NULL;
+	for (unsigned j = (i + 1) & mask; cg_cache.table[j]; j = (j + 1) & mask) {
+		unsigned home = cg_cache_slot(cg_cache.table[j]->hash);
+		// move entry j to the hole at i if i lies cyclically in [home, j)
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			cg_cache.table[i] = cg_cache.table[j];
+			cg_cache.table[j] = NULL;
+			i = j;
 		}
 	}
+}
+
+static void cg_cache_grow(void)
+{
+	struct cached_cg **old = cg_cache.table;
+	unsigned old_size = 1u << cg_cache.table_bits;
+	cg_cache.table_bits++;
+	cg_cache.table = xcalloc(1u << cg_cache.table_bits, sizeof(struct cached_cg*));
+	for (unsigned i = 0; i < old_size; i++) {
+		if (old[i])
+			cg_cache_table_insert(old[i]);
+	}
+	free(old);
+}
+
+static void cg_cache_evict(void)
+{
+	struct cached_cg *e = TAILQ_LAST(&cg_cache.lru, cg_cache_head);
+	int i = cg_cache_find(e->name, e->hash);
+	assert(i >= 0);
+	cg_cache_table_remove(i);
+	TAILQ_REMOVE(&cg_cache.lru, e, entry);
+	cg_cache.nr_entries--;
+	cg_cache.bytes -= e->size;
+	cg_stats.evictions++;
+	cg_free(e->cg);
+	free(e->name);
+	free(e);
+}
+
+static struct cached_cg *cg_cache_lookup(const char *name, uint32_t hash)
+{
+	int i = cg_cache_find(name, hash);
+	return i < 0 ? NULL : cg_cache.table[i];
+}
+
+static struct cg *cg_cache_get(const char *name, uint32_t hash)
+{
+	struct cached_cg *cached = cg_cache_lookup(name, hash);
+	if (!cached)
+		return NULL;
+	// move to front of cache
+	TAILQ_REMOVE(&cg_cache.lru, cached, entry);
+	TAILQ_INSERT_HEAD(&cg_cache.lru, cached, entry);
+	return cached->cg;
+}
+
+static void cg_cache_put(const char *name, uint32_t hash, struct cg *cg)
+{
+	size_t size = cg_size(cg);
+	if (size > config.cg_cache_size)
+		return;
+
+	// evict least recently used CGs until the new CG fits
+	while (cg_cache.bytes + size > config.cg_cache_size)
+		cg_cache_evict();
+	if ((cg_cache.nr_entries + 1) * 2 > (1u << cg_cache.table_bits))
+		cg_cache_grow();
+
+	struct cached_cg *e = xcalloc(1, sizeof(struct cached_cg));
+	e->hash = hash;
+	e->name = xstrdup(name);
+	e->cg = cg;
+	e->size = size;
+	cg->ref++;
+	cg_cache_table_insert(e);
+	TAILQ_INSERT_HEAD(&cg_cache.lru, e, entry);
+	cg_cache.nr_entries++;
+	cg_cache.bytes += size;
+}
+
+/*
+ * CG prefetching. CGs are read from the archive on the main thread and then
+ * decoded on a worker thread. Decoded CGs are held by the job until the main
+ * thread requests them through asset_cg_decode, at which point they are moved
+ * into the CG cache. The CG cache itself is only accessed by the main thread.
+ */
+#define CG_PREFETCH_MAX 4
+
+enum cg_prefetch_state {
+	CG_PREFETCH_QUEUED,
+	CG_PREFETCH_DECODING,
+	CG_PREFETCH_DONE,
+};
+
+struct cg_prefetch_job {
+	TAILQ_ENTRY(cg_prefetch_job) entry;
+	enum cg_prefetch_state state;
+	struct archive_data *file;
+	struct cg *cg;
+};
+
+static struct {
+	SDL_Thread *thread;
+	SDL_mutex *mutex;
+	// signalled when a job is queued (or on shutdown)
+	SDL_cond *queued;
+	// signalled when a job is finished
+	SDL_cond *done;
+	bool quit;
+	unsigned nr_jobs;
+	TAILQ_HEAD(, cg_prefetch_job) jobs;
+} prefetch = {0};
+
+static double elapsed_ms(uint64_t start)
+{
+	return (double)(SDL_GetPerformanceCounter() - start) * 1000.0
+		/ SDL_GetPerformanceFrequency();
+}
+
+static int cg_prefetch_thread(void *data)
+{
+	SDL_LockMutex(prefetch.mutex);
+	while (true) {
+		struct cg_prefetch_job *job = NULL;
+		while (!prefetch.quit) {
+			TAILQ_FOREACH(job, &prefetch.jobs, entry) {
+				if (job->state == CG_PREFETCH_QUEUED)
+					break;
+			}
+			if (job)
+				break;
+			SDL_CondWait(prefetch.queued, prefetch.mutex);
+		}
+		if (prefetch.quit)
+			break;
+
+		job->state = CG_PREFETCH_DECODING;
+		SDL_UnlockMutex(prefetch.mutex);
+		struct cg *cg = cg_load_arcdata(job->file);
+		SDL_LockMutex(prefetch.mutex);
+		job->cg = cg;
+		job->state = CG_PREFETCH_DONE;
+		SDL_CondBroadcast(prefetch.done);
+	}
+	SDL_UnlockMutex(prefetch.mutex);
+	return 0;
+}
+
+static void cg_prefetch_job_free(struct cg_prefetch_job *job)
+{
+	if (job->cg)
+		cg_free(job->cg);
+	archive_data_release(job->file);
+	free(job);
+}
+
+static void cg_prefetch_fini(void)
+{
+	if (!prefetch.thread)
+		return;
+	SDL_LockMutex(prefetch.mutex);
+	prefetch.quit = true;
+	SDL_CondSignal(prefetch.queued);
+	SDL_UnlockMutex(prefetch.mutex);
+	SDL_WaitThread(prefetch.thread, NULL);
+	prefetch.thread = NULL;
+
+	while (!TAILQ_EMPTY(&prefetch.jobs)) {
+		struct cg_prefetch_job *job = TAILQ_FIRST(&prefetch.jobs);
+		TAILQ_REMOVE(&prefetch.jobs, job, entry);
+		cg_prefetch_job_free(job);
+	}
+	SDL_DestroyCond(prefetch.queued);
+	SDL_DestroyCond(prefetch.done);
+	SDL_DestroyMutex(prefetch.mutex);
+}
+
+static void cg_prefetch_init(void)
+{
+	TAILQ_INIT(&prefetch.jobs);
+	if (!(prefetch.mutex = SDL_CreateMutex())
+			|| !(prefetch.queued = SDL_CreateCond())
+			|| !(prefetch.done = SDL_CreateCond())) {
+		WARNING("Failed to initialize CG prefetching: %s", SDL_GetError());
+		return;
+	}
+	prefetch.thread = SDL_CreateThread(cg_prefetch_thread, "cg_prefetch", NULL);
+	if (!prefetch.thread) {
+		WARNING("SDL_CreateThread failed: %s", SDL_GetError());
+		return;
+	}
+	atexit(cg_prefetch_fini);
+}
+
+// must be called with the prefetch mutex held
+static struct cg_prefetch_job *cg_prefetch_find(const char *name)
+{
+	struct cg_prefetch_job *job;
+	TAILQ_FOREACH(job, &prefetch.jobs, entry) {
+		if (!strcasecmp(job->file->name, name))
+			return job;
+	}
 	return NULL;
 }
 
+/*
+ * Take the prefetched CG for `name`, waiting for the worker if it is currently
+ * being decoded. Returns NULL if the CG was not prefetched (or was queued but
+ * not yet started, in which case the job is cancelled and the caller should
+ * decode it itself).
+ */
+static struct cg *cg_prefetch_take(const char *name)
+{
+	if (!prefetch.thread)
+		return NULL;
+
+	SDL_LockMutex(prefetch.mutex);
+	struct cg_prefetch_job *job = cg_prefetch_find(name);
+	if (!job) {
+		SDL_UnlockMutex(prefetch.mutex);
+		return NULL;
+	}
+	if (job->state == CG_PREFETCH_DECODING) {
+		uint64_t start = SDL_GetPerformanceCounter();
+		while (job->state != CG_PREFETCH_DONE)
+			SDL_CondWait(prefetch.done, prefetch.mutex);
+		cg_stats.waits++;
+		cg_stats.wait_ms += elapsed_ms(start);
+	} else if (job->state == CG_PREFETCH_DONE) {
+		cg_stats.prefetch_hits++;
+	}
+	TAILQ_REMOVE(&prefetch.jobs, job, entry);
+	prefetch.nr_jobs--;
+	SDL_UnlockMutex(prefetch.mutex);
+
+	struct cg *cg = job->cg;
+	job->cg = NULL;
+	cg_prefetch_job_free(job);
+	return cg;
+}
+
+void asset_cg_prefetch(const char *name)
+{
+	if (!prefetch.thread)
+		return;
+	if (cg_cache_lookup(name, name_hash(name)))
+		return;
+
+	// jobs are only added/removed on the main thread, so it's safe to drop
+	// the lock while reading the file
+	SDL_LockMutex(prefetch.mutex);
+	if (cg_prefetch_find(name)) {
+		SDL_UnlockMutex(prefetch.mutex);
+		return;
+	}
+	if (prefetch.nr_jobs >= CG_PREFETCH_MAX) {
+		// drop the oldest finished job to make room
+		struct cg_prefetch_job *job;
+		TAILQ_FOREACH(job, &prefetch.jobs, entry) {
+			if (job->state == CG_PREFETCH_DONE)
+				break;
+		}
+		if (!job) {
+			SDL_UnlockMutex(prefetch.mutex);
+			return;
+		}
+		TAILQ_REMOVE(&prefetch.jobs, job, entry);
+		prefetch.nr_jobs--;
+		cg_prefetch_job_free(job);
+	}
+	SDL_UnlockMutex(prefetch.mutex);
+
+	struct archive_data *file = arc.bg ? archive_get(arc.bg, name) : asset_fs_load(name);
+	if (!file)
+		return;
+
+	struct cg_prefetch_job *job = xcalloc(1, sizeof(struct cg_prefetch_job));
+	job->state = CG_PREFETCH_QUEUED;
+	job->file = file;
+	SDL_LockMutex(prefetch.mutex);
+	TAILQ_INSERT_TAIL(&prefetch.jobs, job, entry);
+	prefetch.nr_jobs++;
+	SDL_CondSignal(prefetch.queued);
+	SDL_UnlockMutex(prefetch.mutex);
+}
+
+static bool is_name_char(uint8_t c)
+{
+	return isalnum(c) || c == '_' || c == '-';
+}
+
+void asset_cg_prefetch_scan(const uint8_t *code, size_t size)
+{
+	// only scan when CGs come from an archive, so that a failed lookup
+	// is cheap and non-CG file names are naturally filtered out
+	if (!prefetch.thread || !arc.bg)
+		return;
+
+	unsigned nr_found = 0;
+	size_t i = 0;
+	while (i < size && nr_found < CG_PREFETCH_MAX) {
+		if (!is_name_char(code[i])) {
+			i++;
+			continue;
+		}
+		// match NUL-terminated strings of the form "NAME.EXT"
+		size_t start = i;
+		int dot = -1;
+		while (i < size && (is_name_char(code[i]) || code[i] == '.')) {
+			if (code[i] == '.')
+				dot = i - start;
+			i++;
+		}
+		size_t len = i - start;
+		if (i >= size || code[i] != '\0' || dot < 1 || len - dot < 3 || len - dot > 4
+				|| len > 12)
+			continue;
+		if (!strncasecmp((const char*)code + start + dot, ".MES", 4))
+			continue;
+		asset_cg_prefetch((const char*)code + start);
+		nr_found++;
+	}
+}
+
+void asset_cg_stats(struct asset_cg_stats *stats)
+{
+	*stats = cg_stats;
+	stats->entries = cg_cache.nr_entries;
+	stats->bytes = cg_cache.bytes;
+}
+
 struct cg *asset_cg_decode(struct archive_data *file)
 {
 	// check for cached CG
-	uint64_t key = cg_name_hash(file->name);
-	struct cg *cg = cg_cache_get(file->name, key);
+	uint32_t hash = name_hash(file->name);
+	struct cg *cg = cg_cache_get(file->name, hash);
 	if (cg) {
+		cg_stats.hits++;
 		cg->ref++;
 		return cg;
 	}
 
-	// decode CG
-	cg = cg_load_arcdata(file);
+	// check for prefetched CG, otherwise decode it now
+	if (!(cg = cg_prefetch_take(file->name))) {
+		uint64_t start = SDL_GetPerformanceCounter();
+		cg = cg_load_arcdata(file);
+		cg_stats.misses++;
+		cg_stats.miss_ms += elapsed_ms(start);
+	}
 	if (!cg)
 		return NULL;
 
-	// evict least recently used CG from cache
-	struct cached_cg *cached;
-	if (TAILQ_EMPTY(&cg_free_list)) {
-		cached = TAILQ_LAST(&cg_cache, cg_cache_head);
-		TAILQ_REMOVE(&cg_cache, cached, entry);
-		cached->key = 0;
-		cached->name = NULL;
-		cg_free(cached->cg);
-	} else {
-		cached = TAILQ_FIRST(&cg_free_list);
-		TAILQ_REMOVE(&cg_free_list, cached, entry);
-	}
-
-	// add CG to cache
-	cg->ref++;
-	cached->key = key;
-	cached->name = file->name;
-	cached->cg = cg;
-	TAILQ_INSERT_HEAD(&cg_cache, cached, entry);
-
+	cg_cache_put(file->name, hash, cg);
 	return cg;
 }
 
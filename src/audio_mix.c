@@ -0,0 +1,119 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Mixing kernels for interleaved float audio.
+ *
+ * Each kernel performs the same single-precision operations in the same
+ * order as the scalar code in sts_mixer.h, so the SIMD versions produce
+ * results identical to it. Clamping is done as min(1, x) followed by
+ * max(-1, x), which passes NaNs through as the scalar comparisons do.
+ */
+
+#include <stddef.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define MIX_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MIX_NEON
+#endif
+
+#include "mixer.h"
+
+static inline float clamp_sample(float s)
+{
+	if (s < -1.0f) return -1.0f;
+	if (s > 1.0f) return 1.0f;
+	return s;
+}
+
+void mixer_accumulate(float *acc, const float *src, float gain, size_t n)
+{
+	size_t i = 0;
+#if defined(MIX_SSE2)
+	const __m128 g = _mm_set1_ps(gain);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 neg_one = _mm_set1_ps(-1.0f);
+	for (; i + 8 <= n; i += 8) {
+		__m128 a = _mm_mul_ps(_mm_loadu_ps(src + i), g);
+		__m128 b = _mm_mul_ps(_mm_loadu_ps(src + i + 4), g);
+		a = _mm_max_ps(neg_one, _mm_min_ps(one, a));
+		b = _mm_max_ps(neg_one, _mm_min_ps(one, b));
+		_mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), a));
+		_mm_storeu_ps(acc + i + 4, _mm_add_ps(_mm_loadu_ps(acc + i + 4), b));
+	}
+#elif defined(MIX_NEON)
+	const float32x4_t one = vdupq_n_f32(1.0f);
+	const float32x4_t neg_one = vdupq_n_f32(-1.0f);
+	for (; i + 8 <= n; i += 8) {
+		float32x4_t a = vmulq_n_f32(vld1q_f32(src + i), gain);
+		float32x4_t b = vmulq_n_f32(vld1q_f32(src + i + 4), gain);
+		a = vmaxq_f32(neg_one, vminq_f32(one, a));
+		b = vmaxq_f32(neg_one, vminq_f32(one, b));
+		vst1q_f32(acc + i, vaddq_f32(vld1q_f32(acc + i), a));
+		vst1q_f32(acc + i + 4, vaddq_f32(vld1q_f32(acc + i + 4), b));
+	}
+#endif
+	for (; i < n; i++) {
+		acc[i] += clamp_sample(src[i] * gain);
+	}
+}
+
+void mixer_gain_clamp(float *dst, const float *src, float gain, size_t n)
+{
+	size_t i = 0;
+#if defined(MIX_SSE2)
+	const __m128 g = _mm_set1_ps(gain);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 neg_one = _mm_set1_ps(-1.0f);
+	for (; i + 4 <= n; i += 4) {
+		__m128 a = _mm_mul_ps(_mm_loadu_ps(src + i), g);
+		_mm_storeu_ps(dst + i, _mm_max_ps(neg_one, _mm_min_ps(one, a)));
+	}
+#elif defined(MIX_NEON)
+	const float32x4_t one = vdupq_n_f32(1.0f);
+	const float32x4_t neg_one = vdupq_n_f32(-1.0f);
+	for (; i + 4 <= n; i += 4) {
+		float32x4_t a = vmulq_n_f32(vld1q_f32(src + i), gain);
+		vst1q_f32(dst + i, vmaxq_f32(neg_one, vminq_f32(one, a)));
+	}
+#endif
+	for (; i < n; i++) {
+		dst[i] = clamp_sample(src[i] * gain);
+	}
+}
+
+void mixer_swap_stereo(float *buf, size_t frames)
+{
+	size_t i = 0;
+#if defined(MIX_SSE2)
+	for (; i + 2 <= frames; i += 2) {
+		__m128 x = _mm_loadu_ps(buf + i * 2);
+		_mm_storeu_ps(buf + i * 2, _mm_shuffle_ps(x, x, _MM_SHUFFLE(2, 3, 0, 1)));
+	}
+#elif defined(MIX_NEON)
+	for (; i + 2 <= frames; i += 2) {
+		vst1q_f32(buf + i * 2, vrev64q_f32(vld1q_f32(buf + i * 2)));
+	}
+#endif
+	for (; i < frames; i++) {
+		float tmp = buf[i*2];
+		buf[i*2] = buf[i*2+1];
+		buf[i*2+1] = tmp;
+	}
+}
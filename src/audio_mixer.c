@@ -20,8 +20,11 @@
 #include <SDL.h>
 
 #include "nulib.h"
+#include "nulib/queue.h"
 #include "ai5/arc.h"
 
+#include "ai5.h"
+#include "alloc_stats.h"
 #include "asset.h"
 #include "mixer.h"
 
@@ -33,10 +36,31 @@
  * channels (loading audio, starting/stopping, etc.)
  */
 #define STS_MIXER_IMPLEMENTATION
+#define STS_MIXER_ACCUMULATE mixer_accumulate
+#define STS_MIXER_GAIN_CLAMP mixer_gain_clamp
 #include "sts_mixer.h"
 
 #define CHUNK_SIZE 1024
 
+// size of the decode-ahead ring buffer, in (stereo) frames; must be a power of 2
+#define RING_FRAMES 16384
+// interval at which the decoder thread tops up the ring buffers if not woken
+#define DECODER_POLL_MS 20
+// chunks decoded on the calling thread when a stream is started or seeked;
+// the decoder thread decodes the rest
+#define PRIME_CHUNKS 2
+
+/*
+ * Single-producer/single-consumer ring buffer of stereo frames. The decoder
+ * writes and the audio callback reads. Indices are free-running and
+ * masked on access.
+ */
+struct ring {
+	atomic_uint read;
+	atomic_uint write;
+	float data[RING_FRAMES * 2];
+};
+
 struct fade {
 	atomic_bool fading;
 	bool stop;
@@ -46,7 +70,26 @@ struct fade {
 	float end_volume;
 };
 
+/*
+ * A fully decoded sound, shared (read-only) between all streams playing it.
+ */
+struct pcm_clip {
+	TAILQ_ENTRY(pcm_clip) entry;
+	// archive and entry name (or NULL and path, for files not in an archive)
+	struct archive *archive;
+	char *name;
+	unsigned refs;
+	SF_INFO info;
+	unsigned loop_start;
+	unsigned loop_end;
+	unsigned loop_count;
+	float *data;
+	size_t size;
+	double decode_ms;
+};
+
 struct mixer_stream {
+	TAILQ_ENTRY(mixer_stream) entry;
 	// archive data
 	struct archive_data *dfile;
 	int mixer_no;
@@ -56,12 +99,27 @@ struct mixer_stream {
 	SF_INFO info;
 	sf_count_t offset;
 
+	// decoded audio data (if the sound is cached; replaces `file`)
+	struct pcm_clip *clip;
+	sf_count_t clip_pos;
+
+	// decoder state (protected by the decoder mutex, or owned by the decoder
+	// thread while `decoding` is set)
+	uint_least32_t decode_frame;
+	float decode_buf[CHUNK_SIZE * 2];
+	bool decoding;
+	// set by the decoder once the last frame has been written to the ring
+	atomic_bool eof;
+	// set by the audio callback when a fade stops the stream
+	atomic_bool rewind;
+	struct ring ring;
+
 	// stream data
 	atomic_int voice;
 	sts_mixer_stream_t stream;
 	float data[CHUNK_SIZE * 2];
 
-	// main thread read-only
+	// playback position (main thread read-only)
 	atomic_uint_least32_t frame;
 
 	atomic_uint volume;
@@ -93,19 +151,202 @@ static int nr_mixers = 0;
 
 static SDL_AudioDeviceID audio_device = 0;
 
+/*
+ * Decoder thread. Audio files are decoded ahead of playback into each stream's
+ * ring buffer, so that the audio callback never has to wait on libsndfile.
+ * The decoder mutex protects the stream list and the decoder state of each
+ * stream; the main thread holds it (before locking the audio device) whenever
+ * it seeks a stream or changes its loop parameters. The decoder thread
+ * releases the mutex while decoding a chunk, marking the stream as `decoding`
+ * so that the main thread waits for that chunk only if it needs the same
+ * stream.
+ */
+static struct {
+	SDL_Thread *thread;
+	SDL_mutex *mutex;
+	// posted by the audio callback when a ring buffer needs topping up
+	SDL_sem *wake;
+	// signalled when the decoder thread finishes decoding a chunk
+	SDL_cond *idle;
+	bool quit;
+	TAILQ_HEAD(, mixer_stream) streams;
+} decoder = {0};
+
+static struct {
+	atomic_ulong underruns;
+	atomic_uint min_fill;
+	uint64_t frames_decoded;
+	uint64_t frames_primed;
+	unsigned streams;
+} stats = { .min_fill = RING_FRAMES };
+
+/*
+ * Cache of decoded sounds, keyed by archive and entry name. Sounds no longer
+ * than config.sound_cache_length are decoded in full when first played, and
+ * are played from memory after that. Clips are kept in LRU order, and clips
+ * which are not being played are evicted to keep the cache within
+ * config.sound_cache_size. The cache is only accessed from the main thread.
+ */
+static struct {
+	TAILQ_HEAD(pcm_clip_list, pcm_clip) clips;
+	size_t bytes;
+	struct mixer_sound_cache_stats stats;
+} pcm_cache;
+
+static bool cb_seek(struct mixer_stream *ch, uint_least32_t pos);
+
+static double elapsed_ms(uint64_t start)
+{
+	return (double)(SDL_GetPerformanceCounter() - start) * 1000.0
+		/ SDL_GetPerformanceFrequency();
+}
+
+static void pcm_cache_evict(size_t need)
+{
+	struct pcm_clip *clip = TAILQ_LAST(&pcm_cache.clips, pcm_clip_list);
+	while (clip && pcm_cache.bytes + need > config.sound_cache_size) {
+		struct pcm_clip *prev = TAILQ_PREV(clip, pcm_clip_list, entry);
+		if (!clip->refs) {
+			TAILQ_REMOVE(&pcm_cache.clips, clip, entry);
+			pcm_cache.bytes -= clip->size;
+			pcm_cache.stats.entries--;
+			pcm_cache.stats.evictions++;
+			free(clip->data);
+			free(clip->name);
+			free(clip);
+		}
+		clip = prev;
+	}
+}
+
+static struct pcm_clip *pcm_cache_get(struct archive_data *dfile)
+{
+	struct pcm_clip *clip;
+	TAILQ_FOREACH(clip, &pcm_cache.clips, entry) {
+		if (clip->archive == dfile->archive && !strcasecmp(clip->name, dfile->name))
+			break;
+	}
+	if (!clip)
+		return NULL;
+
+	TAILQ_REMOVE(&pcm_cache.clips, clip, entry);
+	TAILQ_INSERT_HEAD(&pcm_cache.clips, clip, entry);
+	clip->refs++;
+	pcm_cache.stats.hits++;
+	pcm_cache.stats.saved_ms += clip->decode_ms;
+	return clip;
+}
+
+static void pcm_cache_put(struct pcm_clip *clip)
+{
+	assert(clip->refs > 0);
+	if (--clip->refs == 0 && pcm_cache.bytes > config.sound_cache_size)
+		pcm_cache_evict(0);
+}
+
+/*
+ * Decode the whole of a stream's audio file into the cache, if it is short
+ * enough. Returns NULL if the sound should be streamed instead.
+ */
+static struct pcm_clip *pcm_cache_decode(struct mixer_stream *ch, struct archive_data *dfile,
+		unsigned loop_start, unsigned loop_end, unsigned loop_count)
+{
+	if (!config.sound_cache_size || ch->info.frames <= 0 || ch->info.samplerate <= 0)
+		return NULL;
+	if (muldiv(ch->info.frames, 1000, ch->info.samplerate) > config.sound_cache_length)
+		return NULL;
+	size_t size = ch->info.frames * ch->info.channels * sizeof(float);
+	if (size > config.sound_cache_size)
+		return NULL;
+
+	uint64_t start = SDL_GetPerformanceCounter();
+	float *data = xmalloc(size);
+	if (sf_readf_float(ch->file, data, ch->info.frames) != ch->info.frames) {
+		// fall back to streaming
+		free(data);
+		cb_seek(ch, 0);
+		return NULL;
+	}
+
+	pcm_cache_evict(size);
+	struct pcm_clip *clip = xcalloc(1, sizeof(struct pcm_clip));
+	clip->archive = dfile->archive;
+	clip->name = xstrdup(dfile->name);
+	clip->refs = 1;
+	clip->info = ch->info;
+	clip->loop_start = loop_start;
+	clip->loop_end = loop_end;
+	clip->loop_count = loop_count;
+	clip->data = data;
+	clip->size = size;
+	clip->decode_ms = elapsed_ms(start);
+	TAILQ_INSERT_HEAD(&pcm_cache.clips, clip, entry);
+	pcm_cache.bytes += size;
+	pcm_cache.stats.entries++;
+	pcm_cache.stats.misses++;
+	pcm_cache.stats.decode_ms += clip->decode_ms;
+	return clip;
+}
+
+void mixer_sound_cache_stats(struct mixer_sound_cache_stats *stats)
+{
+	*stats = pcm_cache.stats;
+	stats->bytes = pcm_cache.bytes;
+}
+
+static unsigned ring_fill(struct ring *ring)
+{
+	return atomic_load_explicit(&ring->write, memory_order_acquire)
+		- atomic_load_explicit(&ring->read, memory_order_acquire);
+}
+
+// called by the decoder only (the decoder thread, or a thread priming the stream)
+static void ring_write(struct ring *ring, const float *src, unsigned frames)
+{
+	unsigned w = atomic_load_explicit(&ring->write, memory_order_relaxed);
+	unsigned i = w & (RING_FRAMES - 1);
+	unsigned n = min(frames, RING_FRAMES - i);
+	memcpy(ring->data + i * 2, src, n * 2 * sizeof(float));
+	memcpy(ring->data, src + n * 2, (frames - n) * 2 * sizeof(float));
+	atomic_store_explicit(&ring->write, w + frames, memory_order_release);
+}
+
+// called from the audio callback only
+static unsigned ring_read(struct ring *ring, float *dst, unsigned frames)
+{
+	unsigned r = atomic_load_explicit(&ring->read, memory_order_relaxed);
+	unsigned w = atomic_load_explicit(&ring->write, memory_order_acquire);
+	frames = min(frames, w - r);
+	unsigned i = r & (RING_FRAMES - 1);
+	unsigned n = min(frames, RING_FRAMES - i);
+	memcpy(dst, ring->data + i * 2, n * 2 * sizeof(float));
+	memcpy(dst + n * 2, ring->data, (frames - n) * 2 * sizeof(float));
+	atomic_store_explicit(&ring->read, r + frames, memory_order_release);
+	return frames;
+}
+
+// must be called while neither the decoder nor the audio callback is using the ring
+static void ring_reset(struct ring *ring)
+{
+	atomic_store(&ring->read, 0);
+	atomic_store(&ring->write, 0);
+}
+
 /*
  * The SDL2 audio callback.
  */
 static void audio_callback(void *data, Uint8 *stream, int len)
 {
+	ALLOC_STATS_ENTER_REALTIME();
 	sts_mixer_mix_audio(&master->mixer, stream, len / (sizeof(float) * 2));
 	if (master->muted) {
 		memset(stream, 0, len);
 	}
+	ALLOC_STATS_LEAVE_REALTIME();
 }
 
 /*
- * Seek to the specified position in the stream.
+ * Seek the decoder to the specified position in the stream.
  * Returns true if the seek succeeded, otherwise returns false.
  */
 static bool cb_seek(struct mixer_stream *ch, uint_least32_t pos)
@@ -113,12 +354,17 @@ static bool cb_seek(struct mixer_stream *ch, uint_least32_t pos)
 	if (pos > ch->info.frames) {
 		pos = ch->info.frames;
 	}
+	if (ch->clip) {
+		ch->clip_pos = pos;
+		ch->decode_frame = pos;
+		return true;
+	}
 	sf_count_t r = sf_seek(ch->file, pos, SEEK_SET);
 	if (r < 0) {
 		WARNING("sf_seek failed");
 		return false;
 	}
-	ch->frame = r;
+	ch->decode_frame = r;
 	return true;
 }
 
@@ -138,8 +384,23 @@ static bool cb_loop(struct mixer_stream *ch)
 }
 
 /*
- * Callback to refill the stream's audio data.
- * Called from sys_mixer_mix_audio.
+ * Read frames from the decoded sound, or from the audio file.
+ */
+static sf_count_t stream_readf(struct mixer_stream *ch, float *out, sf_count_t frames)
+{
+	if (!ch->clip)
+		return sf_readf_float(ch->file, out, frames);
+
+	int channels = ch->clip->info.channels;
+	frames = max(0, min(frames, ch->clip->info.frames - ch->clip_pos));
+	memcpy(out, ch->clip->data + ch->clip_pos * channels, frames * channels * sizeof(float));
+	ch->clip_pos += frames;
+	return frames;
+}
+
+/*
+ * Read frames from the audio file, handling loops.
+ * Called from the decoder thread.
  */
 static int cb_read_frames(struct mixer_stream *ch, float *out, sf_count_t frame_count, uint_least32_t *num_read)
 {
@@ -147,37 +408,37 @@ static int cb_read_frames(struct mixer_stream *ch, float *out, sf_count_t frame_
 
 	// handle case where chunk crosses loop point (seamless)
 	// NOTE: it's assumed that the length of the loop is greater than the chunk length
-	if (ch->frame + frame_count >= ch->loop_end) {
+	if (ch->decode_frame + frame_count >= ch->loop_end) {
 		// read frames up to loop_end
-		*num_read = sf_readf_float(ch->file, out, ch->loop_end - ch->frame);
+		*num_read = stream_readf(ch, out, ch->loop_end - ch->decode_frame);
 		// adjust parameters for later
-		ch->frame += *num_read;
+		ch->decode_frame += *num_read;
 		out += *num_read;
 		frame_count -= *num_read;
 		// seek to loop_start
 		if (!cb_loop(ch))
 			return STS_STREAM_COMPLETE;
-	} else if (ch->frame >= ch->loop_end) {
+	} else if (ch->decode_frame >= ch->loop_end) {
 		// seek to loop_start
 		if (!cb_loop(ch))
 			return STS_STREAM_COMPLETE;
 	}
 
 	// read remaining data
-	sf_count_t n = sf_readf_float(ch->file, out, frame_count);
+	sf_count_t n = stream_readf(ch, out, frame_count);
 	*num_read += n;
-	ch->frame += n;
+	ch->decode_frame += n;
 	out += *num_read;
 	frame_count -= *num_read;
 
 	// XXX: This *shouldn't* be necessary, but sometimes libsndfile seems to stop reading
-	//      just before the end of file (i.e. ch->frame + frame_count is < ch->info.frames,
+	//      just before the end of file (i.e. ch->decode_frame + frame_count is < ch->info.frames,
 	//      yet sf_readf_float returns less that the requested amount of frames).
 	//      Not sure if this is a bug in ai5-sdl2 or libsndfile
 	if (frame_count > 0) {
 		if (!cb_loop(ch))
 			return STS_STREAM_COMPLETE;
-		*num_read += sf_readf_float(ch->file, out, frame_count);
+		*num_read += stream_readf(ch, out, frame_count);
 	}
 
 	return STS_STREAM_CONTINUE;
@@ -199,31 +460,193 @@ static float cb_calc_fade(struct fade *fade)
 	return gain;
 }
 
-static int refill_stream(sts_mixer_sample_t *sample, void *data)
+static bool stream_needs_decode(struct mixer_stream *ch)
 {
-	struct mixer_stream *ch = data;
-	uint_least32_t frames_read;
-	memset(ch->data, 0, sizeof(float) * sample->length);
+	return !ch->eof && RING_FRAMES - ring_fill(&ch->ring) >= CHUNK_SIZE;
+}
 
-	// read audio data from file
-	int r = cb_read_frames(ch, ch->data, CHUNK_SIZE, &frames_read);
+/*
+ * Decode one chunk into the stream's ring buffer. Returns the number of
+ * frames written. Must be called with the decoder mutex held, or from the
+ * decoder thread while `decoding` is set.
+ */
+static unsigned stream_decode_chunk(struct mixer_stream *ch)
+{
+	uint_least32_t frames_read;
+	memset(ch->decode_buf, 0, sizeof(ch->decode_buf));
+	int r = cb_read_frames(ch, ch->decode_buf, CHUNK_SIZE, &frames_read);
 
 	// convert mono to stereo
 	if (ch->info.channels == 1) {
-		for (int i = CHUNK_SIZE-1; i >= 0; i--) {
-			ch->data[i*2+1] = ch->data[i];
-			ch->data[i*2] = ch->data[i];
+		for (int i = frames_read - 1; i >= 0; i--) {
+			ch->decode_buf[i*2+1] = ch->decode_buf[i];
+			ch->decode_buf[i*2] = ch->decode_buf[i];
 		}
 	}
 
-	// reverse LR channels
-	else if (ch->swapped) {
-		for (int i = 0; i < CHUNK_SIZE; i++) {
-			float tmp = ch->data[i*2];
-			ch->data[i*2] = ch->data[i*2+1];
-			ch->data[i*2+1] = tmp;
+	ring_write(&ch->ring, ch->decode_buf, frames_read);
+	if (r == STS_STREAM_COMPLETE)
+		ch->eof = true;
+	return frames_read;
+}
+
+/*
+ * Decode ahead into the stream's ring buffer until it holds at least `frames`
+ * frames, it is full or the end of the stream is reached. Must be called with
+ * the decoder mutex held.
+ */
+static void stream_decode(struct mixer_stream *ch, unsigned frames)
+{
+	while (ring_fill(&ch->ring) < frames && stream_needs_decode(ch)) {
+		unsigned n = stream_decode_chunk(ch);
+		stats.frames_decoded += n;
+		if (!n && !ch->eof)
+			break;
+	}
+}
+
+/*
+ * Decode the first chunks of a stream which is about to play, leaving the
+ * rest to the decoder thread.
+ */
+static void stream_prime(struct mixer_stream *ch)
+{
+	uint64_t decoded = stats.frames_decoded;
+	stream_decode(ch, PRIME_CHUNKS * CHUNK_SIZE);
+	stats.frames_primed += stats.frames_decoded - decoded;
+	SDL_SemPost(decoder.wake);
+}
+
+/*
+ * Seek to the specified position in the stream, discarding any audio which
+ * was decoded ahead. The first chunks at the new position are decoded before
+ * returning, so that the audio callback does not run dry before the decoder
+ * thread catches up. Must be called with the decoder mutex held and the
+ * audio device locked (or the stream stopped).
+ */
+static bool stream_seek(struct mixer_stream *ch, uint_least32_t pos)
+{
+	bool r = cb_seek(ch, pos);
+	ring_reset(&ch->ring);
+	ch->eof = false;
+	ch->rewind = false;
+	ch->frame = ch->decode_frame;
+	stream_prime(ch);
+	return r;
+}
+
+/*
+ * Lock the decoder mutex and wait until the decoder thread is not decoding
+ * the stream, so that its decoder state can be changed. This waits for at
+ * most one chunk to be decoded.
+ */
+static void stream_lock(struct mixer_stream *ch)
+{
+	SDL_LockMutex(decoder.mutex);
+	while (ch->decoding)
+		SDL_CondWait(decoder.idle, decoder.mutex);
+}
+
+static int decoder_thread(void *data)
+{
+	SDL_LockMutex(decoder.mutex);
+	while (!decoder.quit) {
+		// one chunk per stream per pass, so that no stream waits on the others
+		bool busy = false;
+		struct mixer_stream *ch;
+		TAILQ_FOREACH(ch, &decoder.streams, entry) {
+			if (decoder.quit)
+				break;
+			if (!stream_needs_decode(ch))
+				continue;
+			ch->decoding = true;
+			SDL_UnlockMutex(decoder.mutex);
+			unsigned n = stream_decode_chunk(ch);
+			SDL_LockMutex(decoder.mutex);
+			ch->decoding = false;
+			SDL_CondBroadcast(decoder.idle);
+			stats.frames_decoded += n;
+			if (n || ch->eof)
+				busy = true;
+		}
+		if (!busy) {
+			SDL_UnlockMutex(decoder.mutex);
+			SDL_SemWaitTimeout(decoder.wake, DECODER_POLL_MS);
+			SDL_LockMutex(decoder.mutex);
 		}
 	}
+	SDL_UnlockMutex(decoder.mutex);
+	return 0;
+}
+
+static void decoder_fini(void)
+{
+	if (!decoder.thread)
+		return;
+	SDL_LockMutex(decoder.mutex);
+	decoder.quit = true;
+	SDL_UnlockMutex(decoder.mutex);
+	SDL_SemPost(decoder.wake);
+	SDL_WaitThread(decoder.thread, NULL);
+	decoder.thread = NULL;
+}
+
+static void decoder_init(void)
+{
+	TAILQ_INIT(&decoder.streams);
+	if (!(decoder.mutex = SDL_CreateMutex()) || !(decoder.wake = SDL_CreateSemaphore(0))
+			|| !(decoder.idle = SDL_CreateCond()))
+		ERROR("Failed to initialize audio decoder: %s", SDL_GetError());
+	decoder.thread = SDL_CreateThread(decoder_thread, "audio_decoder", NULL);
+	if (!decoder.thread) {
+		WARNING("SDL_CreateThread failed: %s", SDL_GetError());
+		WARNING("Audio will be decoded in the audio callback");
+		return;
+	}
+	atexit(decoder_fini);
+}
+
+/*
+ * Advance the playback position, following the loop that the decoder took.
+ */
+static void stream_advance(struct mixer_stream *ch, uint_least32_t frames)
+{
+	uint_least32_t frame = ch->frame + frames;
+	if (frame >= ch->loop_end && ch->loop_end > ch->loop_start)
+		frame = ch->loop_start + (frame - ch->loop_end) % (ch->loop_end - ch->loop_start);
+	ch->frame = frame;
+}
+
+static int refill_stream(sts_mixer_sample_t *sample, void *data)
+{
+	struct mixer_stream *ch = data;
+	memset(ch->data, 0, sizeof(float) * sample->length);
+
+	// without a decoder thread, decode in the callback
+	if (unlikely(!decoder.thread))
+		stream_decode(ch, RING_FRAMES);
+
+	// read decoded audio from the ring buffer; eof must be checked first
+	// since the decoder sets it after writing the last frames
+	bool eof = ch->eof;
+	unsigned fill = ring_fill(&ch->ring);
+	unsigned frames_read = ring_read(&ch->ring, ch->data, CHUNK_SIZE);
+	int r = STS_STREAM_CONTINUE;
+	if (eof && frames_read == fill) {
+		r = STS_STREAM_COMPLETE;
+	} else {
+		if (fill < stats.min_fill)
+			stats.min_fill = fill;
+		if (frames_read < CHUNK_SIZE)
+			stats.underruns++;
+		if (fill - frames_read < RING_FRAMES / 2)
+			SDL_SemPost(decoder.wake);
+	}
+	stream_advance(ch, frames_read);
+
+	// reverse LR channels
+	if (ch->swapped)
+		mixer_swap_stereo(ch->data, CHUNK_SIZE);
 
 	// set gain for fade
 	if (ch->fade.fading) {
@@ -236,7 +659,8 @@ static int refill_stream(sts_mixer_sample_t *sample, void *data)
 			ch->fade.fading = false;
 			ch->volume = ch->fade.end_volume * 100.0;
 			if (ch->fade.stop) {
-				cb_seek(ch, 0);
+				ch->rewind = true;
+				ch->frame = 0;
 				r = STS_STREAM_COMPLETE;
 			}
 		}
@@ -281,28 +705,39 @@ static int refill_mixer(sts_mixer_sample_t *sample, void *data)
 
 int mixer_stream_play(struct mixer_stream *ch)
 {
-	SDL_LockAudioDevice(audio_device);
-	if (ch->voice >= 0) {
-		SDL_UnlockAudioDevice(audio_device);
+	if (ch->voice >= 0)
 		return 1;
-	}
+
+	stream_lock(ch);
+	if (ch->rewind)
+		stream_seek(ch, 0);
+	else if (ch->eof && !ring_fill(&ch->ring))
+		stream_seek(ch, ch->decode_frame);
+	// make sure the first chunks are ready before the stream starts
+	stream_prime(ch);
+
+	SDL_LockAudioDevice(audio_device);
 	memset(ch->data, 0, sizeof(ch->data));
 	ch->voice = sts_mixer_play_stream(&mixers[ch->mixer_no].mixer, &ch->stream, 1.0f);
 	SDL_UnlockAudioDevice(audio_device);
+	SDL_UnlockMutex(decoder.mutex);
 	return 1;
 }
 
 int mixer_stream_stop(struct mixer_stream *ch)
 {
+	stream_lock(ch);
 	SDL_LockAudioDevice(audio_device);
 	if (ch->voice < 0) {
 		SDL_UnlockAudioDevice(audio_device);
+		SDL_UnlockMutex(decoder.mutex);
 		return 1;
 	}
-	cb_seek(ch, 0);
+	stream_seek(ch, 0);
 	sts_mixer_stop_voice(&mixers[ch->mixer_no].mixer, ch->voice);
 	ch->voice = -1;
 	SDL_UnlockAudioDevice(audio_device);
+	SDL_UnlockMutex(decoder.mutex);
 	return 1;
 }
 
@@ -313,9 +748,13 @@ int mixer_stream_is_playing(struct mixer_stream *ch)
 
 int mixer_stream_set_loop_count(struct mixer_stream *ch, int count)
 {
+	stream_lock(ch);
 	SDL_LockAudioDevice(audio_device);
 	ch->loop_count = count;
+	// audio decoded ahead followed the old loop
+	stream_seek(ch, ch->frame);
 	SDL_UnlockAudioDevice(audio_device);
+	SDL_UnlockMutex(decoder.mutex);
 	return 1;
 }
 
@@ -326,17 +765,25 @@ int mixer_stream_get_loop_count(struct mixer_stream *ch)
 
 int mixer_stream_set_loop_start_pos(struct mixer_stream *ch, int pos)
 {
+	stream_lock(ch);
 	SDL_LockAudioDevice(audio_device);
 	ch->loop_start = pos;
+	// audio decoded ahead followed the old loop
+	stream_seek(ch, ch->frame);
 	SDL_UnlockAudioDevice(audio_device);
+	SDL_UnlockMutex(decoder.mutex);
 	return 1;
 }
 
 int mixer_stream_set_loop_end_pos(struct mixer_stream *ch, int pos)
 {
+	stream_lock(ch);
 	SDL_LockAudioDevice(audio_device);
 	ch->loop_end = pos;
+	// audio decoded ahead followed the old loop
+	stream_seek(ch, ch->frame);
 	SDL_UnlockAudioDevice(audio_device);
+	SDL_UnlockMutex(decoder.mutex);
 	return 1;
 }
 
@@ -345,6 +792,7 @@ int mixer_stream_set_volume(struct mixer_stream *ch, int volume)
 	SDL_LockAudioDevice(audio_device);
 	ch->fade.fading = false;
 	ch->volume = max(0, min(100, volume));
+	SDL_UnlockAudioDevice(audio_device);
 	return 1;
 }
 
@@ -421,9 +869,11 @@ int mixer_stream_get_sample_length(struct mixer_stream *ch)
 
 int mixer_stream_seek(struct mixer_stream *ch, int pos)
 {
+	stream_lock(ch);
 	SDL_LockAudioDevice(audio_device);
-	int r = cb_seek(ch, muldiv(pos, ch->info.samplerate, 1000));
+	int r = stream_seek(ch, muldiv(pos, ch->info.samplerate, 1000));
 	SDL_UnlockAudioDevice(audio_device);
+	SDL_UnlockMutex(decoder.mutex);
 	return r;
 }
 
@@ -493,15 +943,14 @@ static SF_VIRTUAL_IO mixer_stream_vio = {
 	.tell = mixer_stream_vio_tell
 };
 
-struct mixer_stream *mixer_stream_open(struct archive_data *dfile, enum mix_channel mixer)
+// open an audio file for streaming, reading its loop info
+static bool mixer_stream_open_file(struct mixer_stream *ch, struct archive_data *dfile,
+		unsigned *loop_start, unsigned *loop_end, unsigned *loop_count)
 {
-	struct mixer_stream *ch = xcalloc(1, sizeof(struct mixer_stream));
-
 	// take ownership of archive file
 	if (!archive_data_load(dfile)) {
 		WARNING("Failed to load archive file: %s", dfile->name);
-		free(ch);
-		return NULL;
+		return false;
 	}
 	ch->dfile = dfile;
 
@@ -516,6 +965,49 @@ struct mixer_stream *mixer_stream_open(struct archive_data *dfile, enum mix_chan
 		goto error;
 	}
 
+	// get loop info from WAV file
+	SF_INSTRUMENT instr;
+	if (sf_command(ch->file, SFC_GET_INSTRUMENT, &instr, sizeof(instr)) == SF_TRUE) {
+		if (instr.loop_count > 0) {
+			*loop_start = instr.loops[0].start;
+			*loop_end = instr.loops[0].end;
+			*loop_count = instr.loops[0].count;
+		}
+	}
+
+	// decode short sounds into the cache
+	if ((ch->clip = pcm_cache_decode(ch, dfile, *loop_start, *loop_end, *loop_count))) {
+		sf_close(ch->file);
+		ch->file = NULL;
+		archive_data_release(dfile);
+		ch->dfile = NULL;
+	}
+	return true;
+
+error:
+	if (ch->file)
+		sf_close(ch->file);
+	archive_data_release(dfile);
+	return false;
+}
+
+struct mixer_stream *mixer_stream_open(struct archive_data *dfile, enum mix_channel mixer)
+{
+	struct mixer_stream *ch = xcalloc(1, sizeof(struct mixer_stream));
+
+	unsigned loop_start = 0;
+	unsigned loop_end = 0;
+	unsigned loop_count = 0;
+	if ((ch->clip = pcm_cache_get(dfile))) {
+		ch->info = ch->clip->info;
+		loop_start = ch->clip->loop_start;
+		loop_end = ch->clip->loop_end;
+		loop_count = ch->clip->loop_count;
+	} else if (!mixer_stream_open_file(ch, dfile, &loop_start, &loop_end, &loop_count)) {
+		free(ch);
+		return NULL;
+	}
+
 	// create stream
 	ch->stream.userdata = ch;
 	ch->stream.callback = refill_stream;
@@ -528,19 +1020,6 @@ struct mixer_stream *mixer_stream_open(struct archive_data *dfile, enum mix_chan
 	ch->volume = 100;
 	ch->mixer_no = mixer;
 
-	// get loop info from WAV file
-	unsigned loop_start = 0;
-	unsigned loop_end = 0;
-	unsigned loop_count = 0;
-	SF_INSTRUMENT instr;
-	if (sf_command(ch->file, SFC_GET_INSTRUMENT, &instr, sizeof(instr)) == SF_TRUE) {
-		if (instr.loop_count > 0) {
-			loop_start = instr.loops[0].start;
-			loop_end = instr.loops[0].end;
-			loop_count = instr.loops[0].count;
-		}
-	}
-
 	if (loop_start != loop_end) {
 		ch->loop_start = loop_start;
 		ch->loop_end = loop_end;
@@ -551,19 +1030,27 @@ struct mixer_stream *mixer_stream_open(struct archive_data *dfile, enum mix_chan
 		ch->loop_count = 1;
 	}
 
+	SDL_LockMutex(decoder.mutex);
+	TAILQ_INSERT_TAIL(&decoder.streams, ch, entry);
+	stats.streams++;
+	SDL_UnlockMutex(decoder.mutex);
+	SDL_SemPost(decoder.wake);
 	return ch;
-
-error:
-	archive_data_release(dfile);
-	free(ch);
-	return NULL;
 }
 
 void mixer_stream_close(struct mixer_stream *ch)
 {
 	mixer_stream_stop(ch);
-	sf_close(ch->file);
-	archive_data_release(ch->dfile);
+	stream_lock(ch);
+	TAILQ_REMOVE(&decoder.streams, ch, entry);
+	stats.streams--;
+	SDL_UnlockMutex(decoder.mutex);
+	if (ch->clip) {
+		pcm_cache_put(ch->clip);
+	} else {
+		sf_close(ch->file);
+		archive_data_release(ch->dfile);
+	}
 	free(ch);
 }
 
@@ -601,6 +1088,9 @@ void mixer_init(void)
 		mixers[i].voice = sts_mixer_play_stream(&mixers[i].parent->mixer, &mixers[i].stream, 1.0f);
 	}
 
+	TAILQ_INIT(&pcm_cache.clips);
+	decoder_init();
+
 	// initialize SDL audio
 	SDL_AudioSpec have;
 	SDL_AudioSpec want = {
@@ -614,6 +1104,24 @@ void mixer_init(void)
 	SDL_PauseAudioDevice(audio_device, 0);
 }
 
+void mixer_stream_stats(struct mixer_stream_stats *out)
+{
+	SDL_LockMutex(decoder.mutex);
+	out->underruns = stats.underruns;
+	out->frames_decoded = stats.frames_decoded;
+	out->frames_primed = stats.frames_primed;
+	out->streams = stats.streams;
+	out->ring_frames = RING_FRAMES;
+	out->min_fill = stats.min_fill;
+	out->fill = RING_FRAMES;
+	struct mixer_stream *ch;
+	TAILQ_FOREACH(ch, &decoder.streams, entry) {
+		if (ch->voice >= 0 && !ch->eof)
+			out->fill = min(out->fill, ring_fill(&ch->ring));
+	}
+	SDL_UnlockMutex(decoder.mutex);
+}
+
 int mixer_get_numof(void)
 {
 	return nr_mixers;
@@ -147,3 +147,15 @@ void backlog_push_byte(uint8_t b)
 	data[e->ptr++] = b;
 	data[e->ptr] = 0;
 }
+
+void backlog_push_bytes(const uint8_t *b, unsigned n)
+{
+	struct backlog_entry *e = &backlog[backlog_head];
+	if (e->ptr + n > MEMORY_BACKLOG_DATA_SIZE)
+		VM_ERROR("Backlog buffer overflow");
+
+	uint8_t *data = backlog_data(backlog_head);
+	memcpy(data + e->ptr, b, n);
+	e->ptr += n;
+	data[e->ptr] = 0;
+}
@@ -0,0 +1,248 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Headless benchmark mode.
+ *
+ * The game runs with SDL's dummy video and audio drivers against a virtual
+ * clock: delays advance the clock instead of sleeping, so virtual time only
+ * depends on how long the game waits and not on how often it reads the clock.
+ * Input is scripted so that waits for a key press (and for its release)
+ * complete immediately. The run ends after a fixed number of statements or
+ * virtual seconds, and statistics are printed at exit. The limits are also
+ * checked when the clock is read or advanced, so that wait loops which never
+ * return to the VM can't run forever.
+ */
+
+#include <SDL.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "nulib.h"
+
+#include "ai5.h"
+#include "alloc_stats.h"
+#include "asset.h"
+#include "bench.h"
+#include "gfx.h"
+#include "input.h"
+#include "map.h"
+#ifdef HAVE_FFMPEG
+#include "movie.h"
+#endif
+#include "mixer.h"
+#include "savedata.h"
+#include "vm.h"
+
+static struct {
+	// virtual clock
+	uint64_t time_us;
+	// real time at start of benchmark
+	uint64_t start;
+	bool activate_down;
+} bench = {0};
+
+// format a power-of-two histogram as "<1:n <2:n ... >=2^k:n"
+static const char *histogram_str(const unsigned long *hist, unsigned nr_buckets)
+{
+	static char buf[512];
+	size_t len = 0;
+	buf[0] = '\0';
+	for (unsigned i = 0; i < nr_buckets && len < sizeof(buf); i++) {
+		if (i < nr_buckets - 1)
+			len += snprintf(buf + len, sizeof(buf) - len, "%s<%llu:%lu",
+					i ? " " : "", 1ull << i, hist[i]);
+		else
+			len += snprintf(buf + len, sizeof(buf) - len, " >=%llu:%lu",
+					1ull << (i - 1), hist[i]);
+	}
+	return buf;
+}
+
+static long peak_rss_kib(void)
+{
+#ifdef _WIN32
+	return -1;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage))
+		return -1;
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+#endif
+}
+
+static void bench_fini(void)
+{
+	double t = (double)(SDL_GetPerformanceCounter() - bench.start)
+		/ SDL_GetPerformanceFrequency();
+	struct gfx_update_stats gfx_stats;
+	struct asset_cg_stats cg_stats;
+	struct asset_path_stats fs_stats;
+	struct map_draw_stats map_stats;
+	struct map_path_stats path_stats;
+	gfx_update_stats(&gfx_stats);
+	asset_cg_stats(&cg_stats);
+	asset_path_stats(&fs_stats);
+	map_draw_stats(&map_stats);
+	map_path_stats(&path_stats);
+
+	NOTICE("bench: %lu statements in %.2fs (%.0f statements/s)", vm_stats.statements,
+			t, t > 0 ? vm_stats.statements / t : 0);
+	NOTICE("bench: %.2fs virtual time", bench.time_us / 1000000.0);
+	NOTICE("bench: %lu frames rendered (%llu pixels uploaded)", gfx_stats.frames,
+			(unsigned long long)gfx_stats.pixels_uploaded);
+	if (gfx_stats.frames) {
+		NOTICE("bench: frame time: %.0f us convert, %.0f us upload, %.0f us present",
+				(double)gfx_stats.convert_us / gfx_stats.frames,
+				(double)gfx_stats.upload_us / gfx_stats.frames,
+				(double)gfx_stats.present_us / gfx_stats.frames);
+	}
+	NOTICE("bench: %lu CG decodes (%lu cache hits, %lu prefetched)",
+			cg_stats.misses + cg_stats.waits + cg_stats.prefetch_hits,
+			cg_stats.hits, cg_stats.prefetch_hits + cg_stats.waits);
+	NOTICE("bench: %lu path lookups (%lu misses, %lu directory scans)",
+			fs_stats.lookups, fs_stats.misses, fs_stats.dir_scans);
+	NOTICE("bench: %lu MES loads (%lu cache hits)", vm_stats.mes_loads,
+			vm_stats.mes_cache_hits);
+	for (int logged = 0; logged < 2; logged++) {
+		if (!vm_stats.text_bytes[logged])
+			continue;
+		double secs = (double)vm_stats.text_ticks[logged] / SDL_GetPerformanceFrequency();
+		NOTICE("bench: %llu text bytes read%s (%.1f MB/s)", vm_stats.text_bytes[logged],
+				logged ? " to the backlog" : "",
+				secs > 0 ? vm_stats.text_bytes[logged] / secs / 1000000.0 : 0);
+	}
+	if (map_stats.frames) {
+		NOTICE("bench: %lu map frames (%lu full redraws, %lu scrolls),"
+				" %.1f tiles/frame, %.0f bytes dirtied/frame",
+				map_stats.frames, map_stats.full_redraws, map_stats.scrolls,
+				(double)map_stats.tiles_blitted / map_stats.frames,
+				(double)map_stats.bytes_dirtied / map_stats.frames);
+	}
+	if (path_stats.searches) {
+		NOTICE("bench: %lu path searches (%lu failed), %.1f nodes/path, %.1f us/path",
+				path_stats.searches, path_stats.failures,
+				(double)path_stats.nodes_expanded / path_stats.searches,
+				(double)path_stats.time_us / path_stats.searches);
+	}
+#ifndef USE_SDL_MIXER
+	struct mixer_stream_stats audio_stats;
+	mixer_stream_stats(&audio_stats);
+	NOTICE("bench: %llu audio frames decoded (%llu on the main thread), %lu underruns"
+			" (min ring fill %u/%u frames)",
+			(unsigned long long)audio_stats.frames_decoded,
+			(unsigned long long)audio_stats.frames_primed, audio_stats.underruns,
+			audio_stats.min_fill, audio_stats.ring_frames);
+	struct mixer_sound_cache_stats sound_stats;
+	mixer_sound_cache_stats(&sound_stats);
+	NOTICE("bench: %lu sounds decoded (%lu cache hits, %.1f ms decode time saved)",
+			sound_stats.misses, sound_stats.hits, sound_stats.saved_ms);
+#endif
+#ifdef ALLOC_STATS
+	struct alloc_stats a_stats;
+	alloc_stats(&a_stats);
+	NOTICE("bench: %lu heap allocations (%lu in the audio callback)", a_stats.allocs,
+			a_stats.realtime_allocs);
+#endif
+#ifdef HAVE_FFMPEG
+	struct movie_stats mv_stats;
+	movie_stats(&mv_stats);
+	if (mv_stats.frames_displayed) {
+		unsigned long n = mv_stats.frames_displayed;
+		NOTICE("bench: %lu movie frames (%lu dropped, %lu late, %lu audio underruns)",
+				n, mv_stats.frames_dropped, mv_stats.frames_late,
+				mv_stats.audio_underruns);
+		NOTICE("bench: movie queues: %.1f frames, %.1f video packets, %.1f audio packets",
+				(double)mv_stats.video_frames_queued / n,
+				(double)mv_stats.video_packets_queued / n,
+				(double)mv_stats.audio_packets_queued / n);
+		NOTICE("bench: movie frame time: %.0f us convert (%lu frames), %.0f us upload",
+				mv_stats.frames_converted
+					? (double)mv_stats.convert_us / mv_stats.frames_converted : 0,
+				mv_stats.frames_converted, (double)mv_stats.upload_us / n);
+	}
+#endif
+	struct savedata_stats save_stats;
+	savedata_stats(&save_stats);
+	if (save_stats.operations) {
+		NOTICE("bench: %lu save operations, %lu loads, %lu flushes (%.2f file calls/op)",
+				save_stats.operations, save_stats.loads, save_stats.flushes,
+				(double)save_stats.io_calls / save_stats.operations);
+		if (save_stats.write_failures)
+			NOTICE("bench: %lu failed save writes", save_stats.write_failures);
+		NOTICE("bench: save queue depth: %s", histogram_str(save_stats.queue_depth,
+					SAVEDATA_QUEUE_BUCKETS));
+		NOTICE("bench: save write latency (ms): %s",
+				histogram_str(save_stats.write_latency, SAVEDATA_LATENCY_BUCKETS));
+	}
+	long rss = peak_rss_kib();
+	if (rss >= 0)
+		NOTICE("bench: peak RSS %ld KiB", rss);
+}
+
+void bench_init(void)
+{
+	SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+	SDL_setenv("SDL_AUDIODRIVER", "dummy", 1);
+	bench.start = SDL_GetPerformanceCounter();
+	atexit(bench_fini);
+}
+
+static void bench_check_limits(void)
+{
+	if (config.bench_statements && vm_stats.statements >= config.bench_statements)
+		sys_exit(0);
+	if (config.bench_seconds && bench.time_us >= config.bench_seconds * 1000000ull)
+		sys_exit(0);
+}
+
+uint32_t bench_get_ticks(void)
+{
+	bench_check_limits();
+	return bench.time_us / 1000;
+}
+
+uint64_t bench_time_us(void)
+{
+	return bench.time_us;
+}
+
+void bench_delay(int ms)
+{
+	if (ms > 0)
+		bench.time_us += (uint64_t)ms * 1000;
+	bench_check_limits();
+}
+
+bool bench_input_down(enum input_event_type type)
+{
+	if (type != INPUT_ACTIVATE)
+		return false;
+	// alternate between pressed and released so that waiting for a press
+	// and then for the release both complete
+	bench.activate_down = !bench.activate_down;
+	return bench.activate_down;
+}
+
+void bench_statement(void)
+{
+	bench_check_limits();
+}
@@ -314,8 +314,14 @@ static void beyond_graphics_blend_masked(struct param_list *params)
 	int dst_y = vm_expr_param(params, 10);
 	unsigned dst_i = vm_expr_param(params, 11);
 	uint8_t *mask = memory_raw + vm_expr_param(params, 12);
+	if (!mem_ptr_valid(mask, 4))
+		VM_ERROR("Invalid mask pointer: 0x%x", params->params[12].val);
+	int mask_w = le_get16(mask, 0);
+	int mask_h = le_get16(mask, 2);
+	if (!mem_ptr_valid(mask + 4, mask_w * mask_h))
+		VM_ERROR("Invalid mask size: %dx%d", mask_w, mask_h);
 	gfx_blend_with_mask_color_to(a_x, a_y, w, h, a_i, b_x, b_y, b_i, dst_x, dst_y, dst_i,
-			le_get16(mask, 0), le_get16(mask, 2), mask + 4);
+			mask_w, mask_h, mask + 4);
 }
 
 static void beyond_graphics_crossfade(struct param_list *params)
@@ -28,6 +28,7 @@
 #include "debug.h"
 #include "gfx_private.h"
 #include "memory.h"
+#include "profile.h"
 #include "vm.h"
 
 #if 0
@@ -287,6 +288,23 @@ static int dbg_cmd_vm_state(unsigned nr_args, char **args)
 	return DBG_REPL;
 }
 
+static int dbg_cmd_profile(unsigned nr_args, char **args)
+{
+	if (nr_args == 0) {
+		profile_print();
+	} else if (!strcmp(args[0], "on")) {
+		profile_enable(true);
+		profile_set_mes(mem_mes_name());
+	} else if (!strcmp(args[0], "off")) {
+		profile_enable(false);
+	} else if (!strcmp(args[0], "reset")) {
+		profile_reset();
+	} else {
+		printf("Invalid argument: %s\n", args[0]);
+	}
+	return DBG_REPL;
+}
+
 static int dbg_cmd_help(unsigned nr_args, char **args)
 {
 	cmdline_help(dbg_cmdline, nr_args, args);
@@ -299,6 +317,7 @@ static struct cmdline_cmd dbg_commands[] = {
 	{ "continue", "c", NULL, "Continue running", 0, 0, dbg_cmd_continue },
 	{ "help", "h", NULL, "Display debugger help", 0, 2, dbg_cmd_help },
 	{ "map", NULL, NULL, "Display memory map", 0, 0, dbg_cmd_map },
+	{ "profile", "prof", "[on|off|reset]", "Display or control the VM profiler", 0, 1, dbg_cmd_profile },
 	{ "quit", "q", NULL, "Quit AI5-SDL2", 0, 0, dbg_cmd_quit },
 	{ "get-flag", NULL, "<flag-number>", "Get a flag", 1, 1, dbg_cmd_get_flag },
 	{ "set-flag", NULL, "<flag-number> <value>", "Set a flag", 2, 2, dbg_cmd_set_flag },
@@ -848,7 +848,7 @@ static void dungeon_draw_view(enum dungeon_view_mode mode)
 
 	gfx_whole_surface_dirty(dst_i);
 	vm_timer_tick(&timer, move_frame_time[dungeon_speed]);
-	gfx_update();
+	gfx_flush();
 }
 
 void dungeon_draw(void)
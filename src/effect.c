@@ -33,6 +33,7 @@ void transition_update(vm_timer_t *timer, unsigned dst_i, unsigned ms)
 	// FIXME: use gfx_dirty with damage coordinates
 	gfx_whole_surface_dirty(dst_i);
 	vm_peek();
+	gfx_flush();
 	vm_timer_tick(timer, ms * config.transition_speed);
 }
 
@@ -542,7 +543,7 @@ void gfx_scale_h(unsigned i, int mag)
 	}
 
 	gfx_whole_surface_dirty(i);
-	gfx_update();
+	gfx_flush();
 }
 
 void gfx_zoom(int src_x, int src_y, int w, int h, unsigned src_i, unsigned dst_i,
@@ -26,6 +26,7 @@
 #include "ai5/cg.h"
 
 #include "ai5.h"
+#include "bench.h"
 #include "game.h"
 #include "gfx_private.h"
 #include "vm.h"
@@ -70,12 +71,73 @@ bool gfx_confirm_quit(void)
 
 struct gfx gfx = {0};
 struct gfx_view gfx_view = { 640, 400 };
+static struct gfx_update_stats update_stats = {0};
+
+// frame pacing (in performance counter ticks)
+static uint64_t present_interval = 0;
+static uint64_t last_present = 0;
+static uint64_t init_time = 0;
+
+// frames are paced against the virtual clock in benchmark mode
+static uint64_t present_clock(void)
+{
+	if (config.bench)
+		return bench_time_us();
+	return SDL_GetPerformanceCounter();
+}
+
+static uint64_t elapsed_us(uint64_t start)
+{
+	return (SDL_GetPerformanceCounter() - start) * 1000000 / SDL_GetPerformanceFrequency();
+}
+
+static int rect_area(const SDL_Rect *r)
+{
+	return r->w * r->h;
+}
+
+/*
+ * Returns true if two damaged rectangles should be merged. Overlapping
+ * rectangles are always merged so that the damage list stays disjoint.
+ * Otherwise they are merged if the bounding rectangle doesn't waste more
+ * than a quarter of its area.
+ */
+static bool damage_should_merge(const SDL_Rect *a, const SDL_Rect *b, SDL_Rect *u)
+{
+	SDL_UnionRect(a, b, u);
+	if (SDL_HasIntersection(a, b))
+		return true;
+	return (rect_area(a) + rect_area(b)) * 4 >= rect_area(u) * 3;
+}
 
 void gfx_dirty(unsigned surface, int x, int y, int w, int h)
 {
-	gfx.surface[surface].dirty = true;
+	struct gfx_surface *s = &gfx.surface[surface];
 	SDL_Rect r = { x, y, w, h };
-	SDL_UnionRect(&gfx.surface[surface].damaged, &r, &gfx.surface[surface].damaged);
+	if (unlikely(!s->s || !gfx_fill_clip(s->s, &r)))
+		return;
+
+	s->dirty = true;
+	s->generation++;
+	for (unsigned i = 0; i < s->nr_damaged;) {
+		SDL_Rect u;
+		if (!damage_should_merge(&s->damaged[i], &r, &u)) {
+			i++;
+			continue;
+		}
+		// absorb damaged[i] and rescan, since the union may now overlap
+		// rectangles that were already checked
+		r = u;
+		s->damaged[i] = s->damaged[--s->nr_damaged];
+		i = 0;
+	}
+
+	if (s->nr_damaged >= GFX_MAX_DAMAGED) {
+		s->nr_damaged = 1;
+		s->damaged[0] = (SDL_Rect) { 0, 0, s->s->w, s->s->h };
+		return;
+	}
+	s->damaged[s->nr_damaged++] = r;
 }
 
 bool gfx_is_dirty(unsigned surface)
@@ -86,13 +148,24 @@ bool gfx_is_dirty(unsigned surface)
 void gfx_clean(unsigned surface)
 {
 	gfx.surface[surface].dirty = false;
-	gfx.surface[surface].damaged = (SDL_Rect){0};
+	gfx.surface[surface].nr_damaged = 0;
 }
 
 void gfx_screen_dirty(void)
 {
 	gfx.surface[gfx.screen].dirty = true;
-	gfx.surface[gfx.screen].damaged = gfx.surface[gfx.screen].src;
+	gfx.surface[gfx.screen].nr_damaged = 1;
+	gfx.surface[gfx.screen].damaged[0] = gfx.surface[gfx.screen].src;
+}
+
+void gfx_update_stats(struct gfx_update_stats *stats)
+{
+	*stats = update_stats;
+}
+
+uint32_t gfx_surface_generation(unsigned surface)
+{
+	return gfx.surface[surface].generation;
 }
 
 void gfx_whole_surface_dirty(unsigned surface)
@@ -152,6 +225,15 @@ static SDL_Texture *gfx_create_texture(unsigned w, unsigned h)
 	return t;
 }
 
+// the screen texture is written through SDL_LockTexture in gfx_flush
+static SDL_Texture *gfx_create_screen_texture(void)
+{
+	SDL_Texture *t;
+	SDL_CTOR(SDL_CreateTexture, t, gfx.renderer, gfx.display->format->format,
+			SDL_TEXTUREACCESS_STREAMING, gfx_view.w, gfx_view.h);
+	return t;
+}
+
 SDL_Surface *gfx_get_overlay(void)
 {
 	if (gfx.overlay)
@@ -276,6 +358,10 @@ static void gfx_init_window(void)
 	SDL_FreeSurface(gfx.display);
 	SDL_FreeSurface(gfx.scaled_display);
 	SDL_DestroyTexture(gfx.texture);
+	if (gfx.fade_mask) {
+		SDL_DestroyTexture(gfx.fade_mask);
+		gfx.fade_mask = NULL;
+	}
 
 	// recreate and initialize surfaces/texture
 	for (int i = 0; i < GFX_NR_SURFACES; i++) {
@@ -293,7 +379,7 @@ static void gfx_init_window(void)
 		gfx.surface[i].dst = (SDL_Rect) { 0, 0, w, h };
 		gfx.surface[i].scaled = false;
 		gfx.surface[i].dirty = false;
-		gfx.surface[i].damaged = (SDL_Rect) {0};
+		gfx.surface[i].nr_damaged = 0;
 	}
 	gfx_screen_dirty();
 
@@ -305,7 +391,7 @@ static void gfx_init_window(void)
 	SDL_CALL(SDL_FillRect, gfx.scaled_display, NULL,
 			SDL_MapRGB(gfx.scaled_display->format, 0, 0, 0));
 
-	gfx.texture = gfx_create_texture(gfx_view.w, gfx_view.h);
+	gfx.texture = gfx_create_screen_texture();
 }
 
 void gfx_set_icon(void)
@@ -336,6 +422,25 @@ static void gfx_fini(void)
 	gfx_screen_dirty();
 }
 
+static void gfx_print_frame_stats(void)
+{
+	double t = (double)(SDL_GetPerformanceCounter() - init_time)
+		/ SDL_GetPerformanceFrequency();
+	unsigned long frames = update_stats.frames;
+	NOTICE("%lu presents in %.2fs (%.2f presents/s)", frames, t, t > 0 ? frames / t : 0);
+	NOTICE("%lu statements (%.2f statements/present)", vm_stats.statements,
+			frames ? (double)vm_stats.statements / frames : 0);
+	NOTICE("%llu pixels uploaded (%.0f pixels/present)",
+			(unsigned long long)update_stats.pixels_uploaded,
+			frames ? (double)update_stats.pixels_uploaded / frames : 0);
+	if (frames) {
+		NOTICE("frame time: %.0f us convert, %.0f us upload, %.0f us present",
+				(double)update_stats.convert_us / frames,
+				(double)update_stats.upload_us / frames,
+				(double)update_stats.present_us / frames);
+	}
+}
+
 void gfx_init(const char *name)
 {
 	char title[2048];
@@ -354,35 +459,130 @@ void gfx_init(const char *name)
 			SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, gfx_view.w, gfx_view.h,
 			SDL_WINDOW_RESIZABLE);
 	gfx.window_id = SDL_GetWindowID(gfx.window);
-	SDL_CTOR(SDL_CreateRenderer, gfx.renderer, gfx.window, -1, 0);
+	SDL_CTOR(SDL_CreateRenderer, gfx.renderer, gfx.window, -1,
+			config.vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
 	SDL_CALL(SDL_SetRenderDrawColor, gfx.renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
 	gfx_init_window();
 	atexit(gfx_fini);
+
+	if (config.frame_rate) {
+		uint64_t freq = config.bench ? 1000000 : SDL_GetPerformanceFrequency();
+		present_interval = freq / config.frame_rate;
+	}
+	init_time = SDL_GetPerformanceCounter();
+	if (config.frame_stats)
+		atexit(gfx_print_frame_stats);
 }
 
+/*
+ * Present the screen if it is dirty and at least one frame interval has
+ * elapsed since the last present. This is called after every VM statement,
+ * so scripts which draw many times per frame are only presented once.
+ */
 void gfx_update(void)
 {
 	struct gfx_surface *screen = &gfx.surface[gfx.screen];
 	if (gfx.hidden || !screen->dirty)
 		return;
-	SDL_CALL(SDL_BlitSurface, screen->s, &screen->damaged, gfx.display, &screen->damaged);
-	if (gfx.overlay && gfx_overlay_enabled)
-		SDL_CALL(SDL_BlitSurface, gfx.overlay, &screen->damaged, gfx.display, &screen->damaged);
+	if (present_interval && present_clock() - last_present < present_interval)
+		return;
+	gfx_flush();
+}
+
+// blit the damaged part of the screen (and overlay) into `dst`
+static void blit_damaged(struct gfx_surface *screen, SDL_Surface *dst)
+{
+	for (unsigned i = 0; i < screen->nr_damaged; i++) {
+		SDL_Rect r = screen->damaged[i];
+		SDL_Rect dst_r = r;
+		SDL_CALL(SDL_BlitSurface, screen->s, &r, dst, &dst_r);
+		if (gfx.overlay && gfx_overlay_enabled) {
+			dst_r = r;
+			SDL_CALL(SDL_BlitSurface, gfx.overlay, &r, dst, &dst_r);
+		}
+	}
+}
+
+/*
+ * Present the screen immediately if it is dirty. This should be called before
+ * blocking (waits, delays, transitions) so that the last frame isn't held back
+ * by frame pacing.
+ */
+void gfx_flush(void)
+{
+	struct gfx_surface *screen = &gfx.surface[gfx.screen];
+	if (gfx.hidden || !screen->dirty)
+		return;
+
+	uint64_t convert_us = 0, upload_us = 0;
+	unsigned pixels = 0;
 	if (screen->scaled) {
+		uint64_t start = SDL_GetPerformanceCounter();
+		blit_damaged(screen, gfx.display);
 		SDL_Rect src = screen->src;
 		SDL_Rect dst = screen->dst;
 		SDL_CALL(SDL_BlitScaled, gfx.display, &src, gfx.scaled_display, &dst);
+		convert_us = elapsed_us(start);
+		start = SDL_GetPerformanceCounter();
 		SDL_CALL(SDL_UpdateTexture, gfx.texture, NULL, gfx.scaled_display->pixels,
 				gfx.scaled_display->pitch);
+		upload_us = elapsed_us(start);
+		pixels = gfx.scaled_display->w * gfx.scaled_display->h;
+		update_stats.frame_rects_uploaded = 1;
 	} else {
-		uint8_t *p = gfx.display->pixels + screen->damaged.y * gfx.display->pitch
-			+ screen->damaged.x * gfx.display->format->BytesPerPixel;
-		SDL_CALL(SDL_UpdateTexture, gfx.texture, &screen->damaged, p, gfx.display->pitch);
+		// Convert each damaged rectangle straight into the locked texture.
+		// The display surface is skipped entirely.
+		for (unsigned i = 0; i < screen->nr_damaged; i++) {
+			SDL_Rect r = screen->damaged[i];
+			if (!gfx_fill_clip(gfx.display, &r))
+				continue;
+			uint64_t start = SDL_GetPerformanceCounter();
+			void *p;
+			int pitch;
+			SDL_CALL(SDL_LockTexture, gfx.texture, &r, &p, &pitch);
+			SDL_Surface *dst;
+			SDL_CTOR(SDL_CreateRGBSurfaceWithFormatFrom, dst, p, r.w, r.h,
+					GFX_DIRECT_BPP, pitch, GFX_DIRECT_FORMAT);
+			upload_us += elapsed_us(start);
+
+			start = SDL_GetPerformanceCounter();
+			SDL_Rect src_r = r;
+			SDL_Rect dst_r = { 0, 0, r.w, r.h };
+			SDL_CALL(SDL_BlitSurface, screen->s, &src_r, dst, &dst_r);
+			if (gfx.overlay && gfx_overlay_enabled) {
+				src_r = r;
+				dst_r = (SDL_Rect) { 0, 0, r.w, r.h };
+				SDL_CALL(SDL_BlitSurface, gfx.overlay, &src_r, dst, &dst_r);
+			}
+			SDL_FreeSurface(dst);
+			convert_us += elapsed_us(start);
+
+			start = SDL_GetPerformanceCounter();
+			SDL_UnlockTexture(gfx.texture);
+			upload_us += elapsed_us(start);
+			pixels += r.w * r.h;
+		}
+		update_stats.frame_rects_uploaded = screen->nr_damaged;
 	}
+	update_stats.frames++;
+	update_stats.pixels_uploaded += pixels;
+	update_stats.frame_pixels_uploaded = pixels;
+	update_stats.convert_us += convert_us;
+	update_stats.upload_us += upload_us;
+
+	uint64_t start = SDL_GetPerformanceCounter();
 	SDL_CALL(SDL_RenderClear, gfx.renderer);
 	SDL_CALL(SDL_RenderCopy, gfx.renderer, gfx.texture, NULL, NULL);
 	SDL_RenderPresent(gfx.renderer);
+	update_stats.present_us += elapsed_us(start);
+	last_present = present_clock();
 	gfx_clean(gfx.screen);
+
+	// a fade in now starts from this frame rather than the fade out color
+	if (gfx.fade_mask) {
+		SDL_DestroyTexture(gfx.fade_mask);
+		gfx.fade_mask = NULL;
+	}
 }
 
 void gfx_display_freeze(void)
@@ -439,6 +639,11 @@ void _gfx_display_fade_out(uint32_t vm_color, unsigned ms, bool(*cb)(void))
 	SDL_CALL(SDL_RenderClear, gfx.renderer);
 	SDL_CALL(SDL_RenderCopy, gfx.renderer, mask, NULL, NULL);
 	SDL_RenderPresent(gfx.renderer);
+
+	// keep the mask for a following fade in
+	if (gfx.fade_mask)
+		SDL_DestroyTexture(gfx.fade_mask);
+	gfx.fade_mask = mask;
 }
 
 void gfx_display_fade_out(uint32_t vm_color, unsigned ms)
@@ -451,8 +656,14 @@ void _gfx_display_fade_in(unsigned ms, bool(*cb)(void))
 	GFX_LOG("gfx_display_fade_in(%u)", ms);
 
 	int step = roundf(256.f / ((ms * config.transition_speed) / FADE_FRAME_TIME));
-	SDL_Texture *mask = gfx_create_texture(gfx_view.w, gfx_view.h);
-	SDL_CALL(SDL_UpdateTexture, mask, NULL, gfx.display->pixels, gfx.display->pitch);
+	// Fade from the color of a preceding fade out, or else from the frame
+	// in the screen texture (the display surface isn't kept up to date).
+	SDL_Texture *mask = gfx.fade_mask;
+	gfx.fade_mask = NULL;
+	if (!mask) {
+		mask = gfx.texture;
+		gfx.texture = gfx_create_screen_texture();
+	}
 	SDL_CALL(SDL_SetTextureBlendMode, mask, SDL_BLENDMODE_BLEND);
 
 	SDL_CALL(SDL_BlitSurface, gfx.surface[gfx.screen].s, NULL, gfx.display, NULL);
@@ -475,6 +686,7 @@ void _gfx_display_fade_in(unsigned ms, bool(*cb)(void))
 	SDL_CALL(SDL_RenderClear, gfx.renderer);
 	SDL_CALL(SDL_RenderCopy, gfx.renderer, gfx.texture, NULL, NULL);
 	SDL_RenderPresent(gfx.renderer);
+	SDL_DestroyTexture(mask);
 
 	gfx.hidden = false;
 	gfx_screen_dirty();
@@ -654,7 +866,7 @@ static void _gfx_palette_crossfade(SDL_Color *new, unsigned ms)
 
 		// update
 		vm_peek();
-		SDL_Delay(16);
+		vm_delay(16);
 		t = vm_get_ticks() - start_t;
 	}
 
@@ -1028,18 +1240,26 @@ void gfx_blend(int src_x, int src_y, int w, int h, unsigned src_i, int dst_x, in
 }
 
 _Static_assert(GFX_DIRECT_FORMAT == SDL_PIXELFORMAT_RGB24);
-static void alpha_blend_to(uint8_t *bg, uint8_t *fg, uint8_t *dst, uint8_t alpha)
-{
-	uint32_t a = (uint32_t)alpha + 1;
-	uint32_t inv_a = 256 - (uint32_t)alpha;
-	dst[0] = (uint8_t)((a * fg[0] + inv_a * bg[0]) >> 8);
-	dst[1] = (uint8_t)((a * fg[1] + inv_a * bg[1]) >> 8);
-	dst[2] = (uint8_t)((a * fg[2] + inv_a * bg[2]) >> 8);
-}
 
-static void alpha_blend(uint8_t *bg, uint8_t *fg, uint8_t alpha)
+/*
+ * Expand a row of mask values into per-byte blend weights (see gfx_blend.c).
+ * The returned buffer is reused between calls.
+ */
+static uint16_t *blend_weights(const uint8_t *mask, const uint16_t lut[256], int w)
 {
-	alpha_blend_to(bg, fg, bg, alpha);
+	static uint16_t *buf = NULL;
+	static int buf_w = 0;
+	if (w > buf_w) {
+		buf = xrealloc(buf, w * 3 * sizeof(uint16_t));
+		buf_w = w;
+	}
+	for (int i = 0; i < w; i++) {
+		uint16_t v = lut[mask[i]];
+		buf[i*3+0] = v;
+		buf[i*3+1] = v;
+		buf[i*3+2] = v;
+	}
+	return buf;
 }
 
 void gfx_blend_masked(int src_x, int src_y, int w, int h, unsigned src_i, int dst_x,
@@ -1057,17 +1277,18 @@ void gfx_blend_masked(int src_x, int src_y, int w, int h, unsigned src_i, int ds
 	if (!gfx_copy_begin(src, &src_r, dst, &dst_p))
 		return;
 
-	direct_foreach_px2(src_px, dst_px, src, &src_r, dst, &dst_p,
-		// FIXME: handle all mask types
-		if (*mask == 0) {
-			// nothing
-		} else if (*mask > 15) {
-			memcpy(dst_px, src_px, GFX_DIRECT_BPP / 8);
-		} else {
-			alpha_blend(dst_px, src_px, *mask * 16 - 8);
-		}
-		mask++;
-	);
+	// FIXME: handle all mask types
+	static uint16_t lut[256] = {0};
+	if (!lut[1]) {
+		for (int i = 1; i < 256; i++)
+			lut[i] = i > 15 ? 256 : i * 16 - 7;
+	}
+	for (int row = 0; row < src_r.h; row++, mask += src_r.w) {
+		uint8_t *src_px = DIRECT_PIXEL_P(src, src_r.x, src_r.y + row);
+		uint8_t *dst_px = DIRECT_PIXEL_P(dst, dst_p.x, dst_p.y + row);
+		uint16_t *w = blend_weights(mask, lut, src_r.w);
+		gfx_blend_row(dst_px, dst_px, src_px, w, src_r.w * 3);
+	}
 
 	gfx_dirty(dst_i, dst_x, dst_y, w, h);
 }
@@ -1087,6 +1308,11 @@ void gfx_blend_with_mask_color_to(int a_x, int a_y, int w, int h, unsigned a_i,
 		return;
 	if (unlikely(dst_x < 0 || dst_y < 0 || dst_x + w > dst->w || dst_y + h > dst->h))
 		return;
+	// the mask covers surface a
+	if (unlikely(a_x + w > mask_w || a_y + h > mask_h)) {
+		WARNING("Mask too small: %dx%d (need %dx%d)", mask_w, mask_h, a_x + w, a_y + h);
+		return;
+	}
 
 	if (SDL_MUSTLOCK(a))
 		SDL_CALL(SDL_LockSurface, a);
@@ -1095,21 +1321,19 @@ void gfx_blend_with_mask_color_to(int a_x, int a_y, int w, int h, unsigned a_i,
 	if (SDL_MUSTLOCK(dst))
 		SDL_CALL(SDL_LockSurface, dst);
 
+	// mask values go from 0 (a) to 8 and above (b)
+	// FIXME: handle all mask types
+	static uint16_t lut[256] = {0};
+	if (!lut[1]) {
+		for (int i = 1; i < 256; i++)
+			lut[i] = i > 7 ? 256 : i * 32 - 15;
+	}
 	for (int row = 0; row < h; row++) {
 		uint8_t *src_px = DIRECT_PIXEL_P(a, a_x, a_y + row);
 		uint8_t *new_px = DIRECT_PIXEL_P(b, b_x, b_y + row);
 		uint8_t *dst_px = DIRECT_PIXEL_P(dst, dst_x, dst_y + row);
-		uint8_t *mask_px = mask + a_y * mask_w + a_x;
-		for (int col = 0; col < w; col++, src_px += 3, new_px += 3, dst_px += 3, mask_px++) {
-			// FIXME: handle all mask types
-			if (*mask_px == 0) {
-				memcpy(dst_px, src_px, GFX_DIRECT_BPP / 8);
-			} else if (*mask_px > 7) {
-				memcpy(dst_px, new_px, GFX_DIRECT_BPP / 8);
-			} else {
-				alpha_blend_to(dst_px, src_px, new_px, *mask_px * 32 - 16);
-			}
-		}
+		uint16_t *weights = blend_weights(mask + (a_y + row) * mask_w + a_x, lut, w);
+		gfx_blend_row(dst_px, src_px, new_px, weights, w * 3);
 	}
 
 	if (SDL_MUSTLOCK(a))
@@ -1242,17 +1466,18 @@ void gfx_blend_fill(int x, int y, int w, int h, unsigned i, uint32_t c, uint8_t
 	if (!gfx_fill_begin(s, &r))
 		return;
 
-	uint32_t a = (uint32_t)rate + 1;
-	uint32_t inv_a = 256 - (uint32_t)rate;
+	uint16_t a = (uint16_t)rate + 1;
+	uint16_t inv_a = 256 - (uint16_t)rate;
 	SDL_Color color = gfx_decode_direct(c);
-	color.r *= a;
-	color.g *= a;
-	color.b *= a;
-	direct_foreach_px(p, s, &r,
-		p[0] = (uint8_t)((color.r + inv_a * p[0]) >> 8);
-		p[1] = (uint8_t)((color.g + inv_a * p[1]) >> 8);
-		p[2] = (uint8_t)((color.b + inv_a * p[2]) >> 8);
-	);
+	uint16_t pattern[GFX_BLEND_FILL_PATTERN];
+	for (int i = 0; i < GFX_BLEND_FILL_PATTERN; i += 3) {
+		pattern[i+0] = color.r * a;
+		pattern[i+1] = color.g * a;
+		pattern[i+2] = color.b * a;
+	}
+	for (int row = 0; row < r.h; row++) {
+		gfx_blend_fill_row(DIRECT_PIXEL_P(s, r.x, r.y + row), pattern, inv_a, r.w * 3);
+	}
 
 	gfx_fill_end(s);
 	gfx_dirty(i, x, y, w, h);
@@ -0,0 +1,126 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Blending kernels for RGB24 surfaces.
+ *
+ * All kernels operate on rows of packed bytes and compute
+ *
+ *     out = (w * fg + (257 - w) * bg) >> 8
+ *
+ * for weights w in [0,256]. With w = alpha + 1 this is the usual
+ * (fg * (alpha + 1) + bg * (256 - alpha)) >> 8 formula; w = 0 yields bg and
+ * w = 256 yields fg exactly. The sum never exceeds 257 * 255 = 65535, so the
+ * SIMD versions can work in unsigned 16-bit lanes and produce results
+ * identical to the scalar code.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define BLEND_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BLEND_NEON
+#endif
+
+#include "gfx_blend.h"
+
+void gfx_blend_row(uint8_t *dst, const uint8_t *bg, const uint8_t *fg, const uint16_t *w,
+		size_t n)
+{
+	size_t i = 0;
+#if defined(BLEND_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i k257 = _mm_set1_epi16(257);
+	for (; i + 16 <= n; i += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i*)(bg + i));
+		__m128i f = _mm_loadu_si128((const __m128i*)(fg + i));
+		__m128i w_lo = _mm_loadu_si128((const __m128i*)(w + i));
+		__m128i w_hi = _mm_loadu_si128((const __m128i*)(w + i + 8));
+		__m128i lo = _mm_add_epi16(
+				_mm_mullo_epi16(_mm_unpacklo_epi8(f, zero), w_lo),
+				_mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), _mm_sub_epi16(k257, w_lo)));
+		__m128i hi = _mm_add_epi16(
+				_mm_mullo_epi16(_mm_unpackhi_epi8(f, zero), w_hi),
+				_mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), _mm_sub_epi16(k257, w_hi)));
+		lo = _mm_srli_epi16(lo, 8);
+		hi = _mm_srli_epi16(hi, 8);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+#elif defined(BLEND_NEON)
+	const uint16x8_t k257 = vdupq_n_u16(257);
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t b = vld1q_u8(bg + i);
+		uint8x16_t f = vld1q_u8(fg + i);
+		uint16x8_t w_lo = vld1q_u16(w + i);
+		uint16x8_t w_hi = vld1q_u16(w + i + 8);
+		uint16x8_t lo = vmulq_u16(vmovl_u8(vget_low_u8(f)), w_lo);
+		uint16x8_t hi = vmulq_u16(vmovl_u8(vget_high_u8(f)), w_hi);
+		lo = vmlaq_u16(lo, vmovl_u8(vget_low_u8(b)), vsubq_u16(k257, w_lo));
+		hi = vmlaq_u16(hi, vmovl_u8(vget_high_u8(b)), vsubq_u16(k257, w_hi));
+		vst1q_u8(dst + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+	}
+#endif
+	for (; i < n; i++) {
+		dst[i] = (uint8_t)(((uint32_t)w[i] * fg[i] + (257 - (uint32_t)w[i]) * bg[i]) >> 8);
+	}
+}
+
+void gfx_blend_fill_row(uint8_t *p, const uint16_t fg_w[GFX_BLEND_FILL_PATTERN],
+		uint16_t bg_w, size_t n)
+{
+	size_t i = 0;
+#if defined(BLEND_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i inv = _mm_set1_epi16(bg_w);
+	__m128i c[6];
+	for (int k = 0; k < 6; k++) {
+		c[k] = _mm_loadu_si128((const __m128i*)(fg_w + k * 8));
+	}
+	for (; i + GFX_BLEND_FILL_PATTERN <= n; i += GFX_BLEND_FILL_PATTERN) {
+		for (int k = 0; k < 3; k++) {
+			__m128i x = _mm_loadu_si128((const __m128i*)(p + i + k * 16));
+			__m128i lo = _mm_add_epi16(c[k * 2],
+					_mm_mullo_epi16(_mm_unpacklo_epi8(x, zero), inv));
+			__m128i hi = _mm_add_epi16(c[k * 2 + 1],
+					_mm_mullo_epi16(_mm_unpackhi_epi8(x, zero), inv));
+			lo = _mm_srli_epi16(lo, 8);
+			hi = _mm_srli_epi16(hi, 8);
+			_mm_storeu_si128((__m128i*)(p + i + k * 16), _mm_packus_epi16(lo, hi));
+		}
+	}
+#elif defined(BLEND_NEON)
+	const uint16x8_t inv = vdupq_n_u16(bg_w);
+	uint16x8_t c[6];
+	for (int k = 0; k < 6; k++) {
+		c[k] = vld1q_u16(fg_w + k * 8);
+	}
+	for (; i + GFX_BLEND_FILL_PATTERN <= n; i += GFX_BLEND_FILL_PATTERN) {
+		for (int k = 0; k < 3; k++) {
+			uint8x16_t x = vld1q_u8(p + i + k * 16);
+			uint16x8_t lo = vmlaq_u16(c[k * 2], vmovl_u8(vget_low_u8(x)), inv);
+			uint16x8_t hi = vmlaq_u16(c[k * 2 + 1], vmovl_u8(vget_high_u8(x)), inv);
+			vst1q_u8(p + i + k * 16, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		p[i] = (uint8_t)((fg_w[i % GFX_BLEND_FILL_PATTERN] + (uint32_t)bg_w * p[i]) >> 8);
+	}
+}
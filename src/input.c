@@ -18,6 +18,8 @@
 
 #include "nulib.h"
 
+#include "ai5.h"
+#include "bench.h"
 #include "cursor.h"
 #include "debug.h"
 #include "input.h"
@@ -156,11 +158,18 @@ void handle_events(void)
 
 void vm_delay(int ms)
 {
+	gfx_flush();
+	if (unlikely(config.bench)) {
+		bench_delay(ms);
+		return;
+	}
 	SDL_Delay(ms);
 }
 
 uint32_t vm_get_ticks(void)
 {
+	if (unlikely(config.bench))
+		return bench_get_ticks();
 	return SDL_GetTicks();
 }
 
@@ -168,6 +177,8 @@ bool input_down(enum input_event_type type)
 {
 	assert(type >= 0 && type < INPUT_NR_INPUTS);
 	handle_events();
+	if (unlikely(config.bench))
+		return bench_input_down(type);
 	if (key_down[type] || SDL_GetTicks() - key_down_timestamp[type] < 30)
 		return true;
 	return false;
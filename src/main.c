@@ -30,6 +30,7 @@
 
 #include "asset.h"
 #include "audio.h"
+#include "bench.h"
 #include "cursor.h"
 #include "debug.h"
 #include "game.h"
@@ -42,6 +43,12 @@
 #include "../version.h"
 
 #define DEFAULT_MSG_SKIP_DELAY 16
+#define DEFAULT_GLYPH_CACHE_SIZE 4096
+#define DEFAULT_CG_CACHE_SIZE 32768
+#define DEFAULT_FRAME_RATE 60
+#define DEFAULT_SOUND_CACHE_SIZE 8192
+#define DEFAULT_SOUND_CACHE_LENGTH 5000
+#define DEFAULT_BENCH_STATEMENTS 1000000
 struct config config = {
 	// XXX: Different games have different defaults for bMESTYPE/bDATATYPE.
 	//      We follow Kakyuusei here because that's the only game (so far) that relies
@@ -51,6 +58,12 @@ struct config config = {
 	.font_face = -1,
 	.transition_speed = 1.0,
 	.msg_skip_delay = DEFAULT_MSG_SKIP_DELAY,
+	.glyph_cache_size = DEFAULT_GLYPH_CACHE_SIZE * 1024,
+	.cg_cache_size = DEFAULT_CG_CACHE_SIZE * 1024,
+	.frame_rate = DEFAULT_FRAME_RATE,
+	.sound_cache_size = DEFAULT_SOUND_CACHE_SIZE * 1024,
+	.sound_cache_length = DEFAULT_SOUND_CACHE_LENGTH,
+	.bench_statements = DEFAULT_BENCH_STATEMENTS,
 };
 bool yuno_eng = false;
 
@@ -165,6 +178,18 @@ static int cfg_handler(void *user, const char *section, const char *name, const
 		config->no_warp_mouse = !!atoi(value);
 	} else if (MATCH("AI5SDL2", "MAPNOWALLSLIDE")) {
 		config->map_no_wallslide = !!atoi(value);
+	} else if (MATCH("AI5SDL2", "GLYPHCACHESIZE")) {
+		config->glyph_cache_size = (size_t)clamp(0, 1024*1024, atoi(value)) * 1024;
+	} else if (MATCH("AI5SDL2", "CGCACHESIZE")) {
+		config->cg_cache_size = (size_t)clamp(0, 1024*1024, atoi(value)) * 1024;
+	} else if (MATCH("AI5SDL2", "FRAMERATE")) {
+		config->frame_rate = clamp(0, 1000, atoi(value));
+	} else if (MATCH("AI5SDL2", "SOUNDCACHESIZE")) {
+		config->sound_cache_size = (size_t)clamp(0, 1024*1024, atoi(value)) * 1024;
+	} else if (MATCH("AI5SDL2", "SOUNDCACHELENGTH")) {
+		config->sound_cache_length = clamp(0, 60000, atoi(value));
+	} else if (MATCH("AI5SDL2", "VSYNC")) {
+		config->vsync = !!atoi(value);
 	} else {
 		WARNING("Unknown INI value: %s.%s", section, name);
 		return 0;
@@ -176,19 +201,38 @@ static int cfg_handler(void *user, const char *section, const char *name, const
 static void usage(void)
 {
 	printf("Usage: ai5 [options] [inifile-or-directory]\n");
+	printf("    --bench                  Run headless with a virtual clock and print statistics\n");
+	printf("    --bench-statements=<n>   Stop the benchmark after <n> statements (default: %u)\n",
+			DEFAULT_BENCH_STATEMENTS);
+	printf("    --bench-seconds=<n>      Stop the benchmark after <n> virtual seconds\n");
+	printf("    --cg-cache-size=<KiB>    Set the size of the CG cache (default: %u)\n",
+			DEFAULT_CG_CACHE_SIZE);
 	printf("    -d, --debug              Start in the debugger REPL\n");
 	printf("    --font                   Specify the font\n");
 	printf("    --font-face=<n>          Specify the font face index\n");
+	printf("    --frame-rate=<hz>        Limit the rate of screen updates (default: %u)\n",
+			DEFAULT_FRAME_RATE);
+	printf("                             (0 updates the screen after every statement)\n");
+	printf("    --frame-stats            Print presentation statistics at exit\n");
 	printf("    --game=<game>            Specify the game to run\n");
 	printf("                             (valid options are: yuno, yuno-eng)\n");
+	printf("    --glyph-cache-size=<KiB> Set the size of the glyph cache (default: %u)\n",
+			DEFAULT_GLYPH_CACHE_SIZE);
 	printf("    -h, --help               Display this message and exit\n");
 	printf("    --msg-skip-delay=<ms>    Set the message skip delay time (default: %u)\n",
 			DEFAULT_MSG_SKIP_DELAY);
 	printf("    --no-warp-mouse          Don't move the mouse\n");
+	printf("    --profile                Profile the VM and print the results at exit\n");
+	printf("    --sound-cache-length=<ms>\n");
+	printf("                             Cache decoded sounds up to this length (default: %u)\n",
+			DEFAULT_SOUND_CACHE_LENGTH);
+	printf("    --sound-cache-size=<KiB> Set the size of the decoded sound cache (default: %u)\n",
+			DEFAULT_SOUND_CACHE_SIZE);
 	printf("    --texthook-clipboard     Copy text to the system clipboard\n");
 	printf("    --texthook-stdout        Copy text to standard output\n");
 	printf("    --transition-speed=<ms>  Set the speed of CG transition effects (default: 1.0)\n");
 	printf("    --version                Display the AI5-SDL2 version and exit\n");
+	printf("    --vsync                  Synchronize screen updates with the display\n");
 
 	if (ai5_target_game == GAME_DOUKYUUSEI) {
 		printf("    --map-no-wallslide       Don't slide character along walls of map\n");
@@ -272,15 +316,26 @@ enum {
 	LOPT_HELP = 256,
 	LOPT_VERSION,
 	LOPT_DEBUG,
+	LOPT_BENCH,
+	LOPT_BENCH_STATEMENTS,
+	LOPT_BENCH_SECONDS,
+	LOPT_CG_CACHE_SIZE,
 	LOPT_FONT,
 	LOPT_FONT_FACE,
+	LOPT_FRAME_RATE,
+	LOPT_FRAME_STATS,
 	LOPT_GAME,
+	LOPT_GLYPH_CACHE_SIZE,
 	LOPT_MAP_NO_WALLSLIDE,
 	LOPT_NO_WARP_MOUSE,
 	LOPT_MSG_SKIP_DELAY,
+	LOPT_PROFILE,
+	LOPT_SOUND_CACHE_LENGTH,
+	LOPT_SOUND_CACHE_SIZE,
 	LOPT_TEXTHOOK_CLIPBOARD,
 	LOPT_TEXTHOOK_STDOUT,
 	LOPT_TRANSITION_SPEED,
+	LOPT_VSYNC,
 };
 
 int main(int argc, char *argv[])
@@ -294,15 +349,26 @@ int main(int argc, char *argv[])
 		static struct option long_options[] = {
 			{ "game", required_argument, 0, LOPT_GAME },
 			{ "debug", no_argument, 0, LOPT_DEBUG },
+			{ "bench", no_argument, 0, LOPT_BENCH },
+			{ "bench-statements", required_argument, 0, LOPT_BENCH_STATEMENTS },
+			{ "bench-seconds", required_argument, 0, LOPT_BENCH_SECONDS },
+			{ "cg-cache-size", required_argument, 0, LOPT_CG_CACHE_SIZE },
 			{ "font", required_argument, 0, LOPT_FONT },
 			{ "font-face", required_argument, 0, LOPT_FONT_FACE },
+			{ "frame-rate", required_argument, 0, LOPT_FRAME_RATE },
+			{ "frame-stats", no_argument, 0, LOPT_FRAME_STATS },
+			{ "glyph-cache-size", required_argument, 0, LOPT_GLYPH_CACHE_SIZE },
 			{ "help", no_argument, 0, LOPT_HELP },
 			{ "msg-skip-delay", required_argument, 0, LOPT_MSG_SKIP_DELAY },
 			{ "no-warp-mouse", no_argument, 0, LOPT_NO_WARP_MOUSE },
+			{ "profile", no_argument, 0, LOPT_PROFILE },
+			{ "sound-cache-length", required_argument, 0, LOPT_SOUND_CACHE_LENGTH },
+			{ "sound-cache-size", required_argument, 0, LOPT_SOUND_CACHE_SIZE },
 			{ "texthook-clipboard", no_argument, 0, LOPT_TEXTHOOK_CLIPBOARD },
 			{ "texthook-stdout", no_argument, 0, LOPT_TEXTHOOK_STDOUT },
 			{ "transition-speed", required_argument, 0, LOPT_TRANSITION_SPEED },
 			{ "version", no_argument, 0, LOPT_VERSION },
+			{ "vsync", no_argument, 0, LOPT_VSYNC },
 			// doukyuusei-specific
 			{ "map-no-wallslide", no_argument, 0, LOPT_MAP_NO_WALLSLIDE },
 			{0}
@@ -331,18 +397,48 @@ int main(int argc, char *argv[])
 			debug_on_error = true;
 			debug_on_F12 = true;
 			break;
+		case LOPT_BENCH:
+			config.bench = true;
+			break;
+		case LOPT_BENCH_STATEMENTS:
+			config.bench_statements = strtoul(optarg, NULL, 10);
+			break;
+		case LOPT_BENCH_SECONDS:
+			config.bench_seconds = atoi(optarg);
+			break;
+		case LOPT_CG_CACHE_SIZE:
+			config.cg_cache_size = (size_t)clamp(0, 1024*1024, atoi(optarg)) * 1024;
+			break;
 		case LOPT_FONT:
 			config.font_path = strdup(optarg);
 			break;
 		case LOPT_FONT_FACE:
 			config.font_face = atoi(optarg);
 			break;
+		case LOPT_FRAME_RATE:
+			config.frame_rate = clamp(0, 1000, atoi(optarg));
+			break;
+		case LOPT_FRAME_STATS:
+			config.frame_stats = true;
+			break;
+		case LOPT_GLYPH_CACHE_SIZE:
+			config.glyph_cache_size = (size_t)clamp(0, 1024*1024, atoi(optarg)) * 1024;
+			break;
 		case LOPT_MSG_SKIP_DELAY:
 			config.msg_skip_delay = clamp(0, 5000, atoi(optarg));
 			break;
 		case LOPT_NO_WARP_MOUSE:
 			config.no_warp_mouse = true;
 			break;
+		case LOPT_PROFILE:
+			config.profile = true;
+			break;
+		case LOPT_SOUND_CACHE_LENGTH:
+			config.sound_cache_length = clamp(0, 60000, atoi(optarg));
+			break;
+		case LOPT_SOUND_CACHE_SIZE:
+			config.sound_cache_size = (size_t)clamp(0, 1024*1024, atoi(optarg)) * 1024;
+			break;
 		case LOPT_TEXTHOOK_CLIPBOARD:
 			config.texthook_clipboard = true;
 			break;
@@ -352,6 +448,9 @@ int main(int argc, char *argv[])
 		case LOPT_TRANSITION_SPEED:
 			config.transition_speed = clamp(0.0, 10.0, atof(optarg));
 			break;
+		case LOPT_VSYNC:
+			config.vsync = true;
+			break;
 		case LOPT_MAP_NO_WALLSLIDE:
 			config.map_no_wallslide = true;
 			break;
@@ -387,9 +486,9 @@ int main(int argc, char *argv[])
 	// get ini filename if not specified
 	if (!ini_name) {
 		// try AI5ENG.INI first (YU-NO Eng TL)
-		ini_name = path_get_icase("AI5ENG.INI");
+		ini_name = asset_path_icase("AI5ENG.INI");
 		if (!ini_name)
-			ini_name = path_get_icase("AI5WIN.INI");
+			ini_name = asset_path_icase("AI5WIN.INI");
 	}
 	if (!ini_name)
 		usage_error("Couldn't find AI5WIN.INI (not a game directory?)");
@@ -399,7 +498,7 @@ int main(int argc, char *argv[])
 		sys_error("Failed to read INI file \"%s\"\n", ini_name);
 
 	// parse ai5-sdl2 ini file
-	char *our_ini_name = path_get_icase("AI5SDL2.INI");
+	char *our_ini_name = asset_path_icase("AI5SDL2.INI");
 	if (our_ini_name) {
 		if (ini_parse(our_ini_name, cfg_handler, &config) < 0)
 			sys_error("Failed to read INI file \"%s\"\n", our_ini_name);
@@ -419,7 +518,7 @@ int main(int argc, char *argv[])
 #undef DEFAULT_NAME
 
 	string exe_name = file_replace_extension(ini_name, "EXE");
-	config.exe_path = path_get_icase(exe_name);
+	config.exe_path = asset_path_icase(exe_name);
 	string_free(exe_name);
 	free(ini_name);
 
@@ -436,7 +535,12 @@ int main(int argc, char *argv[])
 	}
 
 	// intitialize subsystems
-	srand(time(NULL));
+	if (config.bench) {
+		bench_init();
+		srand(0);
+	} else {
+		srand(time(NULL));
+	}
 	asset_init();
 	game->mem_init();
 	gfx_init(config.title);
@@ -14,6 +14,9 @@
  * along with this program; if not, see <http://gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "nulib.h"
 #include "nulib/little_endian.h"
 #include "ai5/arc.h"
@@ -47,6 +50,14 @@
 
 #define NO_TILE 0xffff
 #define NO_LOCATION 0xffff
+// marks a tile on surface 0 whose contents are unknown
+#define INVALID_TILE 0xfffe
+
+// maximum dimensions of the screen, in tiles
+#define MAP_SCREEN_COLS (640 / 16)
+#define MAP_SCREEN_ROWS (480 / 16)
+// y-coordinate of the status bar, which is drawn over the bottom of the map
+#define MAP_STATUS_BAR_Y 448
 
 // static map tile data
 struct map_tile {
@@ -79,6 +90,8 @@ struct path_data {
 	unsigned g_score : 16;
 	unsigned f_score : 15;
 	unsigned not_in_frontier : 1;
+	// search which last touched this node; stale nodes are reset on access
+	uint32_t generation;
 };
 
 static struct {
@@ -105,15 +118,30 @@ static struct {
 	unsigned pos_history_ptr;
 	// static map tile data
 	struct map_tile tile_data[MAP_MAX_TILES];
+	// bitmap of positions where a sprite can stand without colliding
+	// (indexed by row * cols + col)
+	uint8_t valid_pos[(MAP_MAX_TILES + 7) / 8];
 	// on-screen tiles (dynamic)
 	struct tile tiles[480][640];
+	// tiles currently drawn to surface 0
+	struct {
+		bool valid;
+		unsigned tx;
+		unsigned ty;
+		unsigned tw;
+		unsigned th;
+		// surface 0 generation after the last frame was drawn
+		uint32_t generation;
+		struct tile tiles[MAP_SCREEN_ROWS][MAP_SCREEN_COLS];
+	} drawn;
 	// frame rate timer
 	vm_timer_t timer;
 	// pathing data
 	struct {
 		bool active;
 		struct map_pos goal;
-		struct path_data tiles[480][640];
+		uint32_t generation;
+		struct path_data tiles[MAP_MAX_TILES];
 		vector_t(struct map_pos) frontier;
 		vector_t(struct map_pos) path;
 		unsigned path_ptr;
@@ -132,6 +160,9 @@ static struct {
 	SDL_Color pal_cha[256];
 } map = {0};
 
+static struct map_draw_stats draw_stats = {0};
+static struct map_path_stats path_stats = {0};
+
 // Bitmaps {{{
 
 static void copy_to_bmp(uint8_t *bmp, unsigned bmp_size, unsigned off, struct archive_data *file)
@@ -155,6 +186,7 @@ void map_load_bitmap(const char *name, unsigned col, unsigned row, unsigned whic
 		return;
 	}
 
+	map.drawn.valid = false;
 	switch (which) {
 	case 0:  copy_to_bmp_map(row * 1280 + col, file); break;
 	case 1:  copy_to_bmp_cha(0xf000 + row * 640 + col, file); break;
@@ -176,6 +208,7 @@ void map_load_palette(const char *name, unsigned which)
 	else if (file->size > 512)
 		WARNING("Palette file is larger than expected (%uB)", file->size);
 
+	map.drawn.valid = false;
 	for (unsigned i = 0; i * 2 < file->size && i < 256; i++) {
 		if (which == 1)
 			map.pal_cha[i] = gfx_decode_bgr555(le_get16(file->data, i * 2));
@@ -213,6 +246,39 @@ static void update_map_data(void)
 	map.cam_off_ty = le_get32(memory.map_data, 40);
 }
 
+static bool map_tile_collides(unsigned x, unsigned y)
+{
+	return map.tile_data[y * map.cols + x].collides;
+}
+
+/*
+ * Build the bitmap of valid sprite positions. A sprite occupies a 3x3 block
+ * of tiles, of which the bottom two rows must not collide. Positions where
+ * this footprint would extend past the edge of the map are invalid.
+ */
+static void build_valid_pos(void)
+{
+	memset(map.valid_pos, 0, sizeof(map.valid_pos));
+	for (unsigned y = 0; y + 2 < map.rows; y++) {
+		for (unsigned x = 0; x + 2 < map.cols; x++) {
+			if (map_tile_collides(x, y + 1) || map_tile_collides(x, y + 2)
+					|| map_tile_collides(x + 1, y + 1)
+					|| map_tile_collides(x + 1, y + 2)
+					|| map_tile_collides(x + 2, y + 1)
+					|| map_tile_collides(x + 2, y + 2))
+				continue;
+			unsigned i = y * map.cols + x;
+			map.valid_pos[i / 8] |= 1 << (i % 8);
+		}
+	}
+}
+
+static bool sprite_pos_valid(unsigned x, unsigned y)
+{
+	unsigned i = y * map.cols + x;
+	return map.valid_pos[i / 8] & (1 << (i % 8));
+}
+
 void map_load_tilemap(void)
 {
 	MAP_LOG("map_load_tilemap()");
@@ -228,6 +294,7 @@ void map_load_tilemap(void)
 	map.location_mode = MAP_LOCATION_DISABLED;
 	map.get_location_enabled = false;
 	map.prev_location = NO_LOCATION;
+	map.drawn.valid = false;
 
 	if (map.rows * map.cols > MAP_MAX_TILES)
 		VM_ERROR("too many tiles in mpx: %ux%u", map.cols, map.rows);
@@ -246,6 +313,7 @@ void map_load_tilemap(void)
 			};
 		}
 	}
+	build_valid_pos();
 }
 
 void map_load_tiles(void)
@@ -310,12 +378,8 @@ static void blit_tile_masked(SDL_Surface *dst, int x, int y, uint8_t *bmp, SDL_C
 	}
 }
 
-static void draw_tile(struct tile *tile, int x, int y)
+static void draw_tile(SDL_Surface *dst, struct tile *tile, int x, int y)
 {
-	SDL_Surface *dst = gfx_get_surface(0);
-	if (SDL_MUSTLOCK(dst))
-		SDL_CALL(SDL_LockSurface, dst);
-
 	if (tile->bg != NO_TILE) {
 		blit_tile(dst, x, y, map.bmp_map, map.pal_map, tile->bg, 1280, 960);
 	}
@@ -332,16 +396,147 @@ static void draw_tile(struct tile *tile, int x, int y)
 			blit_tile_masked(dst, x, y, map.bmp_map, map.pal_map, tile->fg, 1280, 960);
 		}
 	}
+	draw_stats.frame_tiles_blitted++;
+}
+
+static bool tile_equal(struct tile *a, struct tile *b)
+{
+	return a->bg == b->bg && a->fg == b->fg && a->sp == b->sp && a->sp2 == b->sp2
+		&& a->fg_cha == b->fg_cha;
+}
+
+static void map_dirty(int x, int y, int w, int h)
+{
+	gfx_dirty(0, x, y, w, h);
+	draw_stats.frame_bytes_dirtied += w * h * 3;
+}
+
+/*
+ * Returns true if the tiles drawn to surface 0 by the previous frame can be
+ * reused for the current frame. This is only the case if nothing else has
+ * drawn to surface 0 since then, and if the camera hasn't moved by a whole
+ * screen.
+ */
+static bool drawn_tiles_reusable(void)
+{
+	if (!map.drawn.valid)
+		return false;
+	if (map.drawn.tw != map.screen.tw || map.drawn.th != map.screen.th)
+		return false;
+	if (map.drawn.generation != gfx_surface_generation(0))
+		return false;
+	int dx = (int)map.screen.tx - (int)map.drawn.tx;
+	int dy = (int)map.screen.ty - (int)map.drawn.ty;
+	return abs(dx) < map.drawn.tw && abs(dy) < map.drawn.th;
+}
+
+/*
+ * Shift the tiles drawn to surface 0 to account for camera movement. Exposed
+ * tiles are invalidated, and the whole view is marked dirty.
+ */
+static void scroll_drawn_tiles(SDL_Surface *dst, int dx, int dy)
+{
+	unsigned w = map.drawn.tw - abs(dx);
+	unsigned h = map.drawn.th - abs(dy);
+	unsigned src_col = max(dx, 0), dst_col = max(-dx, 0);
+	unsigned src_row = max(dy, 0), dst_row = max(-dy, 0);
+
+	// rows are moved in an order such that no source row is overwritten
+	// before it is read
+	for (unsigned i = 0; i < h; i++) {
+		unsigned row = dy > 0 ? i : h - i - 1;
+		memmove(&map.drawn.tiles[dst_row + row][dst_col],
+				&map.drawn.tiles[src_row + row][src_col],
+				w * sizeof(struct tile));
+		uint8_t *dst_p = dst->pixels + (dst_row + row) * 16 * dst->pitch + dst_col * 16 * 3;
+		uint8_t *src_p = dst->pixels + (src_row + row) * 16 * dst->pitch + src_col * 16 * 3;
+		for (int y = 0; y < 16; y++, dst_p += dst->pitch, src_p += dst->pitch) {
+			memmove(dst_p, src_p, w * 16 * 3);
+		}
+	}
 
-	if (SDL_MUSTLOCK(dst))
-		SDL_UnlockSurface(dst);
+	for (unsigned row = 0; row < map.drawn.th; row++) {
+		bool row_exposed = row < dst_row || row >= dst_row + h;
+		for (unsigned col = 0; col < map.drawn.tw; col++) {
+			if (row_exposed || col < dst_col || col >= dst_col + w)
+				map.drawn.tiles[row][col].bg = INVALID_TILE;
+		}
+	}
+
+	// every tile on screen has moved
+	map_dirty(0, 0, map.drawn.tw * 16, map.drawn.th * 16);
+
+	map.drawn.tx = map.screen.tx;
+	map.drawn.ty = map.screen.ty;
+	draw_stats.scrolls++;
 }
 
-void map_draw_tiles(void)
+static void draw_all_tiles(SDL_Surface *dst)
+{
+	for (unsigned row = 0; row < map.screen.th; row++) {
+		for (unsigned col = 0; col < map.screen.tw; col++) {
+			draw_tile(dst, &map.tiles[row][col], col * 16, row * 16);
+		}
+	}
+	map_dirty(0, 0, map.screen.tw * 16, map.screen.th * 16);
+
+	map.drawn.valid = map.screen.tw <= MAP_SCREEN_COLS && map.screen.th <= MAP_SCREEN_ROWS;
+	if (!map.drawn.valid)
+		return;
+	for (unsigned row = 0; row < map.screen.th; row++) {
+		memcpy(map.drawn.tiles[row], map.tiles[row], map.screen.tw * sizeof(struct tile));
+	}
+	map.drawn.tx = map.screen.tx;
+	map.drawn.ty = map.screen.ty;
+	map.drawn.tw = map.screen.tw;
+	map.drawn.th = map.screen.th;
+	draw_stats.full_redraws++;
+}
+
+// draw only those tiles which differ from the tiles drawn by the previous frame
+static void draw_changed_tiles(SDL_Surface *dst)
 {
+	int dx = (int)map.screen.tx - (int)map.drawn.tx;
+	int dy = (int)map.screen.ty - (int)map.drawn.ty;
+	if (dx || dy)
+		scroll_drawn_tiles(dst, dx, dy);
+
 	for (unsigned row = 0; row < map.screen.th; row++) {
+		int first = -1, last = -1;
 		for (unsigned col = 0; col < map.screen.tw; col++) {
-			draw_tile(&map.tiles[row][col], col * 16, row * 16);
+			struct tile *tile = &map.tiles[row][col];
+			if (tile_equal(tile, &map.drawn.tiles[row][col]))
+				continue;
+			draw_tile(dst, tile, col * 16, row * 16);
+			map.drawn.tiles[row][col] = *tile;
+			if (first < 0)
+				first = col;
+			last = col;
+		}
+		if (first >= 0)
+			map_dirty(first * 16, row * 16, (last - first + 1) * 16, 16);
+	}
+}
+
+void map_draw_tiles(void)
+{
+	SDL_Surface *dst = gfx_get_surface(0);
+	draw_stats.frame_tiles_blitted = 0;
+	draw_stats.frame_bytes_dirtied = 0;
+
+	if (SDL_MUSTLOCK(dst))
+		SDL_CALL(SDL_LockSurface, dst);
+	if (drawn_tiles_reusable())
+		draw_changed_tiles(dst);
+	else
+		draw_all_tiles(dst);
+	if (SDL_MUSTLOCK(dst))
+		SDL_UnlockSurface(dst);
+
+	// tiles under the status bar are drawn over every frame
+	for (unsigned row = MAP_STATUS_BAR_Y / 16; row < map.drawn.th; row++) {
+		for (unsigned col = 0; col < map.drawn.tw; col++) {
+			map.drawn.tiles[row][col].bg = INVALID_TILE;
 		}
 	}
 
@@ -349,7 +544,12 @@ void map_draw_tiles(void)
 	gfx_copy(0, 448, 640, 32, 0, 0, 1248, 7);
 	// draw status bar
 	gfx_copy(0, 106, 640, 32, 7, 0, 448, 0);
-	gfx_whole_surface_dirty(0);
+	draw_stats.frame_bytes_dirtied += 640 * 32 * 3;
+	map.drawn.generation = gfx_surface_generation(0);
+
+	draw_stats.frames++;
+	draw_stats.tiles_blitted += draw_stats.frame_tiles_blitted;
+	draw_stats.bytes_dirtied += draw_stats.frame_bytes_dirtied;
 
 	// XXX: If shift is held down, we double the frame rate.
 	//      This is not what AI5WIN.EXE does (it doubles the amount of movement that
@@ -358,6 +558,11 @@ void map_draw_tiles(void)
 	vm_timer_tick(&map.timer, input_down(INPUT_SHIFT) ? MAP_FRAME_TIME/2 : MAP_FRAME_TIME);
 }
 
+void map_draw_stats(struct map_draw_stats *stats)
+{
+	*stats = draw_stats;
+}
+
 // Tiles }}}
 // Sprites {{{
 
@@ -1200,7 +1405,26 @@ static unsigned h_distance(struct map_pos from, struct map_pos to)
 
 static struct path_data *get_path_data(struct map_pos pos)
 {
-	return &map.path.tiles[pos.y][pos.x];
+	struct path_data *data = &map.path.tiles[pos.y * map.cols + pos.x];
+	if (data->generation != map.path.generation) {
+		*data = (struct path_data) {
+			.pred = { 0xffff, 0xffff },
+			.g_score = 0xffff,
+			.f_score = 0x7fff,
+			.not_in_frontier = 1,
+			.generation = map.path.generation,
+		};
+	}
+	return data;
+}
+
+// invalidate the path data of the previous search
+static void path_data_reset(void)
+{
+	if (unlikely(++map.path.generation == 0)) {
+		memset(map.path.tiles, 0, sizeof(map.path.tiles));
+		map.path.generation = 1;
+	}
 }
 
 static bool frontier_less_than(uint16_t a, uint16_t b)
@@ -1225,17 +1449,23 @@ static uint16_t frontier_min(uint16_t a, uint16_t b)
 	return b;
 }
 
-static void frontier_sink(uint16_t node)
+static void frontier_swap(uint16_t a, uint16_t b)
 {
-	uint16_t l_child = node * 2 + 1;
-	uint16_t r_child = node * 2 + 2;
+	struct map_pos tmp = vector_A(map.path.frontier, a);
+	vector_A(map.path.frontier, a) = vector_A(map.path.frontier, b);
+	vector_A(map.path.frontier, b) = tmp;
+}
 
-	uint16_t min_i = frontier_min(node, frontier_min(l_child, r_child));
-	if (min_i != node) {
-		struct map_pos tmp = vector_A(map.path.frontier, min_i);
-		vector_A(map.path.frontier, min_i) = vector_A(map.path.frontier, node);
-		vector_A(map.path.frontier, node) = tmp;
-		frontier_sink(min_i);
+static void frontier_sink(uint16_t node)
+{
+	while (true) {
+		uint16_t l_child = node * 2 + 1;
+		uint16_t r_child = node * 2 + 2;
+		uint16_t min_i = frontier_min(node, frontier_min(l_child, r_child));
+		if (min_i == node)
+			break;
+		frontier_swap(min_i, node);
+		node = min_i;
 	}
 }
 
@@ -1253,15 +1483,12 @@ static struct map_pos frontier_pop(void)
 
 static void frontier_swim(uint16_t node)
 {
-	if (node == 0)
-		return;
-
-	uint16_t parent = (node - 1) / 2;
-	if (frontier_less_than(node, parent)) {
-		struct map_pos tmp = vector_A(map.path.frontier, parent);
-		vector_A(map.path.frontier, parent) = vector_A(map.path.frontier, node);
-		vector_A(map.path.frontier, node) = tmp;
-		frontier_swim(parent);
+	while (node > 0) {
+		uint16_t parent = (node - 1) / 2;
+		if (!frontier_less_than(node, parent))
+			break;
+		frontier_swap(parent, node);
+		node = parent;
 	}
 }
 
@@ -1271,18 +1498,6 @@ static void frontier_push(struct map_pos pos)
 	frontier_swim(vector_length(map.path.frontier) - 1);
 }
 
-static bool map_tile_collides(unsigned x, unsigned y)
-{
-	return map.tile_data[y * map.cols + x].collides;
-}
-
-static bool sprite_pos_valid(unsigned x, unsigned y)
-{
-	return !map_tile_collides(x, y + 1) && !map_tile_collides(x, y + 2)
-		&& !map_tile_collides(x + 1, y + 1) && !map_tile_collides(x + 1, y + 2)
-		&& !map_tile_collides(x + 2, y + 1) && !map_tile_collides(x + 2, y + 2);
-}
-
 static struct map_pos get_neighbor(struct map_pos pos, int dir)
 {
 	switch (dir) {
@@ -1339,6 +1554,17 @@ no_neighbor:
 	return (struct map_pos) { 0xffff, 0xffff };
 }
 
+static void path_stats_add_time(uint64_t start_t)
+{
+	path_stats.time_us += (SDL_GetPerformanceCounter() - start_t) * 1000000
+		/ SDL_GetPerformanceFrequency();
+}
+
+void map_path_stats(struct map_path_stats *stats)
+{
+	*stats = path_stats;
+}
+
 /*
  * A* pathfinding algorithm.
  */
@@ -1367,23 +1593,31 @@ void map_path_sprite(unsigned sp_no, unsigned tx, unsigned ty)
 	if (map_pos_equal(start, map.path.goal))
 		return;
 
+	uint64_t start_t = SDL_GetPerformanceCounter();
+	path_stats.searches++;
+
 	// initialize path data
-	memset(map.path.tiles, 0xff, sizeof(map.path.tiles));
-	map.path.tiles[sp->y][sp->x].g_score = 0;
-	map.path.tiles[sp->y][sp->x].f_score = h_distance(start, map.path.goal);
+	path_data_reset();
+	struct path_data *start_data = get_path_data(start);
+	start_data->g_score = 0;
+	start_data->f_score = h_distance(start, map.path.goal);
 
 	// put start node into frontier
 	vector_length(map.path.frontier) = 0;
 	vector_set(struct map_pos, map.path.frontier, 0, start);
-	map.path.tiles[start.y][start.x].not_in_frontier = 0;
+	start_data->not_in_frontier = 0;
 
 	while (true) {
 		if (vector_length(map.path.frontier) == 0) {
 			WARNING("pathing failed");
+			path_stats.failures++;
+			path_stats_add_time(start_t);
 			return;
 		}
 		struct map_pos cur = frontier_pop();
-		map.path.tiles[cur.y][cur.x].not_in_frontier = 1;
+		struct path_data *cur_data = get_path_data(cur);
+		cur_data->not_in_frontier = 1;
+		path_stats.nodes_expanded++;
 		if (map_pos_equal(cur, map.path.goal))
 			break;
 
@@ -1394,7 +1628,7 @@ void map_path_sprite(unsigned sp_no, unsigned tx, unsigned ty)
 				continue;
 
 			struct path_data *neighbor = get_path_data(neighbor_pos);
-			uint16_t g = map.path.tiles[cur.y][cur.x].g_score + (i <= 3 ? 1 : 2);
+			uint16_t g = cur_data->g_score + (i <= 3 ? 1 : 2);
 			if (g < neighbor->g_score) {
 				neighbor->pred = cur;
 				neighbor->g_score = g;
@@ -1412,9 +1646,10 @@ void map_path_sprite(unsigned sp_no, unsigned tx, unsigned ty)
 	struct map_pos cur = map.path.goal;
 	do {
 		vector_push(struct map_pos, map.path.path, cur);
-		cur = map.path.tiles[cur.y][cur.x].pred;
+		cur = get_path_data(cur)->pred;
 	} while (!map_pos_equal(cur, start));
 	map.path.path_ptr = vector_length(map.path.path);
+	path_stats_add_time(start_t);
 
 	// put sprite into pathing state
 	map.path.active = true;
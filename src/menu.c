@@ -18,6 +18,7 @@
 
 #include "nulib.h"
 
+#include "gfx.h"
 #include "input.h"
 #include "memory.h"
 #include "menu.h"
@@ -94,6 +95,7 @@ void menu_exec(void)
 			break;
 		// update menu
 		vm_call_procedure(39);
+		gfx_flush();
 		if (input_down(INPUT_ACTIVATE)) {
 			vm_call_procedure(32);
 			input_wait_until_up(INPUT_ACTIVATE);
@@ -15,12 +15,21 @@
  * along with this program; if not, see <http://gnu.org/licenses/>.
  */
 
+#include <stdatomic.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/fifo.h>
 #include <libavutil/imgutils.h>
 #include <libswscale/swscale.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define MOVIE_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MOVIE_NEON
+#endif
+
 #include "nulib.h"
 #include "nulib/file.h"
 #include "ai5/arc.h"
@@ -31,7 +40,16 @@
 #include "sts_mixer.h"
 #include "vm.h"
 
+// number of packets buffered ahead of each decoder
 #define QUEUE_SIZE 10
+// number of converted video frames buffered ahead of display
+#define VIDEO_FRAMES 4
+// minimum size of the decoded audio buffer, in frames (power of two)
+#define AUDIO_RING_FRAMES 16384
+// minimum number of codec frames the decoded audio buffer can hold
+#define AUDIO_RING_CODEC_FRAMES 8
+// number of frames handed to the mixer per callback
+#define AUDIO_CHUNK_FRAMES 1024
 
 struct decoder {
 	AVFormatContext *format_ctx;
@@ -39,24 +57,76 @@ struct decoder {
 	AVCodecContext *ctx;
 	AVFrame *frame;
 	AVFifo *queue;
-	SDL_mutex *mutex;
+	SDL_Thread *thread;
+	// video_serial when the last packet was taken from the queue
+	unsigned serial;
 	bool finished;
 	bool format_eof;
 };
 
+struct video_frame {
+	int64_t ts;
+	// converted RGBA pixels (sws path)
+	uint8_t *pixels;
+	// decoded frame (YUV path)
+	AVFrame *frame;
+};
+
 struct movie_context {
 	struct decoder video;
 	struct decoder audio;
 
 	SDL_Texture *dst;
 
-	bool has_pending_video_frame;
+	// Worker threads. The demux thread keeps the packet queues full; the
+	// video and audio threads decode ahead of playback. Everything below
+	// except the audio ring is protected by `mutex`.
+	SDL_Thread *demux_thread;
+	SDL_mutex *mutex;
+	// signalled when a packet queue has room
+	SDL_cond *demux_cond;
+	// signalled when a packet is queued
+	SDL_cond *packet_cond;
+	// signalled when the video frame ring changes
+	SDL_cond *frame_cond;
+	// signalled on quit (the audio thread otherwise polls for ring space)
+	SDL_cond *audio_cond;
+	bool quit;
+
+	// Ring of converted video frames. The video thread writes the slot at
+	// `frames_written`; the main thread owns the slot at `frames_read`.
+	struct video_frame frames[VIDEO_FRAMES];
+	unsigned frames_read;
+	unsigned frames_written;
+	// incremented on seek to discard frames decoded before it
+	unsigned video_serial;
+	bool video_eof;
+	uint8_t *pixel_bufs[VIDEO_FRAMES + 1];
+
+	// Frames in YUV420P are uploaded to an IYUV texture as decoded, and the
+	// renderer does the color conversion. Other formats are converted to
+	// RGBA with swscale.
+	bool yuv;
+	// the most recently displayed frame (YUV path)
+	AVFrame *last_frame;
+	bool has_last_frame;
+
 	struct SwsContext *sws_ctx;
+	// holds the most recently displayed frame (converted on demand on the
+	// YUV path)
 	AVFrame *sws_frame;
-	void *sws_buf;
 	// number of ms that the video stream has been rewound (independent of audio)
 	double video_rewind_time;
 	unsigned video_current_frame;
+	double frame_duration;
+
+	// Decoded, interleaved audio. Written by the audio thread and read by
+	// the mixer callback.
+	uint8_t *audio_ring;
+	unsigned audio_ring_size;
+	atomic_uint audio_read;
+	atomic_uint audio_write;
+	atomic_bool audio_eof;
 
 	sts_mixer_stream_t sts_stream;
 	int bytes_per_sample;
@@ -71,6 +141,29 @@ struct movie_context {
 	SDL_mutex *timer_mutex;
 };
 
+// updated by the main thread
+static struct movie_stats stats = {0};
+
+// updated by the video thread and the mixer callback
+static struct {
+	atomic_ulong frames_converted;
+	atomic_uint_least64_t convert_us;
+	atomic_ulong audio_underruns;
+} thread_stats;
+
+void movie_stats(struct movie_stats *out)
+{
+	*out = stats;
+	out->frames_converted = atomic_load(&thread_stats.frames_converted);
+	out->convert_us = atomic_load(&thread_stats.convert_us);
+	out->audio_underruns = atomic_load(&thread_stats.audio_underruns);
+}
+
+static uint64_t elapsed_us(uint64_t start)
+{
+	return (SDL_GetPerformanceCounter() - start) * 1000000 / SDL_GetPerformanceFrequency();
+}
+
 static void free_decoder(struct decoder *dec)
 {
 	if (dec->format_ctx)
@@ -87,8 +180,6 @@ static void free_decoder(struct decoder *dec)
 		}
 		av_fifo_freep2(&dec->queue);
 	}
-	if (dec->mutex)
-		SDL_DestroyMutex(dec->mutex);
 }
 
 static bool init_decoder(struct decoder *dec, AVFormatContext *format_ctx, AVStream *stream)
@@ -108,7 +199,6 @@ static bool init_decoder(struct decoder *dec, AVFormatContext *format_ctx, AVStr
 		return false;
 	dec->frame = av_frame_alloc();
 	dec->queue = av_fifo_alloc2(QUEUE_SIZE, sizeof(AVPacket*), 0);
-	dec->mutex = SDL_CreateMutex();
 	return true;
 }
 
@@ -131,44 +221,262 @@ static void read_packet(struct decoder *dec)
 	av_fifo_write(dec->queue, &packet, 1);
 }
 
-static void _preload_packets(struct decoder *dec)
+static void flush_packets(struct decoder *dec)
 {
-	SDL_LockMutex(dec->mutex);
-	while (!dec->format_eof && av_fifo_can_read(dec->queue) < QUEUE_SIZE) {
-		read_packet(dec);
+	while (av_fifo_can_read(dec->queue) > 0) {
+		AVPacket *packet;
+		av_fifo_read(dec->queue, &packet, 1);
+		av_packet_free(&packet);
 	}
-	SDL_UnlockMutex(dec->mutex);
 }
 
-static void preload_packets(struct movie_context *mc)
+static bool queue_wants_packet(struct decoder *dec)
 {
-	if (mc->audio.stream)
-		_preload_packets(&mc->audio);
-	_preload_packets(&mc->video);
+	return dec->stream && !dec->format_eof && av_fifo_can_read(dec->queue) < QUEUE_SIZE;
 }
 
-static bool decode_frame(struct decoder *dec)
+static int demux_thread(void *data)
+{
+	struct movie_context *mc = data;
+
+	SDL_LockMutex(mc->mutex);
+	while (!mc->quit) {
+		bool queued = false;
+		if (queue_wants_packet(&mc->video)) {
+			read_packet(&mc->video);
+			queued = true;
+		}
+		if (queue_wants_packet(&mc->audio)) {
+			read_packet(&mc->audio);
+			queued = true;
+		}
+		if (queued)
+			SDL_CondBroadcast(mc->packet_cond);
+		else
+			SDL_CondWait(mc->demux_cond, mc->mutex);
+	}
+	SDL_UnlockMutex(mc->mutex);
+	return 0;
+}
+
+/*
+ * Decode the next frame into dec->frame. Called from the decoder's thread.
+ * Returns AVERROR_EXIT if the movie is being freed.
+ */
+static int decode_frame(struct movie_context *mc, struct decoder *dec)
 {
 	int ret;
 	while ((ret = avcodec_receive_frame(dec->ctx, dec->frame)) == AVERROR(EAGAIN)) {
-		SDL_LockMutex(dec->mutex);
 		AVPacket *packet;
-		while (av_fifo_can_read(dec->queue) == 0)
-			read_packet(dec);
+		SDL_LockMutex(mc->mutex);
+		while (!mc->quit && av_fifo_can_read(dec->queue) == 0)
+			SDL_CondWait(mc->packet_cond, mc->mutex);
+		if (mc->quit) {
+			SDL_UnlockMutex(mc->mutex);
+			return AVERROR_EXIT;
+		}
 		av_fifo_read(dec->queue, &packet, 1);
-		SDL_UnlockMutex(dec->mutex);
+		dec->serial = mc->video_serial;
+		SDL_CondSignal(mc->demux_cond);
+		SDL_UnlockMutex(mc->mutex);
 
-		if ((ret = avcodec_send_packet(dec->ctx, packet)) != 0) {
+		ret = avcodec_send_packet(dec->ctx, packet);
+		av_packet_free(&packet);
+		if (ret != 0) {
 			WARNING("avcodec_send_packet failed: %d", ret);
-			return false;
+			return ret;
 		}
-		av_packet_free(&packet);
 	}
-	if (ret == AVERROR_EOF)
-		dec->finished = true;
-	else if (ret)
+	if (ret && ret != AVERROR_EOF)
 		WARNING("avcodec_receive_frame failed: %d", ret);
-	return ret == 0;
+	return ret;
+}
+
+static int video_thread(void *data)
+{
+	struct movie_context *mc = data;
+	struct decoder *dec = &mc->video;
+
+	SDL_LockMutex(mc->mutex);
+	while (!mc->quit) {
+		SDL_UnlockMutex(mc->mutex);
+		int ret = decode_frame(mc, dec);
+		SDL_LockMutex(mc->mutex);
+
+		if (ret == AVERROR_EXIT)
+			break;
+		if (ret) {
+			// the stream was seeked while the decoder was draining; the
+			// end of the old position doesn't end the movie
+			if (dec->serial != mc->video_serial) {
+				avcodec_flush_buffers(dec->ctx);
+				continue;
+			}
+			// end of stream (or an error): wait for a seek to restart
+			mc->video_eof = true;
+			SDL_CondBroadcast(mc->frame_cond);
+			while (!mc->quit && mc->video_eof)
+				SDL_CondWait(mc->frame_cond, mc->mutex);
+			avcodec_flush_buffers(dec->ctx);
+			continue;
+		}
+
+		while (!mc->quit && mc->frames_written - mc->frames_read >= VIDEO_FRAMES)
+			SDL_CondWait(mc->frame_cond, mc->mutex);
+		if (mc->quit)
+			break;
+		// discard frames decoded from packets read before a seek
+		if (dec->serial != mc->video_serial)
+			continue;
+
+		// The slot past the end of the ring isn't touched by the main
+		// thread, so the conversion can run unlocked.
+		struct video_frame *f = &mc->frames[mc->frames_written % VIDEO_FRAMES];
+		SDL_UnlockMutex(mc->mutex);
+		f->ts = dec->frame->best_effort_timestamp;
+		if (mc->yuv) {
+			av_frame_unref(f->frame);
+			av_frame_move_ref(f->frame, dec->frame);
+		} else {
+			uint64_t start = SDL_GetPerformanceCounter();
+			uint8_t *dst[4] = { f->pixels };
+			int linesize[4] = { mc->sws_frame->linesize[0] };
+			sws_scale(mc->sws_ctx, (const uint8_t **)dec->frame->data,
+					dec->frame->linesize, 0, dec->ctx->height, dst, linesize);
+			atomic_fetch_add(&thread_stats.convert_us, elapsed_us(start));
+			atomic_fetch_add(&thread_stats.frames_converted, 1);
+		}
+		SDL_LockMutex(mc->mutex);
+
+		if (dec->serial == mc->video_serial) {
+			mc->frames_written++;
+			SDL_CondBroadcast(mc->frame_cond);
+		}
+	}
+	SDL_UnlockMutex(mc->mutex);
+	return 0;
+}
+
+/*
+ * Allocate memory for the audio path. Everything is allocated before the
+ * voice starts; the mixer callback and the audio thread only copy into
+ * buffers that already exist.
+ */
+static void *audio_alloc(struct movie_context *mc, size_t size)
+{
+	assert(mc->voice < 0);
+	return xcalloc(1, size);
+}
+
+static void interleave_16(int16_t *out, const int16_t *l, const int16_t *r, unsigned n)
+{
+	unsigned i = 0;
+#if defined(MOVIE_SSE2)
+	for (; i + 8 <= n; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(l + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(r + i));
+		_mm_storeu_si128((__m128i*)(out + i*2), _mm_unpacklo_epi16(a, b));
+		_mm_storeu_si128((__m128i*)(out + i*2 + 8), _mm_unpackhi_epi16(a, b));
+	}
+#elif defined(MOVIE_NEON)
+	for (; i + 8 <= n; i += 8) {
+		int16x8x2_t v = { { vld1q_s16(l + i), vld1q_s16(r + i) } };
+		vst2q_s16(out + i*2, v);
+	}
+#endif
+	for (; i < n; i++) {
+		out[i*2] = l[i];
+		out[i*2+1] = r[i];
+	}
+}
+
+// also used for float samples, which are only moved
+static void interleave_32(uint32_t *out, const uint32_t *l, const uint32_t *r, unsigned n)
+{
+	unsigned i = 0;
+#if defined(MOVIE_SSE2)
+	for (; i + 4 <= n; i += 4) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(l + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(r + i));
+		_mm_storeu_si128((__m128i*)(out + i*2), _mm_unpacklo_epi32(a, b));
+		_mm_storeu_si128((__m128i*)(out + i*2 + 4), _mm_unpackhi_epi32(a, b));
+	}
+#elif defined(MOVIE_NEON)
+	for (; i + 4 <= n; i += 4) {
+		uint32x4x2_t v = { { vld1q_u32(l + i), vld1q_u32(r + i) } };
+		vst2q_u32(out + i*2, v);
+	}
+#endif
+	for (; i < n; i++) {
+		out[i*2] = l[i];
+		out[i*2+1] = r[i];
+	}
+}
+
+static unsigned audio_ring_space(struct movie_context *mc)
+{
+	return mc->audio_ring_size - (atomic_load(&mc->audio_write) - atomic_load(&mc->audio_read));
+}
+
+/*
+ * Copy `frames` frames of dec->frame (starting at frame `from`) into the ring
+ * at byte offset `pos`, interleaving planar formats.
+ */
+static void audio_ring_put(struct movie_context *mc, unsigned pos, unsigned from, unsigned frames)
+{
+	const unsigned bps = mc->bytes_per_sample;
+	uint8_t *out = mc->audio_ring + pos;
+	if (mc->interleaved) {
+		memcpy(out, mc->audio.frame->data[0] + from * bps * 2, frames * bps * 2);
+		return;
+	}
+	uint8_t *l = mc->audio.frame->data[0] + from * bps;
+	uint8_t *r = mc->audio.frame->data[mc->audio.ctx->ch_layout.nb_channels > 1 ? 1 : 0]
+		+ from * bps;
+	if (bps == 2)
+		interleave_16((int16_t*)out, (int16_t*)l, (int16_t*)r, frames);
+	else
+		interleave_32((uint32_t*)out, (uint32_t*)l, (uint32_t*)r, frames);
+}
+
+static int audio_thread(void *data)
+{
+	struct movie_context *mc = data;
+	const unsigned frame_bytes = mc->bytes_per_sample * 2;
+
+	while (true) {
+		int ret = decode_frame(mc, &mc->audio);
+		if (ret == AVERROR_EXIT)
+			break;
+		if (ret) {
+			atomic_store(&mc->audio_eof, true);
+			break;
+		}
+
+		unsigned frames = mc->audio.frame->nb_samples;
+		if (frames * frame_bytes > mc->audio_ring_size) {
+			WARNING("Audio frame too large: %u samples", frames);
+			frames = mc->audio_ring_size / frame_bytes;
+		}
+
+		SDL_LockMutex(mc->mutex);
+		while (!mc->quit && audio_ring_space(mc) < frames * frame_bytes)
+			SDL_CondWaitTimeout(mc->audio_cond, mc->mutex, 5);
+		bool quit = mc->quit;
+		SDL_UnlockMutex(mc->mutex);
+		if (quit)
+			break;
+
+		// copy in at most two pieces (the ring size is a multiple of the frame size)
+		unsigned write = atomic_load(&mc->audio_write);
+		unsigned pos = write & (mc->audio_ring_size - 1);
+		unsigned first = min(frames, (mc->audio_ring_size - pos) / frame_bytes);
+		audio_ring_put(mc, pos, 0, first);
+		if (first < frames)
+			audio_ring_put(mc, 0, first, frames - first);
+		atomic_store(&mc->audio_write, write + frames * frame_bytes);
+	}
+	return 0;
 }
 
 #ifndef USE_SDL_MIXER
@@ -177,54 +485,131 @@ static int audio_callback(sts_mixer_sample_t *sample, void *data)
 	struct movie_context *mc = data;
 	assert(sample == &mc->sts_stream.sample);
 
-	if (!decode_frame(&mc->audio)) {
-		free(sample->data);
-		sample->length = 0;
-		sample->data = NULL;
+	const unsigned frame_bytes = mc->bytes_per_sample * 2;
+	bool eof = atomic_load(&mc->audio_eof);
+	unsigned read = atomic_load(&mc->audio_read);
+	unsigned avail = (atomic_load(&mc->audio_write) - read) / frame_bytes;
+	if (eof && !avail) {
+		mc->audio.finished = true;
 		mc->voice = -1;
 		return STS_STREAM_COMPLETE;
 	}
 
-	const int nr_channels = 2;
-	unsigned samples = 0;
-	if (mc->interleaved) {
-		samples = mc->audio.frame->linesize[0] / (mc->bytes_per_sample * 2);
-		if (samples * nr_channels != sample->length) {
-			free(sample->data);
-			sample->length = samples * nr_channels;
-			sample->data = xmalloc(sample->length * mc->bytes_per_sample);
-		}
-		memcpy(sample->data, mc->audio.frame->data[0], samples * mc->bytes_per_sample * 2);
-	} else {
-		samples = mc->audio.frame->linesize[0] / mc->bytes_per_sample;
-		if (samples * nr_channels != sample->length) {
-			free(sample->data);
-			sample->length = samples * nr_channels;
-			sample->data = xmalloc(sample->length * mc->bytes_per_sample);
-		}
-		// Interleave.
-		uint8_t *l = mc->audio.frame->data[0];
-		uint8_t *r = mc->audio.frame->data[mc->audio.ctx->ch_layout.nb_channels > 1 ? 1 : 0];
-		uint8_t *out = sample->data;
-		for (unsigned i = 0; i < samples; i++) {
-			memcpy(out, l, mc->bytes_per_sample);
-			out += mc->bytes_per_sample;
-			l += mc->bytes_per_sample;
-			memcpy(out, r, mc->bytes_per_sample);
-			out += mc->bytes_per_sample;
-			r += mc->bytes_per_sample;
-		}
+	unsigned frames = min(avail, AUDIO_CHUNK_FRAMES);
+	unsigned pos = read & (mc->audio_ring_size - 1);
+	unsigned first = min(frames * frame_bytes, mc->audio_ring_size - pos);
+	uint8_t *out = sample->data;
+	memcpy(out, mc->audio_ring + pos, first);
+	memcpy(out + first, mc->audio_ring, frames * frame_bytes - first);
+	atomic_store(&mc->audio_read, read + frames * frame_bytes);
+
+	// pad with silence if the decoder fell behind
+	if (frames < AUDIO_CHUNK_FRAMES) {
+		memset(out + frames * frame_bytes, 0, (AUDIO_CHUNK_FRAMES - frames) * frame_bytes);
+		if (!eof)
+			atomic_fetch_add(&thread_stats.audio_underruns, 1);
 	}
 
 	// Update the timestamp.
 	SDL_LockMutex(mc->timer_mutex);
-	mc->stream_time += (double)samples / mc->audio.ctx->sample_rate;
+	mc->stream_time += (double)frames / mc->audio.ctx->sample_rate;
 	mc->wall_time_ms = SDL_GetTicks();
 	SDL_UnlockMutex(mc->timer_mutex);
 	return STS_STREAM_CONTINUE;
 }
 #endif
 
+static bool init_audio_format(struct movie_context *mc)
+{
+	switch (mc->audio.ctx->sample_fmt) {
+	case AV_SAMPLE_FMT_S16:
+		mc->sts_stream.sample.audio_format = STS_MIXER_SAMPLE_FORMAT_16;
+		mc->bytes_per_sample = 2;
+		mc->interleaved = true;
+		break;
+	case AV_SAMPLE_FMT_S16P:
+		mc->sts_stream.sample.audio_format = STS_MIXER_SAMPLE_FORMAT_16;
+		mc->bytes_per_sample = 2;
+		mc->interleaved = false;
+		break;
+	case AV_SAMPLE_FMT_S32P:
+		mc->sts_stream.sample.audio_format = STS_MIXER_SAMPLE_FORMAT_32;
+		mc->bytes_per_sample = 4;
+		mc->interleaved = false;
+		break;
+	case AV_SAMPLE_FMT_FLTP:
+		mc->sts_stream.sample.audio_format = STS_MIXER_SAMPLE_FORMAT_FLOAT;
+		mc->bytes_per_sample = 4;
+		mc->interleaved = false;
+		break;
+	default:
+		return false;
+	}
+	// size the ring to hold several of the largest frames the codec
+	// produces, so the audio thread never has to split or grow it
+	unsigned frames = AUDIO_RING_FRAMES;
+	while (frames < (unsigned)mc->audio.ctx->frame_size * AUDIO_RING_CODEC_FRAMES)
+		frames *= 2;
+	mc->audio_ring_size = frames * mc->bytes_per_sample * 2;
+	mc->audio_ring = audio_alloc(mc, mc->audio_ring_size);
+	mc->sts_stream.sample.length = AUDIO_CHUNK_FRAMES * 2;
+	mc->sts_stream.sample.data = audio_alloc(mc, AUDIO_CHUNK_FRAMES * 2 * mc->bytes_per_sample);
+	return true;
+}
+
+static bool start_thread(SDL_Thread **thread, SDL_ThreadFunction fn, const char *name,
+		struct movie_context *mc)
+{
+	*thread = SDL_CreateThread(fn, name, mc);
+	if (!*thread) {
+		WARNING("SDL_CreateThread failed: %s", SDL_GetError());
+		return false;
+	}
+	return true;
+}
+
+static bool start_threads(struct movie_context *mc)
+{
+	mc->mutex = SDL_CreateMutex();
+	mc->demux_cond = SDL_CreateCond();
+	mc->packet_cond = SDL_CreateCond();
+	mc->frame_cond = SDL_CreateCond();
+	mc->audio_cond = SDL_CreateCond();
+	if (!start_thread(&mc->demux_thread, demux_thread, "movie_demux", mc))
+		return false;
+	if (!start_thread(&mc->video.thread, video_thread, "movie_video", mc))
+		return false;
+	if (mc->audio_ring && !start_thread(&mc->audio.thread, audio_thread, "movie_audio", mc))
+		return false;
+	return true;
+}
+
+static void stop_threads(struct movie_context *mc)
+{
+	if (!mc->mutex)
+		return;
+	SDL_LockMutex(mc->mutex);
+	mc->quit = true;
+	SDL_CondBroadcast(mc->demux_cond);
+	SDL_CondBroadcast(mc->packet_cond);
+	SDL_CondBroadcast(mc->frame_cond);
+	SDL_CondBroadcast(mc->audio_cond);
+	SDL_UnlockMutex(mc->mutex);
+
+	if (mc->demux_thread)
+		SDL_WaitThread(mc->demux_thread, NULL);
+	if (mc->video.thread)
+		SDL_WaitThread(mc->video.thread, NULL);
+	if (mc->audio.thread)
+		SDL_WaitThread(mc->audio.thread, NULL);
+
+	SDL_DestroyCond(mc->demux_cond);
+	SDL_DestroyCond(mc->packet_cond);
+	SDL_DestroyCond(mc->frame_cond);
+	SDL_DestroyCond(mc->audio_cond);
+	SDL_DestroyMutex(mc->mutex);
+}
+
 static AVStream *open_stream(AVFormatContext *ctx, unsigned type)
 {
 	if (avformat_find_stream_info(ctx, NULL) < 0) {
@@ -290,20 +675,46 @@ struct movie_context *_movie_load(struct movie_context *mc, AVFormatContext *vid
 		goto error;
 	}
 
-	if (!(mc->sws_buf = av_malloc(size))) {
-		WARNING("av_malloc failed");
-		goto error;
+	// The renderer scales the texture to the output, so planes can only be
+	// uploaded directly when no scaling is requested from swscale. SDL
+	// converts IYUV textures as limited range, so full range (JPEG) video
+	// goes through swscale.
+	mc->yuv = mc->video.ctx->pix_fmt == AV_PIX_FMT_YUV420P
+		&& mc->video.ctx->color_range != AVCOL_RANGE_JPEG
+		&& mc->video.ctx->width == w && mc->video.ctx->height == h;
+	for (int i = 0; i < (mc->yuv ? 1 : VIDEO_FRAMES + 1); i++) {
+		if (!(mc->pixel_bufs[i] = av_malloc(size))) {
+			WARNING("av_malloc failed");
+			goto error;
+		}
 	}
-	if (av_image_fill_arrays(mc->sws_frame->data, mc->sws_frame->linesize, mc->sws_buf,
+	if (av_image_fill_arrays(mc->sws_frame->data, mc->sws_frame->linesize, mc->pixel_bufs[0],
 			AV_PIX_FMT_RGBA, w, h, 1) < 0) {
 		WARNING("av_image_fill_arrays failed");
 		goto error;
 	}
+	for (int i = 0; i < VIDEO_FRAMES; i++) {
+		if (mc->yuv && !(mc->frames[i].frame = av_frame_alloc())) {
+			WARNING("av_frame_alloc failed");
+			goto error;
+		}
+		mc->frames[i].pixels = mc->pixel_bufs[i + 1];
+	}
+	if (mc->yuv && !(mc->last_frame = av_frame_alloc())) {
+		WARNING("av_frame_alloc failed");
+		goto error;
+	}
+	AVRational rate = mc->video.stream->avg_frame_rate;
+	mc->frame_duration = rate.num > 0 && rate.den > 0 ? av_q2d(av_inv_q(rate)) : 1.0 / 30;
 
 	mc->timer_mutex = SDL_CreateMutex();
 	mc->volume = 100;
 
-	preload_packets(mc);
+	// an unsupported format is reported by movie_play
+	if (mc->audio.stream)
+		init_audio_format(mc);
+	if (!start_threads(mc))
+		goto error;
 	return mc;
 error:
 	movie_free(mc);
@@ -454,9 +865,10 @@ void movie_free(struct movie_context *mc)
 #ifndef USE_SDL_MIXER
 	if (mc->voice >= 0)
 		mixer_sts_stream_stop(mc->voice);
-	if (mc->sts_stream.sample.data)
-		free(mc->sts_stream.sample.data);
 #endif
+	stop_threads(mc);
+	free(mc->sts_stream.sample.data);
+	free(mc->audio_ring);
 
 	if (mc->timer_mutex)
 		SDL_DestroyMutex(mc->timer_mutex);
@@ -468,20 +880,25 @@ void movie_free(struct movie_context *mc)
 		sws_freeContext(mc->sws_ctx);
 	if (mc->sws_frame)
 		av_frame_free(&mc->sws_frame);
-	if (mc->sws_buf)
-		av_free(mc->sws_buf);
+	for (int i = 0; i < VIDEO_FRAMES + 1; i++) {
+		av_free(mc->pixel_bufs[i]);
+	}
+	for (int i = 0; i < VIDEO_FRAMES; i++) {
+		if (mc->frames[i].frame)
+			av_frame_free(&mc->frames[i].frame);
+	}
+	if (mc->last_frame)
+		av_frame_free(&mc->last_frame);
 	free(mc);
 }
 
-int movie_draw(struct movie_context *mc)
+static double frame_pts(struct movie_context *mc, struct video_frame *f)
 {
-	// Decode a frame, unless we already have one.
-	if (!mc->has_pending_video_frame && !decode_frame(&mc->video))
-		return mc->video.finished ? 0 : -1;
-
-	// Get frame timestamp
-	double pts = av_q2d(mc->video.stream->time_base) * mc->video.frame->best_effort_timestamp + mc->video_rewind_time;
+	return av_q2d(mc->video.stream->time_base) * f->ts + mc->video_rewind_time;
+}
 
+int movie_draw(struct movie_context *mc)
+{
 	// Get current time (and update stream time if no audio stream)
 	SDL_LockMutex(mc->timer_mutex);
 	unsigned now_ms = SDL_GetTicks();
@@ -492,27 +909,81 @@ int movie_draw(struct movie_context *mc)
 	}
 	SDL_UnlockMutex(mc->timer_mutex);
 
-	// If timestamp is in the future, save frame and return.
+	SDL_LockMutex(mc->mutex);
+	if (mc->frames_read == mc->frames_written) {
+		if (mc->video_eof)
+			mc->video.finished = true;
+		SDL_UnlockMutex(mc->mutex);
+		return 0;
+	}
+
+	// If the next frame's timestamp is in the future, wait.
+	struct video_frame *f = &mc->frames[mc->frames_read % VIDEO_FRAMES];
+	double pts = frame_pts(mc, f);
 	if (pts > now) {
-		mc->has_pending_video_frame = true;
-		// We have spare time, let's buffer some packets.
-		preload_packets(mc);
+		SDL_UnlockMutex(mc->mutex);
 		return 0;
 	}
 
-	// Convert to RGB and update the texture.
-	sws_scale(mc->sws_ctx, (const uint8_t **)mc->video.frame->data, mc->video.frame->linesize,
-		 0, mc->video.ctx->height, mc->sws_frame->data, mc->sws_frame->linesize);
-	SDL_CALL(SDL_UpdateTexture, mc->dst, NULL, mc->sws_frame->data[0], mc->sws_frame->linesize[0]);
+	// Skip frames that are already superseded by a newer one.
+	while (mc->frames_written - mc->frames_read > 1) {
+		struct video_frame *next = &mc->frames[(mc->frames_read + 1) % VIDEO_FRAMES];
+		double next_pts = frame_pts(mc, next);
+		if (next_pts > now)
+			break;
+		mc->frames_read++;
+		stats.frames_dropped++;
+		f = next;
+		pts = next_pts;
+	}
+	if (now - pts > mc->frame_duration)
+		stats.frames_late++;
+	stats.frames_displayed++;
+	stats.video_frames_queued += mc->frames_written - mc->frames_read;
+	stats.video_packets_queued += av_fifo_can_read(mc->video.queue);
+	if (mc->audio.queue)
+		stats.audio_packets_queued += av_fifo_can_read(mc->audio.queue);
+	SDL_UnlockMutex(mc->mutex);
+
+	// Update the texture. The displayed frame is swapped out of its slot
+	// so that it outlives it (see movie_get_pixels).
+	uint64_t start = SDL_GetPerformanceCounter();
+	if (mc->yuv) {
+		AVFrame *frame = f->frame;
+		SDL_CALL(SDL_UpdateYUVTexture, mc->dst, NULL,
+				frame->data[0], frame->linesize[0],
+				frame->data[1], frame->linesize[1],
+				frame->data[2], frame->linesize[2]);
+		f->frame = mc->last_frame;
+		mc->last_frame = frame;
+		mc->has_last_frame = true;
+	} else {
+		SDL_CALL(SDL_UpdateTexture, mc->dst, NULL, f->pixels, mc->sws_frame->linesize[0]);
+		uint8_t *tmp = mc->sws_frame->data[0];
+		mc->sws_frame->data[0] = f->pixels;
+		f->pixels = tmp;
+	}
+	stats.upload_us += elapsed_us(start);
 	SDL_CALL(SDL_RenderClear, gfx.renderer);
 	SDL_CALL(SDL_RenderCopy, gfx.renderer, mc->dst, NULL, NULL);
-	mc->video_current_frame = mc->video.frame->best_effort_timestamp;
-	mc->has_pending_video_frame = false;
+	mc->video_current_frame = f->ts;
+
+	SDL_LockMutex(mc->mutex);
+	mc->frames_read++;
+	SDL_CondBroadcast(mc->frame_cond);
+	SDL_UnlockMutex(mc->mutex);
 	return 1;
 }
 
 uint8_t *movie_get_pixels(struct movie_context *mc, unsigned *stride)
 {
+	if (mc->yuv) {
+		if (!mc->has_last_frame)
+			return NULL;
+		sws_scale(mc->sws_ctx, (const uint8_t **)mc->last_frame->data,
+				mc->last_frame->linesize, 0, mc->video.ctx->height,
+				mc->sws_frame->data, mc->sws_frame->linesize);
+	}
 	if (!mc->sws_frame->data[0])
 		return NULL;
 	*stride = mc->sws_frame->linesize[0];
@@ -524,24 +995,26 @@ uint8_t *movie_get_pixels(struct movie_context *mc, unsigned *stride)
  */
 bool movie_seek_video(struct movie_context *mc, unsigned ts)
 {
-	SDL_LockMutex(mc->video.mutex);
+	SDL_LockMutex(mc->mutex);
 	if (av_seek_frame(mc->video.format_ctx, mc->video.stream->index, ts, AVSEEK_FLAG_ANY) < 0) {
 		WARNING("av_seek_frame failed");
-		SDL_UnlockMutex(mc->video.mutex);
+		SDL_UnlockMutex(mc->mutex);
 		return false;
 	}
 	int diff = (int)mc->video_current_frame - (int)ts;
 	mc->video_rewind_time += av_q2d(mc->video.stream->time_base) * diff;
 	mc->video_current_frame = ts;
-	mc->has_pending_video_frame = false;
 
-	// flush queued frames
-	int size = av_fifo_can_read(mc->video.queue);
-	if (size > 0)
-		av_fifo_drain2(mc->video.queue, size);
+	// flush queued packets and frames
+	flush_packets(&mc->video);
 	mc->video.format_eof = false;
+	mc->frames_read = mc->frames_written;
+	mc->video_serial++;
+	mc->video_eof = false;
+	SDL_CondBroadcast(mc->frame_cond);
+	SDL_CondSignal(mc->demux_cond);
 
-	SDL_UnlockMutex(mc->video.mutex);
+	SDL_UnlockMutex(mc->mutex);
 
 	return true;
 }
@@ -559,34 +1032,13 @@ bool movie_play(struct movie_context *mc)
 
 #ifndef USE_SDL_MIXER
 	if (mc->audio.stream) {
-		mc->sts_stream.userdata = mc;
-		mc->sts_stream.callback = audio_callback;
-		mc->sts_stream.sample.frequency = mc->audio.ctx->sample_rate;
-		switch (mc->audio.ctx->sample_fmt) {
-		case AV_SAMPLE_FMT_S16:
-			mc->sts_stream.sample.audio_format = STS_MIXER_SAMPLE_FORMAT_16;
-			mc->bytes_per_sample = 2;
-			mc->interleaved = true;
-			break;
-		case AV_SAMPLE_FMT_S16P:
-			mc->sts_stream.sample.audio_format = STS_MIXER_SAMPLE_FORMAT_16;
-			mc->bytes_per_sample = 2;
-			mc->interleaved = false;
-			break;
-		case AV_SAMPLE_FMT_S32P:
-			mc->sts_stream.sample.audio_format = STS_MIXER_SAMPLE_FORMAT_32;
-			mc->bytes_per_sample = 4;
-			mc->interleaved = false;
-			break;
-		case AV_SAMPLE_FMT_FLTP:
-			mc->sts_stream.sample.audio_format = STS_MIXER_SAMPLE_FORMAT_FLOAT;
-			mc->bytes_per_sample = 4;
-			mc->interleaved = false;
-			break;
-		default:
+		if (!mc->audio_ring) {
 			WARNING("Unsupported audio format %d", mc->audio.ctx->sample_fmt);
 			return false;
 		}
+		mc->sts_stream.userdata = mc;
+		mc->sts_stream.callback = audio_callback;
+		mc->sts_stream.sample.frequency = mc->audio.ctx->sample_rate;
 		mc->voice = mixer_sts_stream_play(&mc->sts_stream, mc->volume);
 	}
 #endif
@@ -594,9 +1046,15 @@ bool movie_play(struct movie_context *mc)
 	if (!mc->audio.stream)
 		mc->audio.finished = true;
 
-	SDL_CTOR(SDL_CreateTexture, mc->dst, gfx.renderer, SDL_PIXELFORMAT_RGBA32,
-			SDL_TEXTUREACCESS_STATIC,
-			mc->video.ctx->width, mc->video.ctx->height);
+	if (mc->yuv) {
+		SDL_CTOR(SDL_CreateTexture, mc->dst, gfx.renderer, SDL_PIXELFORMAT_IYUV,
+				SDL_TEXTUREACCESS_STREAMING,
+				mc->video.ctx->width, mc->video.ctx->height);
+	} else {
+		SDL_CTOR(SDL_CreateTexture, mc->dst, gfx.renderer, SDL_PIXELFORMAT_RGBA32,
+				SDL_TEXTUREACCESS_STATIC,
+				mc->video.ctx->width, mc->video.ctx->height);
+	}
 
 	return true;
 }
@@ -0,0 +1,190 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <SDL.h>
+
+#include "nulib.h"
+
+#include "ai5.h"
+#include "game.h"
+#include "profile.h"
+
+struct profile_entry {
+	unsigned long calls;
+	uint64_t ticks;
+};
+
+struct profile_mes {
+	char *name;
+	struct profile_entry e;
+};
+
+static struct profile_entry stmt_entries[PROFILE_STMT_TEXT + 1];
+static struct profile_entry expr_entries[256];
+static struct profile_entry sys_entries[GAME_MAX_SYS];
+static struct profile_entry util_entries[GAME_MAX_UTIL];
+
+static struct {
+	struct profile_entry *entries;
+	unsigned nr_entries;
+	const char *name;
+} categories[PROFILE_NR_CATEGORIES] = {
+	[PROFILE_STMT] = { stmt_entries, ARRAY_SIZE(stmt_entries), "Statements" },
+	[PROFILE_EXPR] = { expr_entries, ARRAY_SIZE(expr_entries), "Expressions" },
+	[PROFILE_SYS]  = { sys_entries, ARRAY_SIZE(sys_entries), "System calls" },
+	[PROFILE_UTIL] = { util_entries, ARRAY_SIZE(util_entries), "Util calls" },
+};
+
+// per-MES file statement counts/times
+static struct profile_mes *mes_entries = NULL;
+static unsigned nr_mes_entries = 0;
+static int cur_mes = -1;
+
+bool vm_profile_enabled = false;
+
+void profile_init(void)
+{
+	if (!config.profile)
+		return;
+	profile_enable(true);
+	atexit(profile_print);
+}
+
+void profile_enable(bool enable)
+{
+	vm_profile_enabled = enable;
+}
+
+void profile_reset(void)
+{
+	for (int i = 0; i < PROFILE_NR_CATEGORIES; i++) {
+		memset(categories[i].entries, 0,
+				categories[i].nr_entries * sizeof(struct profile_entry));
+	}
+	for (unsigned i = 0; i < nr_mes_entries; i++) {
+		mes_entries[i].e = (struct profile_entry) {0};
+	}
+}
+
+uint64_t profile_start(void)
+{
+	return SDL_GetPerformanceCounter();
+}
+
+void profile_end(enum profile_category cat, unsigned no, uint64_t start)
+{
+	uint64_t t = SDL_GetPerformanceCounter() - start;
+	struct profile_entry *e = &categories[cat].entries[no];
+	e->calls++;
+	e->ticks += t;
+	if (cat == PROFILE_STMT && cur_mes >= 0) {
+		mes_entries[cur_mes].e.calls++;
+		mes_entries[cur_mes].e.ticks += t;
+	}
+}
+
+void profile_set_mes(const char *name)
+{
+	for (unsigned i = 0; i < nr_mes_entries; i++) {
+		if (!strcmp(mes_entries[i].name, name)) {
+			cur_mes = i;
+			return;
+		}
+	}
+	mes_entries = xrealloc(mes_entries, (nr_mes_entries + 1) * sizeof(struct profile_mes));
+	mes_entries[nr_mes_entries] = (struct profile_mes) { .name = xstrdup(name) };
+	cur_mes = nr_mes_entries++;
+}
+
+struct profile_row {
+	char name[32];
+	struct profile_entry *e;
+};
+
+static int profile_row_cmp(const void *_a, const void *_b)
+{
+	const struct profile_row *a = _a;
+	const struct profile_row *b = _b;
+	if (a->e->ticks != b->e->ticks)
+		return a->e->ticks < b->e->ticks ? 1 : -1;
+	return 0;
+}
+
+static void print_rows(const char *title, struct profile_row *rows, unsigned nr_rows)
+{
+	if (!nr_rows)
+		return;
+	qsort(rows, nr_rows, sizeof(struct profile_row), profile_row_cmp);
+
+	double freq = SDL_GetPerformanceFrequency();
+	printf("\n%-24s %12s %12s %12s\n", title, "calls", "total ms", "avg us");
+	for (unsigned i = 0; i < nr_rows; i++) {
+		double ms = rows[i].e->ticks * 1000.0 / freq;
+		printf("%-24s %12lu %12.2f %12.2f\n", rows[i].name, rows[i].e->calls, ms,
+				ms * 1000.0 / rows[i].e->calls);
+	}
+}
+
+static void format_row_name(enum profile_category cat, unsigned no, char *buf)
+{
+	switch (cat) {
+	case PROFILE_STMT:
+		if (no == PROFILE_STMT_TEXT)
+			strcpy(buf, "text");
+		else
+			sprintf(buf, "stmt 0x%02x", no);
+		break;
+	case PROFILE_EXPR:
+		sprintf(buf, "expr 0x%02x", no);
+		break;
+	case PROFILE_SYS:
+		sprintf(buf, "System.function[%u]", no);
+		break;
+	case PROFILE_UTIL:
+		sprintf(buf, "Util.function[%u]", no);
+		break;
+	case PROFILE_NR_CATEGORIES:
+		break;
+	}
+}
+
+void profile_print(void)
+{
+	struct profile_row *rows = xcalloc(max(GAME_MAX_UTIL, nr_mes_entries),
+			sizeof(struct profile_row));
+	for (int cat = 0; cat < PROFILE_NR_CATEGORIES; cat++) {
+		unsigned nr_rows = 0;
+		for (unsigned i = 0; i < categories[cat].nr_entries; i++) {
+			if (!categories[cat].entries[i].calls)
+				continue;
+			format_row_name(cat, i, rows[nr_rows].name);
+			rows[nr_rows++].e = &categories[cat].entries[i];
+		}
+		print_rows(categories[cat].name, rows, nr_rows);
+	}
+
+	unsigned nr_rows = 0;
+	for (unsigned i = 0; i < nr_mes_entries; i++) {
+		if (!mes_entries[i].e.calls)
+			continue;
+		snprintf(rows[nr_rows].name, sizeof(rows[nr_rows].name), "%s", mes_entries[i].name);
+		rows[nr_rows++].e = &mes_entries[i].e;
+	}
+	print_rows("MES files", rows, nr_rows);
+	free(rows);
+}
@@ -14,81 +14,480 @@
  * along with this program; if not, see <http://gnu.org/licenses/>.
  */
 
+/*
+ * Save files are kept in memory. Each file is read once, the first time it
+ * is used, and all reads and writes go to the in-memory image. Modified
+ * images are written back a short while after the last change (so that a
+ * script saving many small pieces of a file in a row only writes it once),
+ * and at exit. Files are replaced atomically: the image is written to a
+ * temporary file, synced, and renamed over the original, and then the
+ * directory is synced so that the rename itself survives a crash.
+ *
+ * The writes happen on a background thread. Syncing queues a copy of each
+ * modified image; a copy that is still queued when the same file is synced
+ * again is replaced rather than written twice. Since reads are always served
+ * from memory, only exit has to wait for the queue to drain. An image whose
+ * write fails is marked modified again, so that it is retried by the next
+ * update (or at exit).
+ */
+
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <SDL.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "nulib.h"
 #include "nulib/file.h"
 #include "nulib/little_endian.h"
+#include "nulib/queue.h"
+#include "nulib/vector.h"
 
+#include "asset.h"
 #include "game.h"
 #include "memory.h"
 #include "savedata.h"
 #include "vm.h"
 
-static void close_save(FILE *f)
+// time after the first unsaved change before images are written back
+#define SAVE_FLUSH_DELAY_MS 250
+
+struct save_image {
+	// name as first used by the game
+	char *name;
+	// path on disk (identifies the image)
+	char *path;
+	uint8_t *data;
+	size_t size;
+	bool dirty;
+	// the last background write failed (protected by writer.mutex)
+	bool write_failed;
+};
+
+struct save_write_job {
+	TAILQ_ENTRY(save_write_job) entry;
+	struct save_image *img;
+	uint8_t *data;
+	size_t size;
+	uint64_t queued_at;
+};
+
+static vector_t(struct save_image*) images = vector_initializer;
+static bool pending = false;
+static uint32_t pending_since = 0;
+// protected by writer.mutex once the writer thread is running
+static struct savedata_stats stats = {0};
+
+static struct {
+	SDL_Thread *thread;
+	SDL_mutex *mutex;
+	// signalled when a job is queued (or on shutdown)
+	SDL_cond *queued;
+	bool quit;
+	// some image has write_failed set
+	bool failed;
+	unsigned nr_jobs;
+	TAILQ_HEAD(, save_write_job) jobs;
+} writer = {0};
+
+static void count_io_calls(unsigned n)
 {
-	if (fclose(f))
-		WARNING("fclose: %s", strerror(errno));
+	if (writer.mutex)
+		SDL_LockMutex(writer.mutex);
+	stats.io_calls += n;
+	if (writer.mutex)
+		SDL_UnlockMutex(writer.mutex);
+}
+
+void savedata_stats(struct savedata_stats *out)
+{
+	if (writer.mutex)
+		SDL_LockMutex(writer.mutex);
+	*out = stats;
+	if (writer.mutex)
+		SDL_UnlockMutex(writer.mutex);
+}
+
+#ifdef _WIN32
+static int sync_file(FILE *f)
+{
+	return _commit(_fileno(f));
+}
+
+// paths are UTF-8; convert them for the wide-character Windows APIs
+static wchar_t *wide_path(const char *path)
+{
+	int n = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
+	if (!n)
+		return NULL;
+	wchar_t *wpath = xmalloc(n * sizeof(wchar_t));
+	if (!MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, n)) {
+		free(wpath);
+		return NULL;
+	}
+	return wpath;
+}
+
+static int replace_file(const char *src, const char *dst)
+{
+	wchar_t *wsrc = wide_path(src);
+	wchar_t *wdst = wide_path(dst);
+	int r = -1;
+	if (wsrc && wdst && MoveFileExW(wsrc, wdst, MOVEFILE_REPLACE_EXISTING
+				| MOVEFILE_WRITE_THROUGH))
+		r = 0;
+	free(wsrc);
+	free(wdst);
+	return r;
+}
+
+static int remove_file(const char *path)
+{
+	wchar_t *wpath = wide_path(path);
+	int r = wpath ? _wremove(wpath) : -1;
+	free(wpath);
+	return r;
+}
+
+static int sync_parent_dir(const char *path)
+{
+	// MOVEFILE_WRITE_THROUGH doesn't return until the rename is on disk
+	return 0;
+}
+#else
+static int sync_file(FILE *f)
+{
+	return fsync(fileno(f));
 }
 
-// XXX: Save files should be shipped with the game, but if not we create them.
-static void create_save(const char *save_name)
+static int replace_file(const char *src, const char *dst)
 {
-	FILE *f = file_open_utf8(save_name, "wb");
+	return rename(src, dst);
+}
+
+static int remove_file(const char *path)
+{
+	return remove(path);
+}
+
+// sync the directory containing `path`, which makes a rename into it durable
+static int sync_parent_dir(const char *path)
+{
+	char *dir = xstrdup(path);
+	char *sep = strrchr(dir, '/');
+	if (sep)
+		sep[sep == dir ? 1 : 0] = '\0';
+	int fd = open(sep ? dir : ".", O_RDONLY);
+	free(dir);
+	if (fd < 0)
+		return -1;
+	int r = fsync(fd);
+	close(fd);
+	return r;
+}
+#endif
+
+static bool write_save(const char *path, const uint8_t *data, size_t size, unsigned *io_calls)
+{
+	bool ok = false;
+	char *tmp_path = xmalloc(strlen(path) + 5);
+	sprintf(tmp_path, "%s.tmp", path);
+
+	(*io_calls)++;
+	FILE *f = file_open_utf8(tmp_path, "wb");
 	if (!f) {
-		WARNING("fopen: %s", strerror(errno));
-		return;
+		WARNING("Failed to open \"%s\": %s", tmp_path, strerror(errno));
+		goto end;
 	}
-	uint8_t buf[MEMORY_MEM16_MAX_SIZE];
-	memset(buf, 0, game->mem16_size);
-	if (fwrite(buf, game->mem16_size, 1, f) != 1)
+	*io_calls += 4;
+	if (fwrite(data, size, 1, f) != 1) {
 		WARNING("fwrite: %s", strerror(errno));
-	close_save(f);
+		fclose(f);
+		goto remove;
+	}
+	if (fflush(f) || sync_file(f)) {
+		WARNING("fsync: %s", strerror(errno));
+		fclose(f);
+		goto remove;
+	}
+	if (fclose(f)) {
+		WARNING("fclose: %s", strerror(errno));
+		goto remove;
+	}
+	(*io_calls)++;
+	if (replace_file(tmp_path, path)) {
+		WARNING("Failed to replace save file \"%s\": %s", path, strerror(errno));
+		goto remove;
+	}
+	ok = true;
+	// the new file is in place; failing to sync only risks losing it in a crash
+	*io_calls += 3;
+	if (sync_parent_dir(path))
+		WARNING("Failed to sync directory of \"%s\": %s", path, strerror(errno));
+	goto end;
+remove:
+	(*io_calls)++;
+	remove_file(tmp_path);
+end:
+	free(tmp_path);
+	return ok;
 }
 
-static FILE *open_save(const char *save_name, const char *mode)
+static uint64_t elapsed_us(uint64_t start)
 {
-	char *path = path_get_icase(save_name);
-	if (!path) {
-		create_save(save_name);
-		path = strdup(save_name);
+	return (SDL_GetPerformanceCounter() - start) * 1000000 / SDL_GetPerformanceFrequency();
+}
+
+// bucket i counts values below 2^i (and the last bucket everything else)
+static void histogram_add(unsigned long *hist, unsigned nr_buckets, uint64_t value)
+{
+	unsigned i = 0;
+	while (i < nr_buckets - 1 && value >= (1ull << i))
+		i++;
+	hist[i]++;
+}
+
+static int save_writer_thread(void *data)
+{
+	SDL_LockMutex(writer.mutex);
+	while (true) {
+		while (!writer.quit && TAILQ_EMPTY(&writer.jobs))
+			SDL_CondWait(writer.queued, writer.mutex);
+		// the queue is drained before quitting
+		if (TAILQ_EMPTY(&writer.jobs))
+			break;
+
+		struct save_write_job *job = TAILQ_FIRST(&writer.jobs);
+		TAILQ_REMOVE(&writer.jobs, job, entry);
+		writer.nr_jobs--;
+		SDL_UnlockMutex(writer.mutex);
+
+		unsigned io_calls = 0;
+		bool ok = write_save(job->img->path, job->data, job->size, &io_calls);
+
+		SDL_LockMutex(writer.mutex);
+		stats.io_calls += io_calls;
+		if (ok) {
+			stats.flushes++;
+		} else {
+			stats.write_failures++;
+			job->img->write_failed = true;
+			writer.failed = true;
+		}
+		histogram_add(stats.write_latency, SAVEDATA_LATENCY_BUCKETS,
+				elapsed_us(job->queued_at) / 1000);
+		free(job->data);
+		free(job);
+	}
+	SDL_UnlockMutex(writer.mutex);
+	return 0;
+}
+
+static void queue_write(struct save_image *img)
+{
+	SDL_LockMutex(writer.mutex);
+	struct save_write_job *job;
+	TAILQ_FOREACH(job, &writer.jobs, entry) {
+		if (job->img == img)
+			break;
+	}
+	if (job) {
+		// not started yet: write the newer image instead
+		free(job->data);
+		stats.coalesced++;
+	} else {
+		job = xcalloc(1, sizeof(struct save_write_job));
+		job->img = img;
+		job->queued_at = SDL_GetPerformanceCounter();
+		TAILQ_INSERT_TAIL(&writer.jobs, job, entry);
+		writer.nr_jobs++;
+		histogram_add(stats.queue_depth, SAVEDATA_QUEUE_BUCKETS, writer.nr_jobs - 1);
+	}
+	job->data = xmalloc(img->size);
+	job->size = img->size;
+	memcpy(job->data, img->data, img->size);
+	SDL_CondSignal(writer.queued);
+	SDL_UnlockMutex(writer.mutex);
+}
+
+void savedata_sync(void)
+{
+	struct save_image *img;
+	vector_foreach(img, images) {
+		if (!img->dirty)
+			continue;
+		// the write may create the file
+		asset_path_invalidate(img->path);
+		if (writer.thread) {
+			queue_write(img);
+			img->dirty = false;
+			continue;
+		}
+		// no writer thread: write synchronously (on failure the image
+		// stays dirty and is retried at the next sync)
+		unsigned io_calls = 0;
+		if (write_save(img->path, img->data, img->size, &io_calls)) {
+			img->dirty = false;
+			stats.flushes++;
+		} else {
+			stats.write_failures++;
+		}
+		count_io_calls(io_calls);
+	}
+	pending = false;
+}
+
+static void mark_dirty(struct save_image *img)
+{
+	img->dirty = true;
+	if (!pending) {
+		pending = true;
+		pending_since = vm_get_ticks();
+	}
+}
+
+// mark images whose background write failed as modified again
+// (called with writer.mutex held, or after the writer thread has exited)
+static void retry_failed_writes(void)
+{
+	if (!writer.failed)
+		return;
+	struct save_image *img;
+	vector_foreach(img, images) {
+		if (img->write_failed) {
+			img->write_failed = false;
+			mark_dirty(img);
+		}
+	}
+	writer.failed = false;
+}
+
+static void save_writer_fini(void)
+{
+	savedata_sync();
+	if (!writer.thread)
+		return;
+	SDL_LockMutex(writer.mutex);
+	writer.quit = true;
+	SDL_CondSignal(writer.queued);
+	SDL_UnlockMutex(writer.mutex);
+	SDL_WaitThread(writer.thread, NULL);
+	writer.thread = NULL;
+	SDL_DestroyCond(writer.queued);
+	SDL_DestroyMutex(writer.mutex);
+	writer.mutex = NULL;
+
+	// one last synchronous attempt at anything that failed on the thread
+	retry_failed_writes();
+	savedata_sync();
+}
+
+static void save_writer_init(void)
+{
+	TAILQ_INIT(&writer.jobs);
+	atexit(save_writer_fini);
+	if (!(writer.mutex = SDL_CreateMutex()) || !(writer.queued = SDL_CreateCond())) {
+		WARNING("Failed to initialize save writer: %s", SDL_GetError());
+		return;
+	}
+	writer.thread = SDL_CreateThread(save_writer_thread, "save_writer", NULL);
+	if (!writer.thread)
+		WARNING("SDL_CreateThread failed: %s", SDL_GetError());
+}
+
+void savedata_update(void)
+{
+	if (writer.thread) {
+		SDL_LockMutex(writer.mutex);
+		retry_failed_writes();
+		SDL_UnlockMutex(writer.mutex);
+	}
+	if (pending && vm_get_ticks() - pending_since >= SAVE_FLUSH_DELAY_MS)
+		savedata_sync();
+}
+
+/*
+ * Images are identified by the path of the file, so that names which differ
+ * only in case share one image. Otherwise each image would be written back
+ * whole, and the last one written would undo the other's changes.
+ */
+static struct save_image *get_save(const char *save_name)
+{
+	struct save_image *img;
+	vector_foreach(img, images) {
+		if (!strcmp(img->name, save_name))
+			return img;
+	}
+
+	count_io_calls(1);
+	char *path = asset_path_icase(save_name);
+	vector_foreach(img, images) {
+		// a file that doesn't exist yet has its path set to the name
+		if (path ? !strcmp(img->path, path) : !strcasecmp(img->path, save_name)) {
+			free(path);
+			return img;
+		}
+	}
+
+	if (vector_length(images) == 0)
+		save_writer_init();
+	img = xcalloc(1, sizeof(struct save_image));
+	img->name = xstrdup(save_name);
+	vector_push(struct save_image*, images, img);
+
+	img->path = path;
+	if (!img->path) {
+		// XXX: Save files should be shipped with the game, but if not we create them.
 		WARNING("Save file \"%s\" doesn't exist", save_name);
+		img->path = xstrdup(save_name);
+		img->size = game->mem16_size;
+		img->data = xcalloc(1, img->size);
+		mark_dirty(img);
+		return img;
+	}
+
+	// open, read, close
+	count_io_calls(3);
+	stats.loads++;
+	if (!(img->data = file_read(img->path, &img->size))) {
+		WARNING("Failed to read save file \"%s\": %s", save_name, strerror(errno));
+		img->size = 0;
 	}
-	FILE *f = file_open_utf8(path, mode);
-	free(path);
-	return f;
+	return img;
 }
 
 void savedata_read(const char *save_name, uint8_t *buf, uint32_t off, size_t size)
 {
-	FILE *f = open_save(save_name, "rb");
-	if (!f) {
-		WARNING("Failed to open save file \"%s\": %s", save_name, strerror(errno));
-		return;
+	struct save_image *img = get_save(save_name);
+	stats.operations++;
+	if (off + size > img->size) {
+		WARNING("Short read from save file \"%s\" (%u+%u > %u)", save_name,
+				(unsigned)off, (unsigned)size, (unsigned)img->size);
+		size = off < img->size ? img->size - off : 0;
 	}
-	if (off && fseek(f, off, SEEK_SET) < 0)
-		WARNING("fseek: %s", strerror(errno));
-	if (fread(buf + off, size, 1, f) != 1)
-		WARNING("fread: %s", strerror(errno));
-	close_save(f);
+	memcpy(buf + off, img->data + off, size);
 }
 
 void savedata_write(const char *save_name, const uint8_t *buf, uint32_t off, size_t size)
 {
-	// XXX: we open r+b (O_RDWR) because it's the only write mode that doesn't
-	//      truncate or append
-	FILE *f = open_save(save_name, "r+b");
-	if (!f) {
-		WARNING("Failed to open save file \"%s\": %s", save_name, strerror(errno));
-		return;
+	struct save_image *img = get_save(save_name);
+	stats.operations++;
+	if (off + size > img->size) {
+		img->data = xrealloc(img->data, off + size);
+		memset(img->data + img->size, 0, off + size - img->size);
+		img->size = off + size;
 	}
-	if (off && fseek(f, off, SEEK_SET) < 0)
-		WARNING("fseek: %s", strerror(errno));
-	if (fwrite(buf + off, size, 1, f) != 1)
-		WARNING("fwrite: %s", strerror(errno));
-	close_save(f);
+	memcpy(img->data + off, buf + off, size);
+	mark_dirty(img);
 }
 
 void savedata_resume_load(const char *save_name)
@@ -131,34 +530,15 @@ void savedata_save_var4(const char *save_name, unsigned var4_size)
 
 void savedata_save_union_var4(const char *save_name, unsigned var4_size)
 {
-	uint8_t buf[MEMORY_VAR4_MAX_SIZE];
-	FILE *f = open_save(save_name, "r+b");
-	if (!f) {
-		WARNING("Failed to open save file \"%s\": %s", save_name, strerror(errno));
-		return;
-	}
-	if (fseek(f, MEMORY_VAR4_OFFSET, SEEK_SET) < 0) {
-		WARNING("fseek: %s", strerror(errno));
-		goto end;
-	}
-	if (fread(buf, var4_size, 1, f) != 1) {
-		WARNING("fread: %s", strerror(errno));
-		goto end;
-	}
+	uint8_t buf[MEMORY_MEM16_MAX_SIZE];
+	savedata_read(save_name, buf, MEMORY_VAR4_OFFSET, var4_size);
 
 	uint8_t *var4 = mem_var4();
 	for (unsigned i = 0; i < var4_size; i++) {
-		buf[i] |= var4[i];
+		buf[MEMORY_VAR4_OFFSET + i] |= var4[i];
 	}
 
-	if (fseek(f, MEMORY_VAR4_OFFSET, SEEK_SET) < 0) {
-		WARNING("fseek: %s", strerror(errno));
-		goto end;
-	}
-	if (fwrite(buf, var4_size, 1, f) != 1)
-		WARNING("fwrite: %s", strerror(errno));
-end:
-	close_save(f);
+	savedata_write(save_name, buf, MEMORY_VAR4_OFFSET, var4_size);
 }
 
 void savedata_load_var4_slice(const char *save_name, unsigned from, unsigned to)
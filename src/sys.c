@@ -180,6 +180,9 @@ void _sys_load_image(const char *name, unsigned i, unsigned x_mult)
 		return;
 	}
 
+	// start decoding upcoming CGs while this one is drawn
+	vm_cg_lookahead();
+
 	// draw CG
 	if (!vm_flag_is_on(FLAG_PALETTE_ONLY)) {
 		mem_set_sysvar16(mes_sysvar16_cg_x, cg->metrics.x / x_mult);
@@ -392,6 +395,7 @@ void sys_graphics_pixel_crossfade_masked(struct param_list *params)
 void sys_wait(struct param_list *params)
 {
 	texthook_commit();
+	gfx_flush();
 	if (params->nr_params == 0 || vm_expr_param(params, 0) == 0) {
 		while (true) {
 			if (input_down(INPUT_CTRL)) {
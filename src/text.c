@@ -14,10 +14,13 @@
  * along with this program; if not, see <http://gnu.org/licenses/>.
  */
 
+#include <limits.h>
+#include <string.h>
 #include <SDL_ttf.h>
 
 #include "nulib.h"
 #include "nulib/file.h"
+#include "nulib/queue.h"
 #include "ai5/mes.h"
 
 #include "ai5.h"
@@ -218,13 +221,446 @@ void gfx_text_swap_colors(int x, int y, int w, int h, unsigned i)
 	gfx_swap_colors(x, y, w, h, i, gfx.text.bg, gfx.text.fg);
 }
 
+/*
+ * Glyph cache.
+ *
+ * Rendered glyphs are packed into one atlas surface per (font, style, render mode).
+ * Glyphs are rendered in a neutral color (palette index 1 for solid glyphs, white for
+ * blended glyphs) and recolored at blit time, so that cached glyphs don't depend on
+ * the current text colors.
+ */
+
+#define GLYPH_ATLAS_COLS 16
+#define GLYPH_ATLAS_ROW_STEP 4
+#define GLYPH_EMPTY 0xffffffff
+
+struct glyph {
+	uint32_t ch;
+	uint16_t w, h;
+	uint64_t last_used;
+};
+
+struct glyph_atlas {
+	TAILQ_ENTRY(glyph_atlas) entry;
+	TTF_Font *font;
+	int style;
+	bool blended;
+	SDL_Surface *s;
+	int cell_w, cell_h;
+	unsigned nr_cells;
+	unsigned nr_used;
+	struct glyph *cells;
+	// open-addressing hash table mapping codepoints to cell indices
+	uint32_t *table;
+	unsigned table_bits;
+};
+
+// reference to a rendered glyph; either a cell in an atlas or a one-off surface
+struct glyph_ref {
+	SDL_Surface *s;
+	SDL_Rect r;
+	bool owned;
+};
+
+static TAILQ_HEAD(glyph_atlas_head, glyph_atlas) glyph_atlases =
+	TAILQ_HEAD_INITIALIZER(glyph_atlases);
+static struct gfx_text_cache_stats glyph_stats = {0};
+static uint64_t glyph_clock = 0;
+
+static unsigned glyph_hash(struct glyph_atlas *a, uint32_t ch)
+{
+	return (ch * 0x9e3779b1u) >> (32 - a->table_bits);
+}
+
+static uint32_t *glyph_table_lookup(struct glyph_atlas *a, uint32_t ch)
+{
+	unsigned mask = (1u << a->table_bits) - 1;
+	for (unsigned i = glyph_hash(a, ch); true; i = (i + 1) & mask) {
+		if (a->table[i] == GLYPH_EMPTY || a->cells[a->table[i]].ch == ch)
+			return &a->table[i];
+	}
+}
+
+static void glyph_table_remove(struct glyph_atlas *a, uint32_t *slot)
+{
+	unsigned mask = (1u << a->table_bits) - 1;
+	unsigned i = slot - a->table;
+	unsigned j = i;
+	while (true) {
+		j = (j + 1) & mask;
+		if (a->table[j] == GLYPH_EMPTY)
+			break;
+		// shift entry at j back into the hole unless its home slot lies in (i,j]
+		unsigned k = glyph_hash(a, a->cells[a->table[j]].ch);
+		if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+			a->table[i] = a->table[j];
+			i = j;
+		}
+	}
+	a->table[i] = GLYPH_EMPTY;
+}
+
+static void glyph_table_rebuild(struct glyph_atlas *a)
+{
+	a->table_bits = 1;
+	while ((1u << a->table_bits) < a->nr_cells * 2)
+		a->table_bits++;
+	free(a->table);
+	a->table = xmalloc(sizeof(uint32_t) << a->table_bits);
+	memset(a->table, 0xff, sizeof(uint32_t) << a->table_bits);
+	for (unsigned i = 0; i < a->nr_used; i++) {
+		*glyph_table_lookup(a, a->cells[i].ch) = i;
+	}
+}
+
+static size_t glyph_atlas_bytes(struct glyph_atlas *a)
+{
+	return a->s ? (size_t)a->s->pitch * a->s->h : 0;
+}
+
+static void glyph_atlas_free(struct glyph_atlas *a)
+{
+	TAILQ_REMOVE(&glyph_atlases, a, entry);
+	glyph_stats.bytes -= glyph_atlas_bytes(a);
+	glyph_stats.glyphs -= a->nr_used;
+	glyph_stats.evictions += a->nr_used;
+	if (a->s)
+		SDL_FreeSurface(a->s);
+	free(a->cells);
+	free(a->table);
+	free(a);
+}
+
+static struct glyph_atlas *glyph_atlas_get(TTF_Font *font, bool blended)
+{
+	int style = TTF_GetFontStyle(font);
+	struct glyph_atlas *a;
+	TAILQ_FOREACH(a, &glyph_atlases, entry) {
+		if (a->font == font && a->style == style && a->blended == blended) {
+			// move to front of atlas list
+			TAILQ_REMOVE(&glyph_atlases, a, entry);
+			TAILQ_INSERT_HEAD(&glyph_atlases, a, entry);
+			return a;
+		}
+	}
+
+	a = xcalloc(1, sizeof(struct glyph_atlas));
+	a->font = font;
+	a->style = style;
+	a->blended = blended;
+	a->cell_h = TTF_FontHeight(font);
+	a->cell_w = a->cell_h;
+	TAILQ_INSERT_HEAD(&glyph_atlases, a, entry);
+	return a;
+}
+
+/*
+ * Add a row of cells to an atlas, dropping least recently used atlases if
+ * needed to stay within the byte budget.
+ */
+static bool glyph_atlas_grow(struct glyph_atlas *a)
+{
+	int w = a->cell_w * GLYPH_ATLAS_COLS;
+	int h = (a->s ? a->s->h : 0) + a->cell_h * GLYPH_ATLAS_ROW_STEP;
+	size_t old_bytes = glyph_atlas_bytes(a);
+	size_t new_bytes = (size_t)w * h * (a->blended ? 4 : 1);
+	while (glyph_stats.bytes - old_bytes + new_bytes > config.glyph_cache_size) {
+		struct glyph_atlas *lru = TAILQ_LAST(&glyph_atlases, glyph_atlas_head);
+		if (lru == a)
+			return false;
+		glyph_atlas_free(lru);
+	}
+
+	SDL_Surface *s;
+	SDL_CTOR(SDL_CreateRGBSurfaceWithFormat, s, 0, w, h, a->blended ? 32 : 8,
+			a->blended ? SDL_PIXELFORMAT_ARGB8888 : SDL_PIXELFORMAT_INDEX8);
+	if (a->blended) {
+		SDL_CALL(SDL_SetSurfaceBlendMode, s, SDL_BLENDMODE_BLEND);
+	} else {
+		SDL_CALL(SDL_SetColorKey, s, SDL_TRUE, 0);
+	}
+	if (a->s) {
+		// same width and format, so the pitch is unchanged
+		memcpy(s->pixels, a->s->pixels, a->s->pitch * a->s->h);
+		SDL_FreeSurface(a->s);
+	}
+	a->s = s;
+	glyph_stats.bytes = glyph_stats.bytes - old_bytes + glyph_atlas_bytes(a);
+
+	unsigned nr_cells = GLYPH_ATLAS_COLS * (h / a->cell_h);
+	a->cells = xrealloc(a->cells, nr_cells * sizeof(struct glyph));
+	for (unsigned i = a->nr_cells; i < nr_cells; i++) {
+		a->cells[i].ch = GLYPH_EMPTY;
+	}
+	a->nr_cells = nr_cells;
+	glyph_table_rebuild(a);
+	return true;
+}
+
+static struct glyph *glyph_atlas_alloc(struct glyph_atlas *a)
+{
+	if (a->nr_used < a->nr_cells || glyph_atlas_grow(a))
+		return &a->cells[a->nr_used++];
+	if (!a->nr_used)
+		return NULL;
+
+	// evict least recently used glyph
+	struct glyph *lru = &a->cells[0];
+	for (unsigned i = 1; i < a->nr_used; i++) {
+		if (a->cells[i].last_used < lru->last_used)
+			lru = &a->cells[i];
+	}
+	glyph_table_remove(a, glyph_table_lookup(a, lru->ch));
+	glyph_stats.evictions++;
+	glyph_stats.glyphs--;
+	return lru;
+}
+
+static SDL_Rect glyph_cell_rect(struct glyph_atlas *a, struct glyph *g)
+{
+	unsigned i = g - a->cells;
+	return (SDL_Rect) {
+		(i % GLYPH_ATLAS_COLS) * a->cell_w,
+		(i / GLYPH_ATLAS_COLS) * a->cell_h,
+		g->w,
+		g->h
+	};
+}
+
+static void glyph_copy_to_cell(struct glyph_atlas *a, SDL_Rect *cell, SDL_Surface *glyph)
+{
+	if (a->blended) {
+		SDL_CALL(SDL_SetSurfaceBlendMode, glyph, SDL_BLENDMODE_NONE);
+		SDL_CALL(SDL_BlitSurface, glyph, NULL, a->s, cell);
+		return;
+	}
+	if (SDL_MUSTLOCK(glyph))
+		SDL_CALL(SDL_LockSurface, glyph);
+	for (int row = 0; row < glyph->h; row++) {
+		uint8_t *src = glyph->pixels + row * glyph->pitch;
+		uint8_t *dst = a->s->pixels + (cell->y + row) * a->s->pitch + cell->x;
+		memcpy(dst, src, glyph->w);
+	}
+	if (SDL_MUSTLOCK(glyph))
+		SDL_UnlockSurface(glyph);
+}
+
+static SDL_Surface *glyph_render(TTF_Font *font, uint32_t ch, bool blended)
+{
+	static const SDL_Color white = { 255, 255, 255, 255 };
+	SDL_Surface *s;
+	if (blended) {
+		if (!(s = TTF_RenderGlyph32_Blended(font, ch, white)))
+			ERROR("TTF_RenderGlyph32_Blended: %s", TTF_GetError());
+	} else {
+		if (!(s = TTF_RenderGlyph32_Solid(font, ch, white)))
+			ERROR("TTF_RenderGlyph32_Solid: %s", TTF_GetError());
+	}
+	glyph_stats.misses++;
+	return s;
+}
+
+static void glyph_get(TTF_Font *font, uint32_t ch, bool blended, struct glyph_ref *ref)
+{
+	struct glyph_atlas *a = NULL;
+	if (config.glyph_cache_size) {
+		a = glyph_atlas_get(font, blended);
+		uint32_t *slot = a->table ? glyph_table_lookup(a, ch) : NULL;
+		if (slot && *slot != GLYPH_EMPTY) {
+			struct glyph *g = &a->cells[*slot];
+			g->last_used = ++glyph_clock;
+			glyph_stats.hits++;
+			ref->s = a->s;
+			ref->r = glyph_cell_rect(a, g);
+			ref->owned = false;
+			return;
+		}
+	}
+
+	SDL_Surface *s = glyph_render(font, ch, blended);
+	struct glyph *g = NULL;
+	if (!a || s->w > a->cell_w || s->h > a->cell_h || !(g = glyph_atlas_alloc(a))) {
+		ref->s = s;
+		ref->r = (SDL_Rect) { 0, 0, s->w, s->h };
+		ref->owned = true;
+		return;
+	}
+
+	g->ch = ch;
+	g->w = s->w;
+	g->h = s->h;
+	g->last_used = ++glyph_clock;
+	*glyph_table_lookup(a, ch) = g - a->cells;
+	glyph_stats.glyphs++;
+
+	ref->s = a->s;
+	ref->r = glyph_cell_rect(a, g);
+	ref->owned = false;
+	glyph_copy_to_cell(a, &ref->r, s);
+	SDL_FreeSurface(s);
+}
+
+static void glyph_set_color(struct glyph_ref *ref, bool blended, SDL_Color c)
+{
+	if (blended) {
+		SDL_CALL(SDL_SetSurfaceColorMod, ref->s, c.r, c.g, c.b);
+	} else {
+		c.a = 255;
+		SDL_CALL(SDL_SetPaletteColors, ref->s->format->palette, &c, 1, 1);
+	}
+}
+
+static void glyph_release(struct glyph_ref *ref)
+{
+	if (ref->owned)
+		SDL_FreeSurface(ref->s);
+}
+
+void gfx_text_cache_stats(struct gfx_text_cache_stats *stats)
+{
+	*stats = glyph_stats;
+}
+
+/*
+ * Text runs. Between gfx_text_begin_run and gfx_text_end_run, damage is
+ * accumulated per line of text instead of per glyph. Solid (non-antialiased)
+ * direct-color glyphs are composited into an indexed scratch surface (index 1
+ * for the outline, index 2 for the glyph) which is blitted once per line. As
+ * the glyphs are composited in the same order they would have been blitted,
+ * the result is identical to blitting each outline and glyph separately.
+ */
+#define RUN_OUTLINE 1
+#define RUN_GLYPH 2
+
+static struct {
+	bool active;
+	unsigned surface;
+	// position of the current line
+	int line_x;
+	int line_y;
+	SDL_Rect damage;
+	// scratch surface for solid direct-color glyphs, and the region of it
+	// which is in use (in destination coordinates)
+	SDL_Surface *scratch;
+	SDL_Rect scratch_r;
+} run = {0};
+
+static void text_dirty(unsigned i, int x, int y, int w, int h)
+{
+	if (run.active) {
+		SDL_Rect r = { x, y, w, h };
+		SDL_UnionRect(&run.damage, &r, &run.damage);
+		return;
+	}
+	glyph_stats.dirty_calls++;
+	gfx_dirty(i, x, y, w, h);
+}
+
+static void run_flush(void)
+{
+	if (run.scratch_r.w > 0 && run.scratch_r.h > 0) {
+		SDL_Color colors[2] = { gfx.text.bg_color, gfx.text.fg_color };
+		colors[0].a = 255;
+		colors[1].a = 255;
+		SDL_CALL(SDL_SetPaletteColors, run.scratch->format->palette, colors, RUN_OUTLINE, 2);
+		SDL_Rect src_r = { 0, 0, run.scratch_r.w, run.scratch_r.h };
+		SDL_Rect dst_r = run.scratch_r;
+		SDL_CALL(SDL_BlitSurface, run.scratch, &src_r, gfx_get_surface(run.surface), &dst_r);
+		glyph_stats.blits++;
+		for (int row = 0; row < run.scratch_r.h; row++) {
+			memset(run.scratch->pixels + row * run.scratch->pitch, 0, run.scratch_r.w);
+		}
+	}
+	run.scratch_r = (SDL_Rect) {0};
+
+	if (run.damage.w > 0 && run.damage.h > 0) {
+		glyph_stats.dirty_calls++;
+		gfx_dirty(run.surface, run.damage.x, run.damage.y, run.damage.w, run.damage.h);
+	}
+	run.damage = (SDL_Rect) {0};
+}
+
+// flush the current line if the glyph at (x,y) doesn't continue it
+static void run_glyph_begin(int x, int y)
+{
+	if (y != run.line_y || x < run.line_x)
+		run_flush();
+	run.line_x = x;
+	run.line_y = y;
+}
+
+static bool run_scratch_reserve(int w, int h)
+{
+	if (run.scratch && run.scratch->w >= w && run.scratch->h >= h)
+		return true;
+	run_flush();
+	if (run.scratch)
+		SDL_FreeSurface(run.scratch);
+	w = max(w, run.scratch ? run.scratch->w : 0);
+	h = max(h, run.scratch ? run.scratch->h : 0);
+	run.scratch = SDL_CreateRGBSurfaceWithFormat(0, w, h, 8, SDL_PIXELFORMAT_INDEX8);
+	if (!run.scratch) {
+		WARNING("SDL_CreateRGBSurfaceWithFormat: %s", SDL_GetError());
+		return false;
+	}
+	SDL_CALL(SDL_SetColorKey, run.scratch, SDL_TRUE, 0);
+	SDL_CALL(SDL_FillRect, run.scratch, NULL, 0);
+	return true;
+}
+
+// composite a solid glyph into the scratch surface at (x,y)
+static void run_scratch_put(struct glyph_ref *ref, int x, int y, uint8_t index)
+{
+	if (run.scratch_r.w == 0) {
+		run.scratch_r.x = x;
+		run.scratch_r.y = y;
+	}
+	int sx = x - run.scratch_r.x;
+	int sy = y - run.scratch_r.y;
+	int w = min(ref->r.w, run.scratch->w - sx);
+	int h = min(ref->r.h, run.scratch->h - sy);
+	if (unlikely(sx < 0 || sy < 0 || w <= 0 || h <= 0))
+		return;
+
+	if (SDL_MUSTLOCK(ref->s))
+		SDL_CALL(SDL_LockSurface, ref->s);
+	for (int row = 0; row < h; row++) {
+		uint8_t *src = ref->s->pixels + (ref->r.y + row) * ref->s->pitch + ref->r.x;
+		uint8_t *dst = run.scratch->pixels + (sy + row) * run.scratch->pitch + sx;
+		for (int col = 0; col < w; col++) {
+			if (src[col])
+				dst[col] = index;
+		}
+	}
+	if (SDL_MUSTLOCK(ref->s))
+		SDL_UnlockSurface(ref->s);
+
+	run.scratch_r.w = max(run.scratch_r.w, sx + w);
+	run.scratch_r.h = max(run.scratch_r.h, sy + h);
+}
+
+void gfx_text_begin_run(unsigned i)
+{
+	run.active = true;
+	run.surface = i;
+	run.line_x = INT_MIN;
+	run.line_y = INT_MIN;
+}
+
+void gfx_text_end_run(void)
+{
+	run_flush();
+	run.active = false;
+}
+
 // XXX: We have to blit manually so that the correct foreground index is written.
-static void glyph_blit_indexed(SDL_Surface *glyph, int dst_x, int dst_y, SDL_Surface *s)
+static void glyph_blit_indexed(SDL_Surface *glyph, SDL_Rect *glyph_r, int dst_x, int dst_y,
+		SDL_Surface *s)
 {
-	int glyph_x = 0;
-	int glyph_y = 0;
-	int glyph_w = glyph->w;
-	int glyph_h = glyph->h;
+	int glyph_x = glyph_r->x;
+	int glyph_y = glyph_r->y;
+	int glyph_w = glyph_r->w;
+	int glyph_h = glyph_r->h;
 	if (unlikely(dst_x < 0)) {
 		glyph_w += dst_x;
 		glyph_x -= dst_x;
@@ -271,45 +707,76 @@ static unsigned gfx_text_draw_glyph_indexed(int i, int x, int y, uint32_t ch)
 {
 	SDL_Surface *dst = gfx_get_surface(i);
 	assert(gfx.text.fg < dst->format->palette->ncolors);
-	SDL_Color fg = dst->format->palette->colors[gfx.text.fg];
-	SDL_Surface *s = TTF_RenderGlyph32_Solid(cur_font->id, ch, fg);
-	if (!s)
-		ERROR("TTF_RenderGlyph32_Solid: %s", TTF_GetError());
+	struct glyph_ref glyph;
+	glyph_get(cur_font->id, ch, false, &glyph);
 
 	y -= cur_font->y_off;
-	unsigned w = s->w;
-	glyph_blit_indexed(s, x, y, dst);
-	gfx_dirty(i, x, y, s->w, s->h);
-	SDL_FreeSurface(s);
+	if (run.active)
+		run_glyph_begin(x, y);
+	unsigned w = glyph.r.w;
+	glyph_blit_indexed(glyph.s, &glyph.r, x, y, dst);
+	glyph_stats.blits++;
+	text_dirty(i, x, y, glyph.r.w, glyph.r.h);
+	glyph_release(&glyph);
 	return w;
 }
 
+static unsigned gfx_text_draw_glyph_run(SDL_Surface *dst, int x, int y, uint32_t ch)
+{
+	struct glyph_ref outline, glyph;
+	run_glyph_begin(x, y);
+
+	glyph_get(cur_font->id_outline, ch, false, &outline);
+	if (!run_scratch_reserve(dst->w + 2, outline.r.h + 2)) {
+		glyph_release(&outline);
+		return 0;
+	}
+	run_scratch_put(&outline, x-1, y-1, RUN_OUTLINE);
+	text_dirty(run.surface, x-1, y-1, outline.r.w, outline.r.h);
+	glyph_release(&outline);
+
+	glyph_get(cur_font->id, ch, false, &glyph);
+	run_scratch_put(&glyph, x, y, RUN_GLYPH);
+	// return the width as clipped to the destination surface
+	SDL_Rect glyph_r = { x, y, glyph.r.w, glyph.r.h };
+	SDL_Rect dst_r = { 0, 0, dst->w, dst->h };
+	if (!SDL_IntersectRect(&glyph_r, &dst_r, &glyph_r))
+		glyph_r.w = 0;
+	glyph_release(&glyph);
+	return glyph_r.w;
+}
+
 static unsigned gfx_text_draw_glyph_direct(int i, int x, int y, uint32_t ch)
 {
-	SDL_Surface *outline, *glyph;
+	// XXX: Antialiasing can cause issues if the text is rendered to a surface
+	//      filled with the mask color and then copied to the main surface with
+	//      copy_masked (e.g. Doukyuusei does this).
+	const bool blended = text_antialias;
 	SDL_Surface *dst = gfx_get_surface(i);
-	if (!text_antialias) {
-		// XXX: Antialiasing can cause issues if the text is rendered to a surface
-		//      filled with the mask color and then copied to the main surface with
-		//      copy_masked (e.g. Doukyuusei does this).
-		outline = TTF_RenderGlyph32_Solid(cur_font->id_outline, ch, gfx.text.bg_color);
-		glyph = TTF_RenderGlyph32_Solid(cur_font->id, ch, gfx.text.fg_color);
-	} else {
-		outline = TTF_RenderGlyph32_Blended(cur_font->id_outline, ch, gfx.text.bg_color);
-		glyph = TTF_RenderGlyph32_Blended(cur_font->id, ch, gfx.text.fg_color);
-	}
-	if (!outline || !glyph)
-		ERROR("TTF_RenderGlyph32_Blended: %s", TTF_GetError());
+	struct glyph_ref outline, glyph;
 
 	y -= cur_font->y_off;
+	if (run.active) {
+		if (!blended)
+			return gfx_text_draw_glyph_run(dst, x, y, ch);
+		run_glyph_begin(x, y);
+	}
 
-	SDL_Rect outline_r = { x-1, y-1, outline->w, outline->h };
-	SDL_Rect glyph_r = { x, y, glyph->w, glyph->h };
-	SDL_CALL(SDL_BlitSurface, outline, NULL, dst, &outline_r);
-	SDL_CALL(SDL_BlitSurface, glyph, NULL, dst, &glyph_r);
-	gfx_dirty(i, x-1, y-1, outline->w, outline->h);
-	SDL_FreeSurface(glyph);
-	SDL_FreeSurface(outline);
+	// XXX: the outline is blitted before the glyph is looked up, since looking
+	//      up the glyph may evict the outline's atlas
+	glyph_get(cur_font->id_outline, ch, blended, &outline);
+	glyph_set_color(&outline, blended, gfx.text.bg_color);
+	SDL_Rect outline_r = { x-1, y-1, outline.r.w, outline.r.h };
+	SDL_CALL(SDL_BlitSurface, outline.s, &outline.r, dst, &outline_r);
+	text_dirty(i, x-1, y-1, outline.r.w, outline.r.h);
+	glyph_release(&outline);
+
+	glyph_get(cur_font->id, ch, blended, &glyph);
+	glyph_set_color(&glyph, blended, gfx.text.fg_color);
+	SDL_Rect glyph_r = { x, y, glyph.r.w, glyph.r.h };
+	SDL_CALL(SDL_BlitSurface, glyph.s, &glyph.r, dst, &glyph_r);
+	glyph_stats.blits += 2;
+	glyph_release(&glyph);
 	return glyph_r.w;
 }
 
@@ -18,6 +18,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <SDL.h>
 
 #include "nulib.h"
 #include "nulib/little_endian.h"
@@ -33,6 +34,7 @@
 #include "asset.h"
 #include "audio.h"
 #include "backlog.h"
+#include "bench.h"
 #include "char.h"
 #include "debug.h"
 #include "game.h"
@@ -40,10 +42,13 @@
 #include "input.h"
 #include "memory.h"
 #include "menu.h"
+#include "profile.h"
+#include "savedata.h"
 #include "texthook.h"
 #include "vm_private.h"
 
 struct vm vm = {0};
+struct vm_stats vm_stats = {0};
 struct memory memory = {0};
 struct memory_ptr memory_ptr = {0};
 struct game *game = NULL;
@@ -67,16 +72,38 @@ void _vm_error(const char *file, const char *func, int line, const char *fmt, ..
 void vm_init(void)
 {
 	vm.ip.code = memory.file_data;
+	profile_init();
+}
+
+/*
+ * Copy of FLAG_LOG, which controls whether bytes read from the script are
+ * appended to the backlog. Scripts may write the flag directly, so it is
+ * refreshed at the start of each statement and whenever the VM toggles it,
+ * rather than being tested on every byte.
+ */
+static bool vm_log_bytes = false;
+
+static void vm_log_update(void)
+{
+	vm_log_bytes = vm_flag_is_on(FLAG_LOG);
 }
 
 static uint8_t vm_read_byte(void)
 {
 	uint8_t c = vm.ip.code[vm.ip.ptr++];
-	if (vm_flag_is_on(FLAG_LOG))
+	if (unlikely(vm_log_bytes))
 		backlog_push_byte(c);
 	return c;
 }
 
+// consume a run of bytes that was read directly from vm.ip.code
+static void vm_read_run(uint32_t end)
+{
+	if (unlikely(vm_log_bytes))
+		backlog_push_bytes(vm.ip.code + vm.ip.ptr, end - vm.ip.ptr);
+	vm.ip.ptr = end;
+}
+
 static uint8_t vm_peek_byte(void)
 {
 	return vm.ip.code[vm.ip.ptr];
@@ -115,8 +142,71 @@ static uint32_t vm_stack_pop(void)
 	return vm.stack[--vm.stack_ptr];
 }
 
+/*
+ * Cache of recently loaded MES files. Returning from MESCALL reloads the
+ * calling script, so keeping a copy of it in RAM avoids going back to the
+ * archive every time a subroutine script returns.
+ */
+#define MES_CACHE_SIZE 8
+
+struct mes_cache_entry {
+	char *name;
+	uint32_t hash;
+	uint8_t *data;
+	size_t size;
+	unsigned long last_used;
+};
+
+static struct mes_cache_entry mes_cache[MES_CACHE_SIZE] = {0};
+static unsigned long mes_cache_clock = 0;
+// cache entry most recently copied to the start of memory.file_data
+static struct mes_cache_entry *mes_resident = NULL;
+
+static uint32_t mes_name_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+	for (; *name; name++) {
+		h = (h ^ (uint8_t)*name) * 16777619u;
+	}
+	return h;
+}
+
+static struct mes_cache_entry *mes_cache_lookup(const char *name, uint32_t hash)
+{
+	for (int i = 0; i < MES_CACHE_SIZE; i++) {
+		struct mes_cache_entry *e = &mes_cache[i];
+		if (e->data && e->hash == hash && !strcmp(e->name, name))
+			return e;
+	}
+	return NULL;
+}
+
+static struct mes_cache_entry *mes_cache_insert(const char *name, uint32_t hash,
+		struct archive_data *file)
+{
+	// use an empty entry or evict the least recently used one
+	struct mes_cache_entry *e = &mes_cache[0];
+	for (int i = 0; i < MES_CACHE_SIZE && e->data; i++) {
+		if (!mes_cache[i].data || mes_cache[i].last_used < e->last_used)
+			e = &mes_cache[i];
+	}
+	if (e == mes_resident)
+		mes_resident = NULL;
+	free(e->name);
+	free(e->data);
+
+	e->name = xstrdup(name);
+	e->hash = hash;
+	e->data = xmalloc(file->size);
+	e->size = file->size;
+	memcpy(e->data, file->data, file->size);
+	return e;
+}
+
 void vm_load_file(struct archive_data *file, uint32_t offset)
 {
+	if (mes_resident && offset < mes_resident->size)
+		mes_resident = NULL;
 	dbg_invalidate(offsetof(struct memory, file_data) + offset, file->size);
 	memcpy(memory.file_data + offset, file->data, file->size);
 	dbg_load_file(file->name, offsetof(struct memory, file_data) + offset, file->size);
@@ -144,11 +234,57 @@ void vm_load_mes(char *name)
 	for (int i = 0; memory_raw[i]; i++) {
 		memory_raw[i] = toupper(memory_raw[i]);
 	}
+
+	if (unlikely(vm_profile_enabled))
+		profile_set_mes(mem_mes_name());
+
+	uint32_t hash = mes_name_hash(mem_mes_name());
+	struct mes_cache_entry *e = mes_cache_lookup(mem_mes_name(), hash);
+	if (e) {
+		vm_stats.mes_cache_hits++;
+		e->last_used = ++mes_cache_clock;
+		asset_mes_set_name(name);
+		// the script may have been modified in memory since it was loaded
+		if (e == mes_resident && !memcmp(memory.file_data, e->data, e->size)) {
+			vm_stats.mes_copies_skipped++;
+			vm_cg_lookahead();
+			return;
+		}
+		struct archive_data file = {
+			.name = e->name,
+			.data = e->data,
+			.size = e->size,
+		};
+		vm_load_file(&file, 0);
+		mes_resident = e;
+		vm_cg_lookahead();
+		return;
+	}
+
 	struct archive_data *file = asset_mes_load(name);
 	if (!file)
 		VM_ERROR("Failed to load MES file \"%s\"", name);
+	vm_stats.mes_loads++;
 	vm_load_file(file, 0);
+	e = mes_cache_insert(mem_mes_name(), hash, file);
+	e->last_used = ++mes_cache_clock;
+	mes_resident = e;
 	archive_data_release(file);
+	vm_cg_lookahead();
+}
+
+#define CG_LOOKAHEAD_SIZE 4096
+
+/*
+ * Scan the upcoming bytes of the current script for CG file names and
+ * prefetch them.
+ */
+void vm_cg_lookahead(void)
+{
+	uint8_t *p = vm.ip.code + vm.ip.ptr;
+	if (!mem_ptr_valid(p, 1))
+		return;
+	asset_cg_prefetch_scan(p, min(CG_LOOKAHEAD_SIZE, memory_end - p));
 }
 
 void vm_expr_var16(void)
@@ -289,7 +425,7 @@ static uint32_t vm_eval(void)
 		if (op == 0xff)
 			return vm_expr_end();
 		if (game->expr_op[op])
-			game->expr_op[op]();
+			PROFILE_CALL(PROFILE_EXPR, op, game->expr_op[op]());
 		else
 			vm_stack_push(op);
 	}
@@ -298,14 +434,12 @@ static uint32_t vm_eval(void)
 
 static void read_string_param(char *str)
 {
-	size_t str_i = 0;
-	uint8_t c;
-	for (str_i = 0; (c = vm_read_byte()); str_i++) {
-		if (unlikely(str_i >= STRING_PARAM_SIZE))
-			VM_ERROR("String parameter overflowed buffer");
-		str[str_i] = c;
-	}
-	str[str_i] = '\0';
+	const uint8_t *s = vm.ip.code + vm.ip.ptr;
+	size_t len = strlen((const char*)s);
+	if (unlikely(len >= STRING_PARAM_SIZE))
+		VM_ERROR("String parameter overflowed buffer");
+	memcpy(str, s, len + 1);
+	vm_read_run(vm.ip.ptr + len + 1);
 }
 
 void read_params(struct param_list *params)
@@ -398,6 +532,7 @@ void vm_draw_text(const char *text)
 	uint16_t x = mem_get_sysvar16(mes_sysvar16_text_cursor_x);
 	uint16_t y = mem_get_sysvar16(mes_sysvar16_text_cursor_y);
 	bool last_char_is_close = false;
+	gfx_text_begin_run(surface);
 	while (*text) {
 		int ch;
 		bool zenkaku = SJIS_2BYTE(*text);
@@ -428,6 +563,7 @@ void vm_draw_text(const char *text)
 		gfx_text_draw_glyph(x, y, surface, ch);
 		x += this_char_space;
 	}
+	gfx_text_end_run();
 	mem_set_sysvar16(mes_sysvar16_text_cursor_x, x);
 	mem_set_sysvar16(mes_sysvar16_text_cursor_y, y);
 }
@@ -439,49 +575,67 @@ void handle_text(void(*read_text)(char*), void(*draw_text)(const char*), bool wi
 	if (vm_flag_is_on(FLAG_LOG_ENABLE) && vm_flag_is_on(FLAG_LOG_TEXT)) {
 		backlog_prepare();
 		vm_flag_on(FLAG_LOG);
+		vm_log_update();
 		if (with_op)
 			backlog_push_byte(mes_code_tables.stmt_op_to_int[MES_STMT_HANKAKU]);
 	}
 
 	char str[TXT_BUF_SIZE];
-	read_text(str);
+	if (unlikely(config.bench)) {
+		uint32_t ptr = vm.ip.ptr;
+		uint64_t start = SDL_GetPerformanceCounter();
+		read_text(str);
+		vm_stats.text_ticks[vm_log_bytes] += SDL_GetPerformanceCounter() - start;
+		vm_stats.text_bytes[vm_log_bytes] += vm.ip.ptr - ptr;
+	} else {
+		read_text(str);
+	}
 	texthook_push(str);
 
 	gfx_text_set_weight(mem_get_sysvar16(mes_sysvar16_font_weight));
 	draw_text(str);
 
-	if (vm_flag_is_on(FLAG_LOG_ENABLE) && vm_flag_is_on(FLAG_LOG_TEXT))
+	if (vm_flag_is_on(FLAG_LOG_ENABLE) && vm_flag_is_on(FLAG_LOG_TEXT)) {
 		vm_flag_off(FLAG_LOG);
+		vm_log_update();
+	}
 }
 
 static void read_zenkaku(char *str)
 {
+	const uint8_t *code = vm.ip.code;
+	uint32_t ptr = vm.ip.ptr;
 	uint8_t c;
 	int str_i = 0;
-	while ((c = vm_peek_byte())) {
+	while ((c = code[ptr])) {
 		if (unlikely(!mes_char_is_zenkaku(c)))
 			goto unterminated;
-		str[str_i++] = vm_read_byte();
-		str[str_i++] = vm_read_byte();
+		str[str_i++] = c;
+		str[str_i++] = code[ptr + 1];
+		ptr += 2;
 	}
-	vm_read_byte();
+	ptr++;
 unterminated:
 	str[str_i] = 0;
+	vm_read_run(ptr);
 }
 
 static void read_hankaku(char *str)
 {
+	const uint8_t *code = vm.ip.code;
+	uint32_t ptr = vm.ip.ptr;
 	uint8_t c;
 	int str_i = 0;
-	while ((c = vm_peek_byte())) {
+	while ((c = code[ptr])) {
 		if (unlikely(!mes_char_is_hankaku(c)))
 			goto unterminated;
 		str[str_i++] = c;
-		vm_read_byte();
+		ptr++;
 	}
-	vm_read_byte();
+	ptr++;
 unterminated:
 	str[str_i] = 0;
+	vm_read_run(ptr);
 }
 
 static void _vm_stmt_txt(bool with_op)
@@ -677,6 +831,7 @@ void vm_stmt_sys(void)
 {
 	if (vm_flag_is_on(FLAG_LOG_ENABLE) && vm_flag_is_on(FLAG_LOG_SYS)) {
 		vm_flag_on(FLAG_LOG);
+		vm_log_update();
 		backlog_push_byte(mes_code_tables.stmt_op_to_int[MES_STMT_SYS]);
 	}
 
@@ -689,10 +844,12 @@ void vm_stmt_sys(void)
 	if (unlikely(!game->sys[no]))
 		VM_ERROR("System.function[%u] not implemented", no);
 
-	game->sys[no](&params);
+	PROFILE_CALL(PROFILE_SYS, no, game->sys[no](&params));
 
-	if (vm_flag_is_on(FLAG_LOG_ENABLE) && vm_flag_is_on(FLAG_LOG_SYS))
+	if (vm_flag_is_on(FLAG_LOG_ENABLE) && vm_flag_is_on(FLAG_LOG_SYS)) {
 		vm_flag_off(FLAG_LOG);
+		vm_log_update();
+	}
 }
 
 void vm_stmt_mesjmp(void)
@@ -794,7 +951,7 @@ void vm_stmt_util(void)
 		VM_ERROR("Invalid Util number: %u", no);
 	if (unlikely(!game->util[no]))
 		VM_ERROR("Util.function[%u] not implemented", no);
-	game->util[no](&params);
+	PROFILE_CALL(PROFILE_UTIL, no, game->util[no](&params));
 }
 
 void vm_stmt_line(void)
@@ -834,6 +991,7 @@ bool vm_exec_statement(void)
 	mes_statement_free(stmt);
 #endif
 
+	vm_log_update();
 	uint8_t op = vm_read_byte();
 retry:
 	if (unlikely(!game->stmt_op[op])) {
@@ -845,11 +1003,11 @@ retry:
 		}
 		vm_rewind_byte();
 		if (mes_char_is_hankaku(op))
-			_vm_stmt_str(false);
+			PROFILE_CALL(PROFILE_STMT, PROFILE_STMT_TEXT, _vm_stmt_str(false));
 		else
-			_vm_stmt_txt(false);
+			PROFILE_CALL(PROFILE_STMT, PROFILE_STMT_TEXT, _vm_stmt_txt(false));
 	} else {
-		game->stmt_op[op]();
+		PROFILE_CALL(PROFILE_STMT, op, game->stmt_op[op]());
 	}
 	return true;
 }
@@ -864,6 +1022,7 @@ void vm_peek(void)
 	if (game->update)
 		game->update();
 	gfx_update();
+	savedata_update();
 }
 
 void vm_exec(void)
@@ -878,6 +1037,9 @@ void vm_exec(void)
 		}
 		if (!vm_exec_statement())
 			break;
+		vm_stats.statements++;
+		if (unlikely(config.bench))
+			bench_statement();
 		vm_peek();
 	}
 	vm.scope_counter--;
@@ -0,0 +1,223 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Check CG cache eviction under the byte budget: entries are evicted in LRU
+ * order, the budget holds after every insertion, a CG still referenced by
+ * the caller outlives its eviction, and a CG being decoded by the prefetch
+ * thread survives cache pressure and is handed over without decoding it
+ * again.
+ *
+ * The cache functions are static, so asset.c is included directly. CG
+ * decoding is replaced so that the test controls the CG sizes and when the
+ * prefetch thread finishes.
+ */
+
+#define cg_load_arcdata test_cg_load_arcdata
+#define cg_free test_cg_free
+#include "../src/asset.c"
+#undef cg_load_arcdata
+#undef cg_free
+
+#include <stdio.h>
+
+#define CG_W 100
+#define CG_H 10
+#define PREFETCH_FILE "CGCACHE.TMP"
+
+struct config config = {0};
+
+static unsigned decodes = 0;
+static unsigned frees = 0;
+
+// decoding of PREFETCH_FILE is held until the test opens the gate
+static SDL_mutex *gate_mutex;
+static SDL_cond *gate_cond;
+static bool gate_open = false;
+
+static struct cg *make_cg(void)
+{
+	struct cg *cg = xcalloc(1, sizeof(struct cg));
+	cg->metrics.w = CG_W;
+	cg->metrics.h = CG_H;
+	cg->metrics.bpp = 8;
+	cg->ref = 1;
+	return cg;
+}
+
+struct cg *test_cg_load_arcdata(struct archive_data *file)
+{
+	if (strstr(file->name, PREFETCH_FILE)) {
+		SDL_LockMutex(gate_mutex);
+		while (!gate_open)
+			SDL_CondWait(gate_cond, gate_mutex);
+		SDL_UnlockMutex(gate_mutex);
+	}
+	decodes++;
+	return make_cg();
+}
+
+void test_cg_free(struct cg *cg)
+{
+	if (--cg->ref)
+		return;
+	frees++;
+	free(cg);
+}
+
+static unsigned failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static bool cached(const char *name)
+{
+	return cg_cache_lookup(name, name_hash(name));
+}
+
+static struct cg *load(const char *name)
+{
+	struct archive_data file = { .name = name };
+	struct cg *cg = asset_cg_decode(&file);
+	CHECK(cg_cache.bytes <= config.cg_cache_size);
+	return cg;
+}
+
+static void test_lru(void)
+{
+	test_cg_free(load("A"));
+	test_cg_free(load("B"));
+	test_cg_free(load("C"));
+	CHECK(cached("A") && cached("B") && cached("C"));
+	CHECK(frees == 0);
+
+	// touching A makes B the least recently used entry
+	test_cg_free(load("a"));
+	test_cg_free(load("D"));
+	CHECK(cached("A") && !cached("B") && cached("C") && cached("D"));
+	CHECK(frees == 1);
+
+	test_cg_free(load("E"));
+	CHECK(cached("A") && !cached("C") && cached("D") && cached("E"));
+	CHECK(frees == 2);
+	CHECK(cg_cache.nr_entries == 3);
+}
+
+static void test_pinned(void)
+{
+	// the caller keeps its reference while F is evicted
+	struct cg *f = load("F");
+	test_cg_free(load("G"));
+	test_cg_free(load("H"));
+	test_cg_free(load("I"));
+	CHECK(!cached("F"));
+	unsigned frees_before = frees;
+	CHECK(f->ref == 1 && f->metrics.w == CG_W);
+	test_cg_free(f);
+	CHECK(frees == frees_before + 1);
+}
+
+static void test_in_flight(void)
+{
+	FILE *f = fopen(PREFETCH_FILE, "wb");
+	if (!f || fputs("cg", f) == EOF || fclose(f)) {
+		fprintf(stderr, "failed to write " PREFETCH_FILE "\n");
+		failures++;
+		return;
+	}
+
+	asset_cg_prefetch(PREFETCH_FILE);
+	SDL_LockMutex(prefetch.mutex);
+	struct cg_prefetch_job *job = cg_prefetch_find(PREFETCH_FILE);
+	CHECK(job != NULL);
+	if (!job) {
+		SDL_UnlockMutex(prefetch.mutex);
+		return;
+	}
+	while (job->state != CG_PREFETCH_DECODING)
+		SDL_CondWaitTimeout(prefetch.done, prefetch.mutex, 1);
+	SDL_UnlockMutex(prefetch.mutex);
+
+	// fill the cache several times over while the job is decoding
+	unsigned evictions = cg_stats.evictions;
+	char name[16];
+	for (int i = 0; i < 10; i++) {
+		sprintf(name, "X%d", i);
+		test_cg_free(load(name));
+	}
+	CHECK(cg_stats.evictions >= evictions + 7);
+
+	// the prefetch thread is blocked before counting its decode
+	unsigned decodes_before = decodes + 1;
+	unsigned long misses = cg_stats.misses;
+	SDL_LockMutex(gate_mutex);
+	gate_open = true;
+	SDL_CondBroadcast(gate_cond);
+	SDL_UnlockMutex(gate_mutex);
+
+	struct archive_data *file = asset_fs_load(PREFETCH_FILE);
+	CHECK(file != NULL);
+	if (file) {
+		struct cg *cg = asset_cg_decode(file);
+		CHECK(cg != NULL);
+		CHECK(cg_stats.misses == misses);
+		CHECK(cg_stats.waits + cg_stats.prefetch_hits == 1);
+		CHECK(decodes == decodes_before);
+		CHECK(cached(file->name));
+		CHECK(cg_cache.bytes <= config.cg_cache_size);
+		test_cg_free(cg);
+		archive_data_release(file);
+	}
+	remove(PREFETCH_FILE);
+}
+
+int main(void)
+{
+	struct cg *cg = make_cg();
+	config.cg_cache_size = cg_size(cg) * 3;
+	free(cg);
+
+	gate_mutex = SDL_CreateMutex();
+	gate_cond = SDL_CreateCond();
+	cg_cache_init();
+	cg_prefetch_init();
+	if (!prefetch.thread) {
+		fprintf(stderr, "prefetch thread not started\n");
+		return 1;
+	}
+
+	test_lru();
+	test_pinned();
+	test_in_flight();
+
+	// a CG bigger than the whole budget is never cached
+	config.cg_cache_size = 0;
+	unsigned entries = cg_cache.nr_entries;
+	struct archive_data big = { .name = "BIG" };
+	test_cg_free(asset_cg_decode(&big));
+	CHECK(!cached("BIG") && cg_cache.nr_entries == entries);
+
+	if (failures) {
+		fprintf(stderr, "%u failures\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,194 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Resolve mixed-case names of files in a small directory tree with
+ * asset_path_icase and with path_get_icase, which lists each directory on
+ * every lookup, and check that they agree: on existing files in every case,
+ * on missing files and directories, and on a file created after its
+ * directory was indexed. Then time repeated lookups with both, which must
+ * not list any directory again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "nulib.h"
+#include "nulib/file.h"
+
+#include "ai5.h"
+#include "asset.h"
+
+#define ROOT "ICASE.TMP"
+#define NR_BENCH_LOOKUPS 20000
+
+struct config config = {0};
+
+static const char *dirs[] = {
+	ROOT,
+	ROOT "/Data",
+	ROOT "/Data/Sound",
+	ROOT "/mes",
+};
+
+static const char *files[] = {
+	ROOT "/START.MES",
+	ROOT "/Ai5Win.ini",
+	ROOT "/Data/Bg01.Gp8",
+	ROOT "/Data/CHAR_A.gp8",
+	ROOT "/Data/Sound/bgm01.wav",
+	ROOT "/Data/Sound/SE_Door.WAV",
+	ROOT "/mes/Main.mes",
+	ROOT "/mes/sub1.MES",
+};
+
+static const char *missing[] = {
+	ROOT "/START.MEZ",
+	ROOT "/Data/Sound/bgm02.wav",
+	ROOT "/Nope/START.MES",
+	ROOT "/START.MES/x",
+	"ICASE.TMX/START.MES",
+};
+
+static unsigned failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static bool touch(const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	return f && !fclose(f);
+}
+
+// 0: as is, 1: upper case, 2: lower case, 3: alternating
+static char *change_case(const char *path, int how)
+{
+	char *s = xstrdup(path);
+	for (int i = 0; s[i]; i++) {
+		if (how == 1)
+			s[i] = toupper((unsigned char)s[i]);
+		else if (how == 2)
+			s[i] = tolower((unsigned char)s[i]);
+		else if (how == 3)
+			s[i] = i % 2 ? tolower((unsigned char)s[i]) : toupper((unsigned char)s[i]);
+	}
+	return s;
+}
+
+static void check_agree(const char *name)
+{
+	char *expected = path_get_icase(name);
+	char *actual = asset_path_icase(name);
+	if (expected ? !actual || strcmp(expected, actual) : !!actual) {
+		fprintf(stderr, "\"%s\": path_get_icase: %s, asset_path_icase: %s\n", name,
+				expected ? expected : "(null)", actual ? actual : "(null)");
+		failures++;
+	}
+	free(expected);
+	free(actual);
+}
+
+static double lookup_us(char *(*lookup)(const char*), char **names, unsigned nr_names)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned i = 0; i < NR_BENCH_LOOKUPS; i++) {
+		free(lookup(names[i % nr_names]));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double us = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+	return us / NR_BENCH_LOOKUPS;
+}
+
+static void cleanup(void)
+{
+	remove(ROOT "/New_File.DAT");
+	for (int i = ARRAY_SIZE(files) - 1; i >= 0; i--)
+		remove(files[i]);
+	for (int i = ARRAY_SIZE(dirs) - 1; i >= 0; i--)
+		remove(dirs[i]);
+}
+
+int main(void)
+{
+	cleanup();
+	for (unsigned i = 0; i < ARRAY_SIZE(dirs); i++) {
+		if (mkdir_p(dirs[i])) {
+			fprintf(stderr, "failed to create %s\n", dirs[i]);
+			return 1;
+		}
+	}
+	for (unsigned i = 0; i < ARRAY_SIZE(files); i++) {
+		if (!touch(files[i])) {
+			fprintf(stderr, "failed to create %s\n", files[i]);
+			cleanup();
+			return 1;
+		}
+	}
+
+	char *names[ARRAY_SIZE(files) * 4];
+	unsigned nr_names = 0;
+	for (unsigned i = 0; i < ARRAY_SIZE(files); i++) {
+		for (int how = 0; how < 4; how++) {
+			names[nr_names] = change_case(files[i], how);
+			check_agree(names[nr_names]);
+			nr_names++;
+		}
+	}
+	for (unsigned i = 0; i < ARRAY_SIZE(missing); i++) {
+		for (int how = 0; how < 4; how++) {
+			char *name = change_case(missing[i], how);
+			check_agree(name);
+			free(name);
+		}
+	}
+
+	// a file created after its directory was indexed
+	CHECK(touch(ROOT "/New_File.DAT"));
+	asset_path_invalidate(ROOT "/New_File.DAT");
+	check_agree(ROOT "/NEW_FILE.DAT");
+	check_agree(ROOT "/new_file.dat");
+
+	// repeated lookups of existing files are served from the index
+	struct asset_path_stats before, after;
+	asset_path_stats(&before);
+	double index_us = lookup_us(asset_path_icase, names, nr_names);
+	asset_path_stats(&after);
+	CHECK(after.dir_scans == before.dir_scans);
+	CHECK(after.misses == before.misses);
+	double readdir_us = lookup_us(path_get_icase, names, nr_names);
+	printf("%u lookups: path_get_icase %.2f us/lookup, asset_path_icase %.2f us/lookup\n",
+			NR_BENCH_LOOKUPS, readdir_us, index_us);
+
+	for (unsigned i = 0; i < nr_names; i++)
+		free(names[i]);
+	cleanup();
+
+	if (failures) {
+		fprintf(stderr, "%u failures\n", failures);
+		return 1;
+	}
+	return 0;
+}
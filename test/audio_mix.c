@@ -0,0 +1,151 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Mix 16 float streams with the kernels in audio_mix.c (SSE2/NEON where
+ * available) and with the scalar kernels in sts_mixer.h, and check that the
+ * output is bit-identical. The streams have random gains and samples outside
+ * [-1, 1] to exercise clamping, chunk lengths which are not multiples of the
+ * SIMD width, and two of them are resampled. The time taken by each is
+ * printed.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mixer.h"
+
+static void accumulate(float *acc, const float *src, float gain, size_t n);
+static void gain_clamp(float *dst, const float *src, float gain, size_t n);
+
+#define STS_MIXER_IMPLEMENTATION
+#define STS_MIXER_ACCUMULATE accumulate
+#define STS_MIXER_GAIN_CLAMP gain_clamp
+#include "sts_mixer.h"
+
+#define RATE 44100
+#define NR_STREAMS 16
+#define MAX_CHUNK 1100
+// frames mixed per call, as in the audio callback
+#define OUT_FRAMES 1024
+#define NR_CHECK_CALLS 200
+#define NR_BENCH_CALLS 5000
+
+static bool use_kernels;
+
+static void accumulate(float *acc, const float *src, float gain, size_t n)
+{
+	if (use_kernels)
+		mixer_accumulate(acc, src, gain, n);
+	else
+		sts_mixer__accumulate(acc, src, gain, n);
+}
+
+static void gain_clamp(float *dst, const float *src, float gain, size_t n)
+{
+	if (use_kernels)
+		mixer_gain_clamp(dst, src, gain, n);
+	else
+		sts_mixer__gain_clamp(dst, src, gain, n);
+}
+
+struct test_stream {
+	sts_mixer_stream_t stream;
+	uint32_t seed;
+	float data[MAX_CHUNK * 2];
+};
+
+static struct test_stream streams[NR_STREAMS];
+static sts_mixer_t mixer;
+
+// deterministic, so that both runs see the same samples
+static float next_sample(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return ((float)(*seed >> 8) / (float)(1 << 24)) * 3.0f - 1.5f;
+}
+
+static int refill(sts_mixer_sample_t *sample, void *data)
+{
+	struct test_stream *s = data;
+	for (unsigned i = 0; i < sample->length; i++) {
+		s->data[i] = next_sample(&s->seed);
+	}
+	return STS_STREAM_CONTINUE;
+}
+
+static void start_streams(void)
+{
+	sts_mixer_init(&mixer, RATE, STS_MIXER_SAMPLE_FORMAT_FLOAT);
+	mixer.gain = 0.8f;
+	for (int i = 0; i < NR_STREAMS; i++) {
+		struct test_stream *s = &streams[i];
+		s->seed = i + 1;
+		s->stream.userdata = s;
+		s->stream.callback = refill;
+		s->stream.sample.frequency = i < 2 ? RATE / 2 : RATE;
+		s->stream.sample.audio_format = STS_MIXER_SAMPLE_FORMAT_FLOAT;
+		s->stream.sample.length = (MAX_CHUNK - i * 37) * 2;
+		s->stream.sample.data = s->data;
+		// the mixer plays the current chunk before calling back for the next
+		refill(&s->stream.sample, s);
+		sts_mixer_play_stream(&mixer, &s->stream, 0.1f + 0.09f * i);
+	}
+}
+
+static double mix(bool kernels, float *out, unsigned calls, bool keep)
+{
+	use_kernels = kernels;
+	start_streams();
+	clock_t start = clock();
+	for (unsigned i = 0; i < calls; i++) {
+		sts_mixer_mix_audio(&mixer, keep ? out + i * OUT_FRAMES * 2 : out, OUT_FRAMES);
+	}
+	return (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+}
+
+int main(void)
+{
+	static float expected[NR_CHECK_CALLS * OUT_FRAMES * 2];
+	static float actual[NR_CHECK_CALLS * OUT_FRAMES * 2];
+	unsigned failures = 0;
+
+	mix(false, expected, NR_CHECK_CALLS, true);
+	mix(true, actual, NR_CHECK_CALLS, true);
+	for (size_t i = 0; i < NR_CHECK_CALLS * OUT_FRAMES * 2; i++) {
+		if (memcmp(&expected[i], &actual[i], sizeof(float))) {
+			fprintf(stderr, "frame %zu channel %zu: expected %a, got %a\n",
+					i / 2, i % 2, expected[i], actual[i]);
+			failures++;
+			break;
+		}
+	}
+
+	double scalar_ms = mix(false, actual, NR_BENCH_CALLS, false);
+	double kernel_ms = mix(true, actual, NR_BENCH_CALLS, false);
+	printf("%d streams, %d frames: scalar %.2f us/mix, kernels %.2f us/mix\n",
+			NR_STREAMS, OUT_FRAMES, scalar_ms * 1000 / NR_BENCH_CALLS,
+			kernel_ms * 1000 / NR_BENCH_CALLS);
+
+	if (failures) {
+		fprintf(stderr, "%u failures\n", failures);
+		return 1;
+	}
+	return 0;
+}
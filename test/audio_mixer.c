@@ -0,0 +1,161 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Play a streamed WAV file through SDL's dummy audio driver, which consumes
+ * audio in real time. Starting, seeking and looping the stream must decode
+ * no more than the first chunks on the calling thread, and playback must not
+ * underrun while the decoder thread tops up the ring buffer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL.h>
+
+#include "nulib.h"
+#include "nulib/little_endian.h"
+#include "ai5/arc.h"
+
+#include "ai5.h"
+#include "mixer.h"
+
+// CHUNK_SIZE * PRIME_CHUNKS in audio_mixer.c
+#define MAX_PRIME_FRAMES 2048
+#define RATE 44100
+#define SECONDS 5
+
+struct config config = {0};
+
+static unsigned failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+// a 16-bit stereo WAV file, in the same shape as asset_fs_load's fake archive_data
+static struct archive_data *wav_file(void)
+{
+	const unsigned frames = RATE * SECONDS;
+	const unsigned data_size = frames * 4;
+	struct archive_data *file = xcalloc(1, sizeof(struct archive_data));
+	file->size = 44 + data_size;
+	file->name = "TEST.WAV";
+	file->data = xcalloc(1, file->size);
+	file->ref = 1;
+	file->allocated = true;
+
+	uint8_t *p = file->data;
+	memcpy(p, "RIFF", 4);
+	le_put32(p, 4, 36 + data_size);
+	memcpy(p + 8, "WAVEfmt ", 8);
+	le_put32(p, 16, 16);
+	le_put16(p, 20, 1); // PCM
+	le_put16(p, 22, 2);
+	le_put32(p, 24, RATE);
+	le_put32(p, 28, RATE * 4);
+	le_put16(p, 32, 4);
+	le_put16(p, 34, 16);
+	memcpy(p + 36, "data", 4);
+	le_put32(p, 40, data_size);
+	// a quiet sawtooth
+	for (unsigned i = 0; i < frames; i++) {
+		uint16_t sample = (i % 100) * 64;
+		le_put16(p, 44 + i * 4, sample);
+		le_put16(p, 46 + i * 4, sample);
+	}
+	return file;
+}
+
+static struct mixer_stream_stats stats;
+
+static uint64_t primed(void)
+{
+	uint64_t before = stats.frames_primed;
+	mixer_stream_stats(&stats);
+	return stats.frames_primed - before;
+}
+
+int main(void)
+{
+	setenv("SDL_AUDIODRIVER", "dummy", 1);
+	if (SDL_Init(SDL_INIT_AUDIO) < 0) {
+		fprintf(stderr, "SDL_Init failed: %s\n", SDL_GetError());
+		return 77;
+	}
+	// stream the file rather than decoding it into the sound cache
+	config.sound_cache_size = 0;
+	mixer_init();
+	mixer_stream_stats(&stats);
+
+	struct mixer_stream *ch = mixer_stream_open(wav_file(), MIXER_MUSIC);
+	if (!ch) {
+		fprintf(stderr, "failed to open stream\n");
+		return 1;
+	}
+	CHECK(mixer_stream_get_sample_length(ch) == RATE * SECONDS);
+
+	mixer_stream_play(ch);
+	CHECK(primed() <= MAX_PRIME_FRAMES);
+	SDL_Delay(500);
+	mixer_stream_stats(&stats);
+	CHECK(mixer_stream_is_playing(ch));
+	CHECK(mixer_stream_get_sample_pos(ch) > 0);
+	CHECK(stats.underruns == 0);
+
+	// seeking primes the new position only
+	mixer_stream_seek(ch, 2000);
+	CHECK(primed() <= MAX_PRIME_FRAMES);
+	CHECK(mixer_stream_get_sample_pos(ch) >= 2 * RATE);
+	SDL_Delay(300);
+	mixer_stream_stats(&stats);
+	CHECK(mixer_stream_get_sample_pos(ch) > 2 * RATE);
+	CHECK(stats.underruns == 0);
+
+	// loop a quarter of a second forever; each change reseeks the stream
+	mixer_stream_seek(ch, 1000);
+	mixer_stream_set_loop_start_pos(ch, RATE);
+	mixer_stream_set_loop_end_pos(ch, RATE + RATE / 4);
+	mixer_stream_set_loop_count(ch, 0);
+	CHECK(primed() <= 4 * MAX_PRIME_FRAMES);
+	SDL_Delay(1000);
+	mixer_stream_stats(&stats);
+	int pos = mixer_stream_get_sample_pos(ch);
+	CHECK(mixer_stream_is_playing(ch));
+	CHECK(pos >= RATE && pos < RATE + RATE / 4);
+	CHECK(stats.underruns == 0);
+
+	mixer_stream_stop(ch);
+	CHECK(!mixer_stream_is_playing(ch));
+	mixer_stream_close(ch);
+	mixer_stream_stats(&stats);
+	CHECK(stats.streams == 0);
+
+	printf("%llu frames decoded (%llu primed), min ring fill %u/%u frames\n",
+			(unsigned long long)stats.frames_decoded,
+			(unsigned long long)stats.frames_primed,
+			stats.min_fill, stats.ring_frames);
+
+	if (failures) {
+		fprintf(stderr, "%u failures\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,152 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Play the same short sound repeatedly through SDL's dummy audio driver, and
+ * check that it is decoded only the first time: every later play must be a
+ * sound cache hit. Sounds longer than the cache length limit are streamed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL.h>
+
+#include "nulib.h"
+#include "nulib/little_endian.h"
+#include "ai5/arc.h"
+
+#include "ai5.h"
+#include "mixer.h"
+
+#define RATE 44100
+#define NR_PLAYS 5
+
+struct config config = {0};
+
+static unsigned failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+// a 16-bit mono WAV file, in the same shape as asset_fs_load's fake archive_data
+static struct archive_data *wav_file(const char *name, unsigned frames)
+{
+	const unsigned data_size = frames * 2;
+	struct archive_data *file = xcalloc(1, sizeof(struct archive_data));
+	file->size = 44 + data_size;
+	file->name = name;
+	file->data = xcalloc(1, file->size);
+	file->ref = 1;
+	file->allocated = true;
+
+	uint8_t *p = file->data;
+	memcpy(p, "RIFF", 4);
+	le_put32(p, 4, 36 + data_size);
+	memcpy(p + 8, "WAVEfmt ", 8);
+	le_put32(p, 16, 16);
+	le_put16(p, 20, 1); // PCM
+	le_put16(p, 22, 1);
+	le_put32(p, 24, RATE);
+	le_put32(p, 28, RATE * 2);
+	le_put16(p, 32, 2);
+	le_put16(p, 34, 16);
+	memcpy(p + 36, "data", 4);
+	le_put32(p, 40, data_size);
+	for (unsigned i = 0; i < frames; i++) {
+		le_put16(p, 44 + i * 2, (i % 100) * 64);
+	}
+	return file;
+}
+
+// open a sound the way audio_interface.c does, releasing the caller's reference
+static struct mixer_stream *open_sound(const char *name, unsigned frames)
+{
+	struct archive_data *file = wav_file(name, frames);
+	struct mixer_stream *ch = mixer_stream_open(file, MIXER_EFFECT);
+	archive_data_release(file);
+	CHECK(ch != NULL);
+	return ch;
+}
+
+// play a sound to the end
+static void play_sound(const char *name, unsigned frames)
+{
+	struct mixer_stream *ch = open_sound(name, frames);
+	if (!ch)
+		return;
+	CHECK(mixer_stream_get_sample_length(ch) == frames);
+	mixer_stream_play(ch);
+	for (int i = 0; i < 200 && mixer_stream_is_playing(ch); i++) {
+		SDL_Delay(10);
+	}
+	CHECK(!mixer_stream_is_playing(ch));
+	mixer_stream_close(ch);
+}
+
+int main(void)
+{
+	setenv("SDL_AUDIODRIVER", "dummy", 1);
+	if (SDL_Init(SDL_INIT_AUDIO) < 0) {
+		fprintf(stderr, "SDL_Init failed: %s\n", SDL_GetError());
+		return 77;
+	}
+	config.sound_cache_size = 1024 * 1024;
+	config.sound_cache_length = 1000;
+	mixer_init();
+
+	for (int i = 0; i < NR_PLAYS; i++) {
+		play_sound("SE.WAV", RATE / 10);
+	}
+	struct mixer_sound_cache_stats cache;
+	mixer_sound_cache_stats(&cache);
+	CHECK(cache.misses == 1);
+	CHECK(cache.hits == NR_PLAYS - 1);
+	CHECK(cache.entries == 1);
+
+	// a different sound is decoded separately
+	play_sound("SE2.WAV", RATE / 10);
+	mixer_sound_cache_stats(&cache);
+	CHECK(cache.misses == 2);
+	CHECK(cache.hits == NR_PLAYS - 1);
+	CHECK(cache.entries == 2);
+
+	// a sound longer than the length limit is streamed
+	struct mixer_stream *ch = open_sound("BGM.WAV", RATE * 2);
+	if (ch)
+		mixer_stream_close(ch);
+	mixer_sound_cache_stats(&cache);
+	CHECK(cache.misses == 2);
+	CHECK(cache.entries == 2);
+
+	struct mixer_stream_stats stats;
+	mixer_stream_stats(&stats);
+	CHECK(stats.underruns == 0);
+
+	printf("%lu hits, %lu misses, %.2f ms decoding, %.2f ms saved\n",
+			cache.hits, cache.misses, cache.decode_ms, cache.saved_ms);
+
+	if (failures) {
+		fprintf(stderr, "%u failures\n", failures);
+		return 1;
+	}
+	return 0;
+}
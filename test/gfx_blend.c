@@ -0,0 +1,159 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+
+/*
+ * Check the blending kernels in gfx_blend.c (SSE2/NEON where available)
+ * against the scalar per-pixel formulas they replaced, on random rows of
+ * every length up to a few SIMD blocks and at unaligned offsets.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gfx_blend.h"
+
+#define MAX_PX 100
+#define MAX_BYTES (MAX_PX * 3)
+
+static unsigned failures = 0;
+
+static void check(const char *what, size_t n, unsigned off, const uint8_t *expected,
+		const uint8_t *actual)
+{
+	for (size_t i = 0; i < n; i++) {
+		if (expected[i] != actual[i]) {
+			fprintf(stderr, "%s: n=%zu offset=%u byte %zu: expected %u, got %u\n",
+					what, n, off, i, expected[i], actual[i]);
+			failures++;
+			return;
+		}
+	}
+}
+
+static void fill_random(uint8_t *p, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		p[i] = rand() & 0xff;
+}
+
+// gfx_blend_masked: mask 0 keeps dst, 16+ copies src, otherwise blends
+static void ref_masked(uint8_t *dst, const uint8_t *src, const uint8_t *mask, size_t px)
+{
+	for (size_t i = 0; i < px; i++) {
+		if (mask[i] == 0)
+			continue;
+		if (mask[i] > 15) {
+			memcpy(dst + i*3, src + i*3, 3);
+			continue;
+		}
+		uint32_t alpha = mask[i] * 16 - 8;
+		for (int c = 0; c < 3; c++) {
+			dst[i*3+c] = (uint8_t)(((alpha + 1) * src[i*3+c]
+						+ (256 - alpha) * dst[i*3+c]) >> 8);
+		}
+	}
+}
+
+static void test_masked(size_t px, unsigned off)
+{
+	uint8_t src[MAX_BYTES + 16], dst[MAX_BYTES + 16], expected[MAX_BYTES + 16];
+	uint8_t mask[MAX_PX];
+	uint16_t w[MAX_BYTES];
+	fill_random(src, sizeof(src));
+	fill_random(dst, sizeof(dst));
+	for (size_t i = 0; i < px; i++) {
+		// bias towards the interesting range
+		mask[i] = rand() % 4 ? rand() % 17 : rand() & 0xff;
+		uint16_t v = mask[i] == 0 ? 0 : mask[i] > 15 ? 256 : mask[i] * 16 - 7;
+		w[i*3+0] = w[i*3+1] = w[i*3+2] = v;
+	}
+	memcpy(expected, dst, sizeof(dst));
+	ref_masked(expected + off, src + off, mask, px);
+	gfx_blend_row(dst + off, dst + off, src + off, w, px * 3);
+	check("blend_masked", px * 3, off, expected, dst);
+}
+
+// gfx_blend_with_mask_color_to: mask 0 copies a, 8+ copies b, otherwise blends
+static void test_mask_color_to(size_t px, unsigned off)
+{
+	uint8_t a[MAX_BYTES + 16], b[MAX_BYTES + 16], dst[MAX_BYTES + 16];
+	uint8_t expected[MAX_BYTES + 16];
+	uint16_t w[MAX_BYTES];
+	fill_random(a, sizeof(a));
+	fill_random(b, sizeof(b));
+	fill_random(dst, sizeof(dst));
+	memcpy(expected, dst, sizeof(dst));
+	for (size_t i = 0; i < px; i++) {
+		uint8_t m = rand() % 4 ? rand() % 9 : rand() & 0xff;
+		uint16_t v = m == 0 ? 0 : m > 7 ? 256 : m * 32 - 15;
+		w[i*3+0] = w[i*3+1] = w[i*3+2] = v;
+		uint8_t *e = expected + off + i*3;
+		const uint8_t *pa = a + off + i*3, *pb = b + off + i*3;
+		if (m == 0) {
+			memcpy(e, pa, 3);
+		} else if (m > 7) {
+			memcpy(e, pb, 3);
+		} else {
+			uint32_t alpha = m * 32 - 16;
+			for (int c = 0; c < 3; c++)
+				e[c] = (uint8_t)(((alpha + 1) * pb[c] + (256 - alpha) * pa[c]) >> 8);
+		}
+	}
+	gfx_blend_row(dst + off, a + off, b + off, w, px * 3);
+	check("blend_with_mask_color_to", px * 3, off, expected, dst);
+}
+
+// gfx_blend_fill: blend a constant color into every pixel
+static void test_fill(size_t px, unsigned off)
+{
+	uint8_t p[MAX_BYTES + 16], expected[MAX_BYTES + 16];
+	uint8_t color[3] = { rand() & 0xff, rand() & 0xff, rand() & 0xff };
+	uint32_t rate = rand() & 0xff;
+	uint32_t a = rate + 1;
+	uint32_t inv_a = 256 - rate;
+	fill_random(p, sizeof(p));
+	memcpy(expected, p, sizeof(p));
+	for (size_t i = 0; i < px * 3; i++) {
+		uint8_t *e = expected + off + i;
+		*e = (uint8_t)((color[i % 3] * a + inv_a * *e) >> 8);
+	}
+	uint16_t pattern[GFX_BLEND_FILL_PATTERN];
+	for (int i = 0; i < GFX_BLEND_FILL_PATTERN; i++)
+		pattern[i] = color[i % 3] * a;
+	gfx_blend_fill_row(p + off, pattern, inv_a, px * 3);
+	check("blend_fill", px * 3, off, expected, p);
+}
+
+int main(void)
+{
+	srand(1);
+	for (int iter = 0; iter < 20; iter++) {
+		for (size_t px = 0; px <= MAX_PX; px++) {
+			for (unsigned off = 0; off < 4; off++) {
+				test_masked(px, off);
+				test_mask_color_to(px, off);
+				test_fill(px, off);
+			}
+		}
+	}
+	if (failures) {
+		fprintf(stderr, "%u failures\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,286 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Run map_path_sprite on random obstacle grids and compare the paths with
+ * the search it replaced, which cleared a 480x640 array of search state
+ * before every search. Both searches must find the same path. The time per
+ * search of each is printed.
+ *
+ * The search state is static, so map.c is included directly.
+ */
+
+#include "../src/map.c"
+
+#include <stdio.h>
+
+#define MAP_COLS 100
+#define MAP_ROWS 100
+#define NR_MAPS 5
+#define NR_SEARCHES 50
+
+struct config config = {0};
+struct memory memory = {0};
+struct memory_ptr memory_ptr = {0};
+
+// stubs for the rest of the program
+_Noreturn void _vm_error(const char *file, const char *func, int line, const char *fmt, ...)
+{
+	fprintf(stderr, "VM_ERROR in %s\n", func);
+	exit(1);
+}
+struct archive_data *asset_data_load(const char *name) { return NULL; }
+void cursor_get_pos(unsigned *x, unsigned *y) { *x = *y = 0; }
+bool input_down(enum input_event_type type) { return false; }
+void vm_delay(int ms) {}
+uint32_t vm_get_ticks(void) { return 0; }
+void gfx_copy(int src_x, int src_y, int src_w, int src_h, unsigned src_i, int dst_x,
+		int dst_y, unsigned dst_i) {}
+void gfx_dirty(unsigned surface, int x, int y, int w, int h) {}
+SDL_Surface *gfx_get_surface(unsigned i) { return NULL; }
+uint32_t gfx_surface_generation(unsigned surface) { return 0; }
+
+/*
+ * The previous search state: one entry per screen pixel, cleared before each
+ * search, with a recursive binary heap.
+ */
+static struct path_data old_tiles[480][640];
+static vector_t(struct map_pos) old_frontier = vector_initializer;
+
+static bool old_less_than(uint16_t a, uint16_t b)
+{
+	struct map_pos pa = vector_A(old_frontier, a);
+	struct map_pos pb = vector_A(old_frontier, b);
+	return old_tiles[pa.y][pa.x].f_score < old_tiles[pb.y][pb.x].f_score;
+}
+
+static uint16_t old_min(uint16_t a, uint16_t b)
+{
+	if (a >= vector_length(old_frontier))
+		a = 0xffff;
+	if (b >= vector_length(old_frontier))
+		b = 0xffff;
+	if (a == 0xffff)
+		return b;
+	if (b == 0xffff)
+		return a;
+	if (old_less_than(a, b))
+		return a;
+	return b;
+}
+
+static void old_swap(uint16_t a, uint16_t b)
+{
+	struct map_pos tmp = vector_A(old_frontier, a);
+	vector_A(old_frontier, a) = vector_A(old_frontier, b);
+	vector_A(old_frontier, b) = tmp;
+}
+
+static void old_sink(uint16_t node)
+{
+	uint16_t min_i = old_min(node, old_min(node * 2 + 1, node * 2 + 2));
+	if (min_i != node) {
+		old_swap(min_i, node);
+		old_sink(min_i);
+	}
+}
+
+static void old_swim(uint16_t node)
+{
+	if (node == 0)
+		return;
+	uint16_t parent = (node - 1) / 2;
+	if (old_less_than(node, parent)) {
+		old_swap(parent, node);
+		old_swim(parent);
+	}
+}
+
+static struct map_pos old_pop(void)
+{
+	struct map_pos r = vector_A(old_frontier, 0);
+	if (vector_length(old_frontier) > 1) {
+		vector_A(old_frontier, 0) = vector_pop(old_frontier);
+		old_sink(0);
+	}
+	return r;
+}
+
+// returns the length of the path from goal to start (excluding start)
+static unsigned old_search(struct map_pos start, struct map_pos goal, struct map_pos *path)
+{
+	memset(old_tiles, 0xff, sizeof(old_tiles));
+	old_tiles[start.y][start.x].g_score = 0;
+	old_tiles[start.y][start.x].f_score = h_distance(start, goal);
+	vector_length(old_frontier) = 0;
+	vector_push(struct map_pos, old_frontier, start);
+	old_tiles[start.y][start.x].not_in_frontier = 0;
+
+	while (true) {
+		struct map_pos cur = old_pop();
+		struct path_data *cur_data = &old_tiles[cur.y][cur.x];
+		cur_data->not_in_frontier = 1;
+		if (map_pos_equal(cur, goal))
+			break;
+		for (int i = 0; i < 8; i++) {
+			struct map_pos n_pos = get_neighbor(cur, i);
+			if (n_pos.x == 0xffff)
+				continue;
+			struct path_data *n = &old_tiles[n_pos.y][n_pos.x];
+			uint16_t g = cur_data->g_score + (i <= 3 ? 1 : 2);
+			if (g < n->g_score) {
+				n->pred = cur;
+				n->g_score = g;
+				n->f_score = g + h_distance(n_pos, goal);
+				if (n->not_in_frontier) {
+					vector_push(struct map_pos, old_frontier, n_pos);
+					old_swim(vector_length(old_frontier) - 1);
+					n->not_in_frontier = 0;
+				}
+			}
+		}
+	}
+
+	unsigned len = 0;
+	struct map_pos cur = goal;
+	do {
+		path[len++] = cur;
+		cur = old_tiles[cur.y][cur.x].pred;
+	} while (!map_pos_equal(cur, start));
+	return len;
+}
+
+static void random_map(unsigned density)
+{
+	map.cols = MAP_COLS;
+	map.rows = MAP_ROWS;
+	for (unsigned i = 0; i < MAP_COLS * MAP_ROWS; i++) {
+		map.tile_data[i] = (struct map_tile) { .collides = (unsigned)(rand() % 100) < density };
+	}
+	build_valid_pos();
+}
+
+/*
+ * Label the connected areas of valid positions. Neither search terminates
+ * when the goal is unreachable (the last frontier node is never removed), so
+ * only goals in the same area as the start are searched for.
+ */
+static unsigned area[MAP_ROWS][MAP_COLS];
+
+static void label_areas(void)
+{
+	static struct map_pos queue[MAP_COLS * MAP_ROWS];
+	memset(area, 0, sizeof(area));
+	unsigned label = 0;
+	for (unsigned y = 0; y < MAP_ROWS; y++) {
+		for (unsigned x = 0; x < MAP_COLS; x++) {
+			if (area[y][x] || !sprite_pos_valid(x, y))
+				continue;
+			unsigned head = 0, tail = 0;
+			queue[tail++] = (struct map_pos) { x, y };
+			area[y][x] = ++label;
+			while (head < tail) {
+				struct map_pos cur = queue[head++];
+				for (int i = 0; i < 8; i++) {
+					struct map_pos n = get_neighbor(cur, i);
+					if (n.x == 0xffff || area[n.y][n.x])
+						continue;
+					area[n.y][n.x] = label;
+					queue[tail++] = n;
+				}
+			}
+		}
+	}
+}
+
+static struct map_pos random_valid_pos(unsigned in_area)
+{
+	while (true) {
+		struct map_pos p = { rand() % MAP_COLS, rand() % MAP_ROWS };
+		if (sprite_pos_valid(p.x, p.y) && (!in_area || area[p.y][p.x] == in_area))
+			return p;
+	}
+}
+
+static uint64_t elapsed_us(uint64_t start)
+{
+	return (SDL_GetPerformanceCounter() - start) * 1000000 / SDL_GetPerformanceFrequency();
+}
+
+int main(void)
+{
+	static struct map_pos old_path[MAP_COLS * MAP_ROWS];
+	struct map_pos starts[NR_SEARCHES], goals[NR_SEARCHES];
+	unsigned failures = 0, found = 0;
+	uint64_t old_us = 0, new_us = 0;
+
+	srand(1);
+	vector_push(struct ccd_sprite, map.sprites, (struct ccd_sprite){0});
+	for (int m = 0; m < NR_MAPS; m++) {
+		random_map(5 + m * 5);
+		label_areas();
+		for (int i = 0; i < NR_SEARCHES; i++) {
+			starts[i] = random_valid_pos(0);
+			goals[i] = random_valid_pos(area[starts[i].y][starts[i].x]);
+		}
+
+		for (int i = 0; i < NR_SEARCHES; i++) {
+			struct ccd_sprite *sp = &vector_A(map.sprites, 0);
+			sp->x = starts[i].x;
+			sp->y = starts[i].y;
+			uint64_t t = SDL_GetPerformanceCounter();
+			// the target is given as the center of the sprite
+			map_path_sprite(0, goals[i].x, goals[i].y + 1);
+			new_us += elapsed_us(t);
+			bool new_found = map.path.active;
+			unsigned new_len = new_found ? vector_length(map.path.path) : 0;
+
+			t = SDL_GetPerformanceCounter();
+			unsigned old_len = map_pos_equal(starts[i], goals[i]) ? 0
+				: old_search(starts[i], goals[i], old_path);
+			old_us += elapsed_us(t);
+
+			if (new_len != old_len) {
+				fprintf(stderr, "map %d search %d: path length %u, expected %u\n",
+						m, i, new_len, old_len);
+				failures++;
+			} else if (new_len && memcmp(&vector_A(map.path.path, 0), old_path,
+						new_len * sizeof(struct map_pos))) {
+				fprintf(stderr, "map %d search %d: paths differ\n", m, i);
+				failures++;
+			}
+			if (new_len)
+				found++;
+			map_stop_pathing();
+		}
+	}
+
+	unsigned nr = NR_MAPS * NR_SEARCHES;
+	printf("%u searches (%u paths found), %lu nodes expanded\n", nr, found,
+			(unsigned long)path_stats.nodes_expanded);
+	printf("old search: %.1f us/search\n", (double)old_us / nr);
+	printf("new search: %.1f us/search\n", (double)new_us / nr);
+
+	if (!found) {
+		fprintf(stderr, "no paths found\n");
+		failures++;
+	}
+	if (failures) {
+		fprintf(stderr, "%u failures\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,110 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Check every position of several tilemaps in the bitmap built by
+ * build_valid_pos against the per-call collision check that sprite_pos_valid
+ * used to do. Positions whose footprint extends past the edge of the map
+ * must be invalid.
+ *
+ * The bitmap is static, so map.c is included directly.
+ */
+
+#include "../src/map.c"
+
+#include <stdio.h>
+
+struct config config = {0};
+struct memory memory = {0};
+struct memory_ptr memory_ptr = {0};
+
+// stubs for the rest of the program
+_Noreturn void _vm_error(const char *file, const char *func, int line, const char *fmt, ...)
+{
+	fprintf(stderr, "VM_ERROR in %s\n", func);
+	exit(1);
+}
+struct archive_data *asset_data_load(const char *name) { return NULL; }
+void cursor_get_pos(unsigned *x, unsigned *y) { *x = *y = 0; }
+bool input_down(enum input_event_type type) { return false; }
+void vm_delay(int ms) {}
+uint32_t vm_get_ticks(void) { return 0; }
+void gfx_copy(int src_x, int src_y, int src_w, int src_h, unsigned src_i, int dst_x,
+		int dst_y, unsigned dst_i) {}
+void gfx_dirty(unsigned surface, int x, int y, int w, int h) {}
+SDL_Surface *gfx_get_surface(unsigned i) { return NULL; }
+uint32_t gfx_surface_generation(unsigned surface) { return 0; }
+
+// the check sprite_pos_valid did on every call
+static bool pos_valid_slow(unsigned x, unsigned y)
+{
+	return !map_tile_collides(x, y + 1) && !map_tile_collides(x, y + 2)
+		&& !map_tile_collides(x + 1, y + 1) && !map_tile_collides(x + 1, y + 2)
+		&& !map_tile_collides(x + 2, y + 1) && !map_tile_collides(x + 2, y + 2);
+}
+
+static unsigned failures = 0;
+
+static void check_tilemap(unsigned cols, unsigned rows, unsigned density)
+{
+	map.cols = cols;
+	map.rows = rows;
+	for (unsigned i = 0; i < cols * rows; i++) {
+		map.tile_data[i] = (struct map_tile) { .collides = (unsigned)(rand() % 100) < density };
+	}
+	build_valid_pos();
+
+	unsigned nr_valid = 0;
+	for (unsigned y = 0; y < rows; y++) {
+		for (unsigned x = 0; x < cols; x++) {
+			bool expected = x + 2 < cols && y + 2 < rows && pos_valid_slow(x, y);
+			if (sprite_pos_valid(x, y) != expected) {
+				fprintf(stderr, "%ux%u (%u%%): (%u,%u) is %s, expected %s\n",
+						cols, rows, density, x, y,
+						expected ? "invalid" : "valid",
+						expected ? "valid" : "invalid");
+				failures++;
+				return;
+			}
+			nr_valid += expected;
+		}
+	}
+	printf("%ux%u, %u%% blocked: %u valid positions\n", cols, rows, density, nr_valid);
+}
+
+int main(void)
+{
+	srand(1);
+	// sizes which are and aren't multiples of 8, down to a single tile
+	check_tilemap(64, 64, 0);
+	check_tilemap(64, 64, 100);
+	check_tilemap(100, 100, 10);
+	check_tilemap(37, 23, 20);
+	check_tilemap(111, 105, 5);
+	check_tilemap(3, 3, 0);
+	check_tilemap(2, 50, 0);
+	check_tilemap(1, 1, 0);
+
+	// a tilemap followed by a smaller one must not keep stale bits
+	check_tilemap(111, 105, 0);
+	check_tilemap(13, 7, 30);
+
+	if (failures) {
+		fprintf(stderr, "%u failures\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,188 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Play a short movie headless, with SDL's dummy video and audio drivers and a
+ * software renderer. The movie is written by the test: a YUV4MPEG2 video and
+ * a WAV audio track, which libavformat reads without any external codecs.
+ * It is played once at its own size (uploaded as YUV) and once scaled
+ * (converted with swscale). Playback must follow the audio clock to the end.
+ *
+ * When built with the alloc_stats option, the audio callback must not make
+ * any heap allocations during playback.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL.h>
+
+#include "nulib.h"
+#include "nulib/little_endian.h"
+
+#include "ai5.h"
+#include "alloc_stats.h"
+#include "gfx_private.h"
+#include "mixer.h"
+#include "movie.h"
+
+#define VIDEO_FILE "MOVIE.Y4M"
+#define AUDIO_FILE "MOVIE.WAV"
+#define W 64
+#define H 48
+#define FPS 25
+#define NR_FRAMES 25
+#define RATE 44100
+
+struct config config = {0};
+struct gfx gfx = {0};
+
+static unsigned failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static bool write_video(void)
+{
+	FILE *f = fopen(VIDEO_FILE, "wb");
+	if (!f)
+		return false;
+	fprintf(f, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", W, H, FPS);
+	static uint8_t planes[W * H * 3 / 2];
+	for (int i = 0; i < NR_FRAMES; i++) {
+		// a different gradient each frame
+		for (int p = 0; p < W * H * 3 / 2; p++) {
+			planes[p] = (p + i * 8) & 0xff;
+		}
+		fputs("FRAME\n", f);
+		fwrite(planes, 1, sizeof(planes), f);
+	}
+	return !ferror(f) && !fclose(f);
+}
+
+static bool write_audio(void)
+{
+	const unsigned frames = RATE * NR_FRAMES / FPS;
+	const unsigned data_size = frames * 4;
+	uint8_t *p = xcalloc(1, 44 + data_size);
+	memcpy(p, "RIFF", 4);
+	le_put32(p, 4, 36 + data_size);
+	memcpy(p + 8, "WAVEfmt ", 8);
+	le_put32(p, 16, 16);
+	le_put16(p, 20, 1); // PCM
+	le_put16(p, 22, 2);
+	le_put32(p, 24, RATE);
+	le_put32(p, 28, RATE * 4);
+	le_put16(p, 32, 4);
+	le_put16(p, 34, 16);
+	memcpy(p + 36, "data", 4);
+	le_put32(p, 40, data_size);
+	for (unsigned i = 0; i < frames; i++) {
+		le_put16(p, 44 + i * 4, (i % 100) * 64);
+		le_put16(p, 46 + i * 4, (i % 100) * 64);
+	}
+
+	FILE *f = fopen(AUDIO_FILE, "wb");
+	bool ok = f && fwrite(p, 1, 44 + data_size, f) == 44 + data_size;
+	if (f && fclose(f))
+		ok = false;
+	free(p);
+	return ok;
+}
+
+static void play(int w, int h)
+{
+	struct movie_context *mc = movie_load(VIDEO_FILE, AUDIO_FILE, w, h);
+	CHECK(mc != NULL);
+	if (!mc)
+		return;
+
+	struct movie_stats before, after;
+	movie_stats(&before);
+#ifdef ALLOC_STATS
+	struct alloc_stats allocs_before, allocs_after;
+	alloc_stats(&allocs_before);
+#endif
+	CHECK(movie_play(mc));
+	uint32_t start = SDL_GetTicks();
+	while (!movie_is_end(mc) && SDL_GetTicks() - start < 5000) {
+		movie_draw(mc);
+		SDL_Delay(5);
+	}
+	uint32_t elapsed = SDL_GetTicks() - start;
+	movie_stats(&after);
+#ifdef ALLOC_STATS
+	alloc_stats(&allocs_after);
+	unsigned long realtime_allocs = allocs_after.realtime_allocs - allocs_before.realtime_allocs;
+	printf("%dx%d: %lu heap allocations (%lu in the audio callback)\n", w, h,
+			allocs_after.allocs - allocs_before.allocs, realtime_allocs);
+	CHECK(realtime_allocs == 0);
+#endif
+	unsigned long displayed = after.frames_displayed - before.frames_displayed;
+	unsigned long dropped = after.frames_dropped - before.frames_dropped;
+
+	printf("%dx%d: %lu frames displayed, %lu dropped, %lu late, %lu audio underruns"
+			" in %u ms\n", w, h, displayed, dropped,
+			after.frames_late - before.frames_late,
+			after.audio_underruns - before.audio_underruns, elapsed);
+	CHECK(movie_is_end(mc));
+	CHECK(displayed > 0);
+	CHECK(displayed + dropped <= NR_FRAMES);
+	// the movie is timed by the audio, which the dummy driver plays in real time
+	CHECK(elapsed >= 1000 * NR_FRAMES / FPS * 9 / 10);
+	if (w == W && h == H)
+		CHECK(after.frames_converted == before.frames_converted);
+	else
+		CHECK(after.frames_converted > before.frames_converted);
+	movie_free(mc);
+}
+
+int main(void)
+{
+	setenv("SDL_VIDEODRIVER", "dummy", 1);
+	setenv("SDL_AUDIODRIVER", "dummy", 1);
+	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
+		fprintf(stderr, "SDL_Init failed: %s\n", SDL_GetError());
+		return 77;
+	}
+	SDL_Surface *target = SDL_CreateRGBSurfaceWithFormat(0, W * 2, H * 2, 32,
+			SDL_PIXELFORMAT_RGBA32);
+	if (!target || !(gfx.renderer = SDL_CreateSoftwareRenderer(target))) {
+		fprintf(stderr, "failed to create renderer: %s\n", SDL_GetError());
+		return 77;
+	}
+	mixer_init();
+
+	if (!write_video() || !write_audio()) {
+		fprintf(stderr, "failed to write movie files\n");
+		return 1;
+	}
+	play(W, H);
+	play(W * 2, H * 2);
+	remove(VIDEO_FILE);
+	remove(AUDIO_FILE);
+
+	if (failures) {
+		fprintf(stderr, "%u failures\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,151 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Check that replacing a save file is crash-safe. A child process writes a
+ * new image and dies after syncing the temporary file but before renaming it
+ * over the save file, which must then still hold the old image. A complete
+ * write must sync the file, rename it, and then sync the directory, in that
+ * order.
+ *
+ * write_save is static, so savedata.c is included directly, with rename and
+ * fsync replaced to record the order of operations and to simulate the
+ * crash. POSIX only.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+static int test_rename(const char *old_path, const char *new_path);
+static int test_fsync(int fd);
+
+#define rename test_rename
+#define fsync test_fsync
+#include "../src/savedata.c"
+#undef rename
+#undef fsync
+
+#define SAVE_FILE "SAVECRASH.DAT"
+
+struct memory memory = {0};
+struct memory_ptr memory_ptr = {0};
+struct game *game = NULL;
+
+// operations in order: F = fsync of a file, D = fsync of a directory, R = rename
+static char ops[16];
+static unsigned nr_ops = 0;
+// set in the child process to die before renaming
+static bool crash_before_rename = false;
+
+static void record(char op)
+{
+	if (nr_ops < sizeof(ops) - 1)
+		ops[nr_ops++] = op;
+}
+
+static int test_rename(const char *old_path, const char *new_path)
+{
+	if (crash_before_rename) {
+		// report whether the temporary file was synced before the "crash"
+		_exit(nr_ops == 1 && ops[0] == 'F' ? 0 : 2);
+	}
+	record('R');
+	return rename(old_path, new_path);
+}
+
+static int test_fsync(int fd)
+{
+	struct stat s;
+	if (fstat(fd, &s))
+		return -1;
+	record(S_ISDIR(s.st_mode) ? 'D' : 'F');
+	return fsync(fd);
+}
+
+// stubs for the rest of the program
+char *asset_path_icase(const char *name) { return NULL; }
+void asset_path_invalidate(const char *path) {}
+uint32_t vm_get_ticks(void) { return 0; }
+void vm_load_mes(char *name) {}
+
+static unsigned failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static bool file_equals(const char *path, const char *expected)
+{
+	char buf[64] = {0};
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return false;
+	size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	return n == strlen(expected) && !memcmp(buf, expected, n);
+}
+
+static bool save(const char *content)
+{
+	unsigned io_calls = 0;
+	nr_ops = 0;
+	memset(ops, 0, sizeof(ops));
+	return write_save(SAVE_FILE, (const uint8_t*)content, strlen(content), &io_calls);
+}
+
+int main(void)
+{
+	CHECK(save("old image"));
+	CHECK(file_equals(SAVE_FILE, "old image"));
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (pid == 0) {
+		crash_before_rename = true;
+		save("new image");
+		// not reached: test_rename exits
+		_exit(3);
+	}
+	int status;
+	CHECK(waitpid(pid, &status, 0) == pid);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	CHECK(file_equals(SAVE_FILE, "old image"));
+
+	// the temporary file left by the crash is overwritten
+	CHECK(save("new image"));
+	CHECK(file_equals(SAVE_FILE, "new image"));
+	CHECK(!strcmp(ops, "FRD"));
+	CHECK(access(SAVE_FILE ".tmp", F_OK) != 0);
+	printf("operations: %s\n", ops);
+
+	remove(SAVE_FILE);
+	remove(SAVE_FILE ".tmp");
+
+	if (failures) {
+		fprintf(stderr, "%u failures\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,150 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Check that a save file whose background write fails is not lost: the
+ * failure is counted, and the change is written by a later update once
+ * writing works again. A write that fails on the writer thread just before
+ * exit is retried when the writer shuts down.
+ *
+ * savedata.c is included directly to reach the writer shutdown, and opening
+ * files is replaced so that the test controls when writes fail.
+ */
+
+#include <stdio.h>
+
+#include "nulib/file.h"
+
+static FILE *test_file_open_utf8(const char *path, const char *mode);
+
+#define file_open_utf8 test_file_open_utf8
+#include "../src/savedata.c"
+#undef file_open_utf8
+
+#define SAVE_FILE "SAVERETRY.DAT"
+#define SAVE_SIZE 16
+
+static struct game test_game = { .mem16_size = SAVE_SIZE };
+struct game *game = &test_game;
+struct memory memory = {0};
+struct memory_ptr memory_ptr = {0};
+
+static bool fail_writes = false;
+static uint32_t ticks = 0;
+
+static FILE *test_file_open_utf8(const char *path, const char *mode)
+{
+	if (fail_writes && strchr(mode, 'w')) {
+		errno = EACCES;
+		return NULL;
+	}
+	return file_open_utf8(path, mode);
+}
+
+// stubs for the rest of the program
+char *asset_path_icase(const char *name) { return NULL; }
+void asset_path_invalidate(const char *path) {}
+uint32_t vm_get_ticks(void) { return ticks; }
+void vm_load_mes(char *name) {}
+
+static unsigned failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static bool file_starts_with(const char *path, uint8_t byte)
+{
+	uint8_t buf[SAVE_SIZE];
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return false;
+	size_t n = fread(buf, 1, sizeof(buf), f);
+	fclose(f);
+	return n == SAVE_SIZE && buf[0] == byte;
+}
+
+static void write_byte(uint8_t byte)
+{
+	uint8_t buf[SAVE_SIZE] = { byte };
+	savedata_write(SAVE_FILE, buf, 0, SAVE_SIZE);
+}
+
+// wait until the writer thread has finished `n` writes, successful or not
+static void wait_for_writes(unsigned long n)
+{
+	struct savedata_stats s;
+	for (int i = 0; i < 500; i++) {
+		savedata_stats(&s);
+		if (s.flushes + s.write_failures >= n)
+			return;
+		SDL_Delay(2);
+	}
+}
+
+int main(void)
+{
+	remove(SAVE_FILE);
+	struct savedata_stats s;
+
+	// the first write fails...
+	fail_writes = true;
+	write_byte(1);
+	ticks += SAVE_FLUSH_DELAY_MS;
+	savedata_update();
+	wait_for_writes(1);
+	savedata_stats(&s);
+	CHECK(s.write_failures == 1);
+	CHECK(s.flushes == 0);
+	CHECK(access(SAVE_FILE, F_OK) != 0);
+
+	// ...and is retried by the update after next, once the flush delay has passed again
+	fail_writes = false;
+	savedata_update();
+	CHECK(pending);
+	ticks += SAVE_FLUSH_DELAY_MS;
+	savedata_update();
+	wait_for_writes(2);
+	savedata_stats(&s);
+	CHECK(s.write_failures == 1);
+	CHECK(s.flushes == 1);
+	CHECK(file_starts_with(SAVE_FILE, 1));
+
+	// a write that fails just before exit is retried at shutdown
+	fail_writes = true;
+	write_byte(2);
+	savedata_sync();
+	wait_for_writes(3);
+	fail_writes = false;
+	save_writer_fini();
+	savedata_stats(&s);
+	CHECK(s.write_failures == 2);
+	CHECK(s.flushes == 2);
+	CHECK(file_starts_with(SAVE_FILE, 2));
+
+	printf("%lu flushes, %lu failed writes\n", s.flushes, s.write_failures);
+	remove(SAVE_FILE);
+
+	if (failures) {
+		fprintf(stderr, "%u failures\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,156 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Run a synthetic script that MESCALLs a subroutine script twice, and check
+ * that each MES file is read from the archive only once: returning from the
+ * MESCALL must reload the caller from the MES cache.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "nulib.h"
+#include "ai5/arc.h"
+#include "ai5/mes.h"
+
+#include "ai5.h"
+#include "game.h"
+#include "memory.h"
+#include "profile.h"
+#include "vm.h"
+#include "vm_private.h"
+
+#define OP_MESCALL 0x10
+
+struct config config = {0};
+bool debug_on_error = false;
+bool vm_profile_enabled = false;
+
+// MESCALL "SUB.MES"; MESCALL "SUB.MES"; end
+static const uint8_t main_mes[] = {
+	OP_MESCALL, MES_PARAM_STRING, 'S', 'U', 'B', '.', 'M', 'E', 'S', 0, 0,
+	OP_MESCALL, MES_PARAM_STRING, 'S', 'U', 'B', '.', 'M', 'E', 'S', 0, 0,
+	0
+};
+
+// end
+static const uint8_t sub_mes[] = { 0 };
+
+static unsigned main_reads = 0;
+static unsigned sub_reads = 0;
+
+static struct archive_data *mes_file(const char *name, const uint8_t *data, size_t size)
+{
+	// same shape as asset_fs_load's fake archive_data
+	struct archive_data *file = xcalloc(1, sizeof(struct archive_data));
+	file->size = size;
+	file->name = name;
+	file->data = xmalloc(size);
+	memcpy(file->data, data, size);
+	file->ref = 1;
+	file->allocated = true;
+	return file;
+}
+
+struct archive_data *asset_mes_load(const char *name)
+{
+	if (!strcasecmp(name, "MAIN.MES")) {
+		main_reads++;
+		return mes_file("MAIN.MES", main_mes, sizeof(main_mes));
+	}
+	if (!strcasecmp(name, "SUB.MES")) {
+		sub_reads++;
+		return mes_file("SUB.MES", sub_mes, sizeof(sub_mes));
+	}
+	return NULL;
+}
+
+// stubs for the rest of the program
+struct archive_data *asset_data_load(const char *name) { return NULL; }
+void asset_mes_set_name(const char *name) {}
+void asset_cg_prefetch_scan(const uint8_t *code, size_t size) {}
+void anim_execute(void) {}
+void backlog_prepare(void) {}
+void backlog_push_byte(uint8_t b) {}
+void backlog_push_bytes(const uint8_t *b, unsigned n) {}
+void bench_statement(void) {}
+uint8_t dbg_handle_breakpoint(uint32_t addr) { return 0; }
+void dbg_invalidate(uint32_t addr, size_t size) {}
+void dbg_load_file(const char *name, uint32_t addr, size_t size) {}
+void dbg_repl(void) {}
+void gfx_error_message(const char *message) {}
+void gfx_text_begin_run(unsigned i) {}
+unsigned gfx_text_draw_glyph(int x, int y, unsigned i, uint32_t ch) { return 0; }
+void gfx_text_end_run(void) {}
+void gfx_text_set_weight(int weight) {}
+void gfx_update(void) {}
+void handle_events(void) {}
+void menu_define(unsigned menu_no, bool empty) {}
+void menu_exec(void) {}
+void profile_end(enum profile_category cat, unsigned no, uint64_t start) {}
+void profile_init(void) {}
+void profile_set_mes(const char *name) {}
+uint64_t profile_start(void) { return 0; }
+void savedata_update(void) {}
+void texthook_push(const char *text) {}
+
+static struct game test_game = {0};
+static uint8_t system_var16[64];
+
+static unsigned failures = 0;
+
+#define CHECK_EQ(what, actual, expected) \
+	do { \
+		unsigned long _a = (actual), _e = (expected); \
+		if (_a != _e) { \
+			fprintf(stderr, "%s: expected %lu, got %lu\n", what, _e, _a); \
+			failures++; \
+		} \
+	} while (0)
+
+int main(void)
+{
+	test_game.stmt_op[OP_MESCALL] = vm_stmt_mescall;
+	test_game.flags[FLAG_RETURN] = 1;
+	game = &test_game;
+	memory_ptr.system_var16 = system_var16;
+
+	vm_init();
+	vm_load_mes("MAIN.MES");
+	vm_exec();
+
+	CHECK_EQ("MAIN.MES archive reads", main_reads, 1);
+	CHECK_EQ("SUB.MES archive reads", sub_reads, 1);
+	CHECK_EQ("archive reads", vm_stats.mes_loads, 2);
+	// SUB.MES the second time, MAIN.MES after each return
+	CHECK_EQ("cache hits", vm_stats.mes_cache_hits, 3);
+	CHECK_EQ("statements", vm_stats.statements, 2);
+	if (strcmp(mem_mes_name(), "MAIN.MES")) {
+		fprintf(stderr, "current MES: expected MAIN.MES, got %s\n", mem_mes_name());
+		failures++;
+	}
+	if (memcmp(memory.file_data, main_mes, sizeof(main_mes))) {
+		fprintf(stderr, "MAIN.MES was not restored after return\n");
+		failures++;
+	}
+
+	if (failures) {
+		fprintf(stderr, "%u failures\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,197 @@
+/* Copyright (C) 2024 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Run a synthetic script made of zenkaku (TXT) and hankaku text statements,
+ * once with text logging disabled and once with it enabled, and print the
+ * rate at which the VM reads text in each mode. Every text byte must be
+ * counted, every string must reach the text hook intact, and with logging
+ * enabled the backlog must receive exactly the bytes of the script.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <SDL.h>
+
+#include "nulib.h"
+#include "ai5/arc.h"
+#include "ai5/game.h"
+#include "ai5/mes.h"
+
+#include "ai5.h"
+#include "game.h"
+#include "memory.h"
+#include "profile.h"
+#include "vm.h"
+#include "vm_private.h"
+
+#define OP_TXT 0x01
+#define NR_STATEMENTS 2000
+#define NR_RUNS 50
+
+struct config config = {0};
+bool debug_on_error = false;
+bool vm_profile_enabled = false;
+
+static uint8_t *text_mes;
+static size_t text_mes_size;
+// text bytes in the script, including terminators but not opcodes
+static unsigned long text_size;
+// length of all strings passed to the text hook in one run
+static unsigned long text_len;
+
+static unsigned long backlog_bytes = 0;
+static unsigned long hook_bytes = 0;
+
+// TXT statements with zenkaku text alternating with bare hankaku text
+static void build_script(void)
+{
+	text_mes = xmalloc(NR_STATEMENTS * 80 + 1);
+	size_t n = 0;
+	for (int i = 0; i < NR_STATEMENTS; i++) {
+		size_t start;
+		if (i % 2) {
+			start = n;
+			for (int j = 0; j < 30 + i % 23; j++) {
+				text_mes[n++] = 'a' + (i + j) % 26;
+			}
+		} else {
+			text_mes[n++] = OP_TXT;
+			start = n;
+			for (int j = 0; j < 20 + i % 17; j++) {
+				text_mes[n++] = 0x82;
+				text_mes[n++] = 0xa0 + j % 64;
+			}
+		}
+		text_len += n - start;
+		text_mes[n++] = 0;
+		text_size += n - start;
+	}
+	text_mes[n++] = 0;
+	text_mes_size = n;
+}
+
+struct archive_data *asset_mes_load(const char *name)
+{
+	// same shape as asset_fs_load's fake archive_data
+	struct archive_data *file = xcalloc(1, sizeof(struct archive_data));
+	file->size = text_mes_size;
+	file->name = "TEXT.MES";
+	file->data = xmalloc(text_mes_size);
+	memcpy(file->data, text_mes, text_mes_size);
+	file->ref = 1;
+	file->allocated = true;
+	return file;
+}
+
+void backlog_push_byte(uint8_t b) { backlog_bytes++; }
+void backlog_push_bytes(const uint8_t *b, unsigned n) { backlog_bytes += n; }
+void texthook_push(const char *text) { hook_bytes += strlen(text); }
+static void draw_text(const char *text) {}
+
+// stubs for the rest of the program
+struct archive_data *asset_data_load(const char *name) { return NULL; }
+void asset_mes_set_name(const char *name) {}
+void asset_cg_prefetch_scan(const uint8_t *code, size_t size) {}
+void anim_execute(void) {}
+void backlog_prepare(void) {}
+void bench_statement(void) {}
+uint8_t dbg_handle_breakpoint(uint32_t addr) { return 0; }
+void dbg_invalidate(uint32_t addr, size_t size) {}
+void dbg_load_file(const char *name, uint32_t addr, size_t size) {}
+void dbg_repl(void) {}
+void gfx_error_message(const char *message) {}
+void gfx_text_begin_run(unsigned i) {}
+unsigned gfx_text_draw_glyph(int x, int y, unsigned i, uint32_t ch) { return 0; }
+void gfx_text_end_run(void) {}
+void gfx_text_set_weight(int weight) {}
+void gfx_update(void) {}
+void handle_events(void) {}
+void menu_define(unsigned menu_no, bool empty) {}
+void menu_exec(void) {}
+void profile_end(enum profile_category cat, unsigned no, uint64_t start) {}
+void profile_init(void) {}
+void profile_set_mes(const char *name) {}
+uint64_t profile_start(void) { return 0; }
+void savedata_update(void) {}
+
+static struct game test_game = {0};
+static uint8_t system_var16[64];
+
+static unsigned failures = 0;
+
+#define CHECK_EQ(what, actual, expected) \
+	do { \
+		unsigned long _a = (actual), _e = (expected); \
+		if (_a != _e) { \
+			fprintf(stderr, "%s: expected %lu, got %lu\n", what, _e, _a); \
+			failures++; \
+		} \
+	} while (0)
+
+static void run(bool logged)
+{
+	mem_set_sysvar16(MES_SYS_VAR_FLAGS, logged ? 2 | 4 : 0);
+	backlog_bytes = 0;
+	hook_bytes = 0;
+	unsigned long long bytes_before = vm_stats.text_bytes[logged];
+	for (int i = 0; i < NR_RUNS; i++) {
+		// as in MESJMP: the VM restarts at the top of the loaded file
+		vm_load_mes("TEXT.MES");
+		vm_flag_on(FLAG_RETURN);
+		vm_exec();
+	}
+
+	unsigned long long bytes = vm_stats.text_bytes[logged] - bytes_before;
+	CHECK_EQ(logged ? "logged text bytes" : "text bytes", bytes, text_size * NR_RUNS);
+	CHECK_EQ("text hook bytes", hook_bytes, text_len * NR_RUNS);
+	// each TXT statement also logs its opcode
+	CHECK_EQ("backlog bytes", backlog_bytes,
+			logged ? (text_size + NR_STATEMENTS / 2) * NR_RUNS : 0);
+
+	double secs = (double)vm_stats.text_ticks[logged] / SDL_GetPerformanceFrequency();
+	printf("%s: %llu text bytes, %.1f MB/s\n", logged ? "logged" : "unlogged",
+			vm_stats.text_bytes[logged],
+			secs > 0 ? vm_stats.text_bytes[logged] / secs / 1000000.0 : 0);
+}
+
+int main(void)
+{
+	// text reading is only timed in bench mode
+	config.bench = true;
+	ai5_set_game("yuno");
+	test_game.stmt_op[OP_TXT] = vm_stmt_txt;
+	test_game.draw_text_zen = draw_text;
+	test_game.draw_text_han = draw_text;
+	test_game.flags[FLAG_RETURN] = 1;
+	test_game.flags[FLAG_LOG_ENABLE] = 2;
+	test_game.flags[FLAG_LOG_TEXT] = 4;
+	test_game.flags[FLAG_LOG] = 8;
+	game = &test_game;
+	memory_ptr.system_var16 = system_var16;
+
+	build_script();
+	vm_init();
+	run(false);
+	run(true);
+	free(text_mes);
+
+	if (failures) {
+		fprintf(stderr, "%u failures\n", failures);
+		return 1;
+	}
+	return 0;
+}